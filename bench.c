@@ -0,0 +1,434 @@
+#include <pthread.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <stdint.h>
+
+#include "tqueue.h"
+
+// sweeps scenarios x engines x publishers x subscribers x queue sizes x
+// payload sizes and prints one CSV line per run with throughput and
+// put-to-get latency percentiles
+
+#define MAX_LIST 16
+#define MAX_THREADS 256
+
+#define DEFAULT_MESSAGES 100000
+#define HANDOFF_SPIN 1000
+#define SLOW_NS 1000
+#define CHURN_SET_SIZE 8
+
+// log-linear histogram, values below HIST_SUB are exact, above that every
+// power of two is split into HIST_SUB buckets (about 3% precision)
+#define HIST_SUB_BITS 5
+#define HIST_SUB (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS ((64 - HIST_SUB_BITS + 1) * HIST_SUB)
+
+enum scenario {
+	BLOCKING,
+	HANDOFF,
+	SLOW,
+	CHURN,
+	GROUP,
+	SCENARIOS
+};
+
+static const char *scenario_names[SCENARIOS] =
+	{ "blocking", "handoff", "slow", "churn", "group" };
+static const char *engine_names[] = { "locked", "lockfree" };
+
+typedef struct histogram {
+	unsigned long long count;
+	unsigned long long max;
+	unsigned long long buckets[HIST_BUCKETS];
+} histogram;
+
+typedef struct run {
+	TQueue queue;
+	enum scenario scenario;
+	int engine;
+	int publishers;
+	int subscribers;
+	int size;
+	int payload;
+	int messages;
+	int spin;
+	int done;
+	int started;
+	pthread_mutex_t start_lock;
+	pthread_cond_t start_cond;
+	TQueueSubscription *handles[MAX_THREADS];
+} run;
+
+typedef struct subscriber_data {
+	run *run;
+	int id;
+	unsigned long long received;
+	unsigned long long last;
+	histogram hist;
+} subscriber_data;
+
+typedef struct list {
+	int values[MAX_LIST];
+	int n;
+} list;
+
+unsigned long long now_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+unsigned hist_index(unsigned long long v) {
+	int shift;
+
+	if (v < HIST_SUB)
+		return (unsigned)v;
+	shift = 63 - __builtin_clzll(v) - HIST_SUB_BITS;
+	return (unsigned)((shift + 1) * HIST_SUB + (v >> shift) - HIST_SUB);
+}
+
+unsigned long long hist_value(unsigned i) {
+	if (i < HIST_SUB)
+		return i;
+	return (unsigned long long)(i % HIST_SUB + HIST_SUB) << (i / HIST_SUB -
+															 1);
+}
+
+void hist_add(histogram * hist, unsigned long long v) {
+	++hist->buckets[hist_index(v)];
+	++hist->count;
+	if (v > hist->max)
+		hist->max = v;
+}
+
+void hist_merge(histogram * to, histogram * from) {
+	for (int i = 0; i < HIST_BUCKETS; ++i)
+		to->buckets[i] += from->buckets[i];
+	to->count += from->count;
+	if (from->max > to->max)
+		to->max = from->max;
+}
+
+unsigned long long hist_percentile(histogram * hist, double p) {
+	unsigned long long rank = (unsigned long long)(p * hist->count);
+	unsigned long long seen = 0;
+
+	if (rank >= hist->count)
+		return hist->max;
+	for (int i = 0; i < HIST_BUCKETS; ++i) {
+		seen += hist->buckets[i];
+		if (seen > rank)
+			return hist_value(i);
+	}
+	return hist->max;
+}
+
+void wait_start(run * r) {
+	pthread_mutex_lock(&r->start_lock);
+	while (!r->started)
+		pthread_cond_wait(&r->start_cond, &r->start_lock);
+	pthread_mutex_unlock(&r->start_lock);
+}
+
+// the message is its put timestamp, carried in the pointer itself or,
+// on typed queues, in the first bytes of the payload
+void *publisher(void *arg) {
+	run *r = arg;
+	char *value = calloc(1, r->payload ? r->payload : 1);
+	unsigned long long ts;
+
+	wait_start(r);
+	for (int i = 0; i < r->messages; ++i) {
+		ts = now_ns();
+		if (r->payload) {
+			memcpy(value, &ts, sizeof(ts));
+			if (TQueuePut(&r->queue, value) == -1)
+				break;
+		} else if (TQueuePut(&r->queue, (void *)(uintptr_t)ts) == -1)
+			break;
+	}
+
+	free(value);
+	return NULL;
+}
+
+void *subscriber(void *arg) {
+	subscriber_data *data = arg;
+	run *r = data->run;
+	TQueueSubscription *handle = r->handles[data->id];
+	char *value = malloc(r->payload ? r->payload : 1);
+	unsigned long long ts, t;
+	void *msg;
+
+	while (1) {
+		if (r->payload) {
+			if (TQueueGetValueHandle(&r->queue, handle, value))
+				break;
+			memcpy(&ts, value, sizeof(ts));
+		} else {
+			msg = TQueueGetHandle(&r->queue, handle);
+			if (msg == NULL)
+				break;
+			ts = (uintptr_t)msg;
+		}
+		t = now_ns();
+		hist_add(&data->hist, t > ts ? t - ts : 0);
+		++data->received;
+		data->last = t;
+
+		// the first subscriber lags behind the others
+		if (r->scenario == SLOW && data->id == 0)
+			while (now_ns() - t < SLOW_NS) ;
+	}
+
+	free(value);
+	return NULL;
+}
+
+// removes a message which is not on the queue, so every call scans it,
+// and resizes the queue between its size and half of it
+void *churn(void *arg) {
+	run *r = arg;
+	char *value = calloc(1, r->payload ? r->payload : 1);
+	int size;
+
+	wait_start(r);
+	for (int i = 0; !__atomic_load_n(&r->done, __ATOMIC_RELAXED); ++i) {
+		if (TQueueRemoveMsg(&r->queue, r->payload ? value : NULL) == -1)
+			break;
+		if (i % CHURN_SET_SIZE)
+			continue;
+		size = i / CHURN_SET_SIZE % 2 ? r->size : (r->size + 1) / 2;
+		if (TQueueSetSize(&r->queue, &size) == -1)
+			break;
+	}
+
+	free(value);
+	return NULL;
+}
+
+// a message claimed by a member of a group is not available to the
+// others, but it stays in the queue until the member has read it
+int drained(run * r) {
+	if (r->scenario == GROUP)
+		return TQueuePeekSize(&r->queue) == 0;
+	for (int i = 0; i < r->subscribers; ++i)
+		if (TQueueGetAvailableHandle(&r->queue, r->handles[i]) > 0)
+			return 0;
+	return 1;
+}
+
+void bench(run * r) {
+	pthread_t threads[2 * MAX_THREADS + 1];
+	subscriber_data *subs = calloc(r->subscribers, sizeof(subscriber_data));
+	histogram *hist = calloc(1, sizeof(histogram));
+	unsigned long long start, end, received = 0;
+	int hashmap_size = r->subscribers, spin = r->spin;
+	int elem_size = r->payload;
+	double seconds;
+	int n = 0;
+
+	if (r->payload)
+		TQueueCreateQueueTyped(&r->queue, &r->size, &elem_size);
+	else
+		TQueueCreateQueueEngine(&r->queue, &r->size, &hashmap_size,
+								r->engine);
+	if (r->scenario == HANDOFF)
+		TQueueSetSpin(&r->queue, &spin);
+	r->done = 0;
+	r->started = 0;
+	pthread_mutex_init(&r->start_lock, NULL);
+	pthread_cond_init(&r->start_cond, NULL);
+
+	// everyone is subscribed before the first message is put, in a group
+	// each message is read by only one of them
+	for (int i = 0; i < r->subscribers; ++i) {
+		if (r->scenario == GROUP)
+			r->handles[i] = TQueueSubscribeGroupHandle(&r->queue, "bench");
+		else
+			r->handles[i] = TQueueSubscribeHandle(&r->queue);
+		subs[i].run = r;
+		subs[i].id = i;
+		pthread_create(&threads[n++], NULL, subscriber, &subs[i]);
+	}
+	for (int i = 0; i < r->publishers; ++i)
+		pthread_create(&threads[n++], NULL, publisher, r);
+	if (r->scenario == CHURN)
+		pthread_create(&threads[n++], NULL, churn, r);
+
+	pthread_mutex_lock(&r->start_lock);
+	r->started = 1;
+	start = now_ns();
+	pthread_cond_broadcast(&r->start_cond);
+	pthread_mutex_unlock(&r->start_lock);
+
+	for (int i = r->subscribers; i < r->subscribers + r->publishers; ++i)
+		pthread_join(threads[i], NULL);
+	__atomic_store_n(&r->done, 1, __ATOMIC_RELAXED);
+	if (r->scenario == CHURN)
+		pthread_join(threads[n - 1], NULL);
+	while (!drained(r))
+		usleep(100);
+	end = start;
+
+	TQueueDestroyQueue_1(&r->queue);
+	for (int i = 0; i < r->subscribers; ++i) {
+		pthread_join(threads[i], NULL);
+		hist_merge(hist, &subs[i].hist);
+		received += subs[i].received;
+		if (subs[i].last > end)
+			end = subs[i].last;
+	}
+	TQueueDestroyQueue_2(&r->queue);
+	pthread_mutex_destroy(&r->start_lock);
+	pthread_cond_destroy(&r->start_cond);
+
+	// measured up to the last message read, not to the drain check
+	seconds = (end > start ? end - start : 1) / 1e9;
+	printf("%s,%s,%d,%d,%d,%d,%llu,%llu,%.6f,%.0f,%.0f,%llu,%llu,%llu,%llu\n",
+		   scenario_names[r->scenario], engine_names[r->engine],
+		   r->publishers, r->subscribers, r->size, r->payload,
+		   (unsigned long long)r->publishers * r->messages, received,
+		   seconds, r->publishers * r->messages / seconds,
+		   received / seconds, hist_percentile(hist, 0.5),
+		   hist_percentile(hist, 0.99), hist_percentile(hist, 0.999),
+		   hist->max);
+	fflush(stdout);
+
+	free(hist);
+	free(subs);
+}
+
+int parse_list(list * l, char *arg, const char **names, int n_names) {
+	char *tok;
+
+	l->n = 0;
+	for (tok = strtok(arg, ","); tok != NULL; tok = strtok(NULL, ",")) {
+		if (l->n == MAX_LIST)
+			return -1;
+		if (names == NULL) {
+			l->values[l->n] = atoi(tok);
+			if (l->values[l->n] < 0)
+				return -1;
+		} else {
+			l->values[l->n] = -1;
+			for (int i = 0; i < n_names; ++i)
+				if (!strcmp(tok, names[i]))
+					l->values[l->n] = i;
+			if (l->values[l->n] == -1)
+				return -1;
+		}
+		++l->n;
+	}
+	return l->n ? 0 : -1;
+}
+
+void usage(const char *name) {
+	fprintf(stderr,
+			"usage: %s [-S scenarios] [-e engines] [-p publishers]"
+			" [-s subscribers] [-q sizes] [-b payloads] [-n messages]"
+			" [-w spin]\n"
+			"lists are comma separated, scenarios are blocking, handoff,"
+			" slow, churn and\ngroup, engines are locked and lockfree, a payload"
+			" of 0 passes pointers, a larger one\nuses a typed queue,"
+			" messages are counted per publisher, handoff runs spin\n"
+			"for spin iterations (%d by default)\n", name, HANDOFF_SPIN);
+	exit(1);
+}
+
+int main(int argc, char **argv) {
+	list scenarios = { {BLOCKING, HANDOFF, SLOW, CHURN, GROUP}, SCENARIOS };
+	list engines = { {TQUEUE_ENGINE_LOCKED, TQUEUE_ENGINE_LOCKFREE}, 2 };
+	list publishers = { {1, 4}, 2 };
+	list subscribers = { {1, 4}, 2 };
+	list sizes = { {64}, 1 };
+	list payloads = { {0, 64}, 2 };
+	int messages = DEFAULT_MESSAGES;
+	int spin = HANDOFF_SPIN;
+	int ret = 0;
+	int opt;
+	run *r = calloc(1, sizeof(run));
+
+	while ((opt = getopt(argc, argv, "S:e:p:s:q:b:n:w:")) != -1) {
+		switch (opt) {
+		case 'S':
+			ret = parse_list(&scenarios, optarg, scenario_names, SCENARIOS);
+			break;
+		case 'e':
+			ret = parse_list(&engines, optarg, engine_names, 2);
+			break;
+		case 'p':
+			ret = parse_list(&publishers, optarg, NULL, 0);
+			break;
+		case 's':
+			ret = parse_list(&subscribers, optarg, NULL, 0);
+			break;
+		case 'q':
+			ret = parse_list(&sizes, optarg, NULL, 0);
+			break;
+		case 'b':
+			ret = parse_list(&payloads, optarg, NULL, 0);
+			break;
+		case 'n':
+			messages = atoi(optarg);
+			break;
+		case 'w':
+			spin = atoi(optarg);
+			break;
+		default:
+			usage(argv[0]);
+		}
+		if (ret)
+			usage(argv[0]);
+	}
+
+	printf("scenario,engine,publishers,subscribers,size,payload,messages,"
+		   "received,seconds,put_per_s,get_per_s,p50_ns,p99_ns,p999_ns,"
+		   "max_ns\n");
+
+	for (int a = 0; a < scenarios.n; ++a)
+		for (int b = 0; b < engines.n; ++b)
+			for (int c = 0; c < publishers.n; ++c)
+				for (int d = 0; d < subscribers.n; ++d)
+					for (int e = 0; e < sizes.n; ++e)
+						for (int f = 0; f < payloads.n; ++f) {
+							r->scenario = scenarios.values[a];
+							r->engine = engines.values[b];
+							r->publishers = publishers.values[c];
+							r->subscribers = subscribers.values[d];
+							r->size = sizes.values[e];
+							r->payload = payloads.values[f];
+							r->messages = messages;
+							r->spin = spin;
+
+							// hot handoff always goes through a single slot
+							if (r->scenario == HANDOFF) {
+								if (e)
+									continue;
+								r->size = 1;
+							}
+							// typed queues, TQueueRemoveMsg,
+							// TQueueSetSize and groups are not
+							// supported lock-free
+							if (r->engine == TQUEUE_ENGINE_LOCKFREE
+								&& (r->payload || r->scenario == CHURN
+									|| r->scenario == GROUP))
+								continue;
+							if (r->publishers < 1 || r->subscribers < 1
+								|| r->publishers > MAX_THREADS
+								|| r->subscribers > MAX_THREADS
+								|| r->size < 1)
+								continue;
+							if (r->payload
+								&& r->payload < (int)sizeof(long long))
+								r->payload = sizeof(long long);
+							bench(r);
+						}
+
+	free(r);
+
+	return 0;
+}
@@ -0,0 +1,1130 @@
+#include <assert.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "tqueue.h"
+
+// test_sizes needs mallocs which do not fit to fail instead of aborting
+// when the tests are built with the address sanitizer
+const char *__asan_default_options(void) {
+	return "allocator_may_return_null=1";
+}
+
+// a waiter which tries its get again when it is woken, as the C++
+// awaitables do
+typedef struct retry_waiter {
+	TQueueWaiter waiter;
+	TQueue *tqueue;
+	TQueueSubscription *subscription;
+	void *msg;
+	int woken;
+	int status;
+} retry_waiter;
+
+void retry_wake(TQueueWaiter * waiter) {
+	retry_waiter *retry = (retry_waiter *) waiter;
+
+	++retry->woken;
+	retry->status = TQueueGetAsync(retry->tqueue, retry->subscription,
+								   &retry->msg, &retry->waiter);
+}
+
+// destroying the queue wakes the waiters after the subscriptions have
+// been freed, their get has to find the queue destroyed
+void test_async_destroy(void) {
+	TQueue tqueue;
+	int size = 4;
+	retry_waiter retry = { {retry_wake, NULL, NULL}, &tqueue, NULL, NULL, 0, 0 };
+
+	TQueueCreateQueue(&tqueue, &size);
+	retry.subscription = TQueueSubscribeHandle(&tqueue);
+	assert(retry.subscription != NULL);
+	assert(TQueueGetAsync(&tqueue, retry.subscription, &retry.msg,
+						  &retry.waiter) == -4);
+	assert(TQueueDestroyQueue(&tqueue) == 0);
+	assert(retry.woken == 1);
+	assert(retry.status == -1);
+	printf("async destroy: ok\n");
+}
+
+// values of a shared queue are copied with their own size, which is
+// smaller than the slots they are kept in
+void test_shared_elem_size(void) {
+	TQueueShared tqueue;
+	char name[64];
+	int size = 4;
+	int elem_size = 5;
+	int subscribers = 1;
+	char *in = malloc(5);
+	char *out = malloc(5);
+
+	snprintf(name, sizeof(name), "/tqueue_test_%d", (int)getpid());
+	assert(TQueueCreateShared(&tqueue, name, &size, &elem_size,
+							  &subscribers) == 0);
+	assert(TQueueSharedSubscribe(&tqueue, 1) == 0);
+	memcpy(in, "abcde", 5);
+	assert(TQueueSharedPut(&tqueue, in) == 0);
+	assert(TQueueSharedGet(&tqueue, 1, out) == 0);
+	assert(memcmp(out, "abcde", 5) == 0);
+	assert(TQueueDestroyShared(&tqueue) == 0);
+	TQueueDetachShared(&tqueue);
+	free(in);
+	free(out);
+	printf("shared elem size: ok\n");
+}
+
+// operations of other threads keep going until they find the sharded
+// queue destroyed, its shards are not freed under them
+TQueueSharded sharded;
+
+void *sharded_reader(void *arg) {
+	pthread_t self = pthread_self();
+	void *msg;
+
+	TQueueShardedSubscribe(&sharded, &self);
+	while (TQueueShardedTryGet(&sharded, &self, &msg) != -1) ;
+	return arg;
+}
+
+void *sharded_writer(void *arg) {
+	unsigned long long key = 0;
+
+	while (TQueueShardedPut(&sharded, key++, arg) != -1) ;
+	return arg;
+}
+
+void test_sharded_destroy(void) {
+	pthread_t threads[4];
+	int shards = 4;
+	int size = 16;
+
+	for (int round = 0; round < 20; ++round) {
+		TQueueCreateSharded(&sharded, &shards, &size);
+		pthread_create(&threads[0], NULL, sharded_reader, NULL);
+		pthread_create(&threads[1], NULL, sharded_reader, NULL);
+		pthread_create(&threads[2], NULL, sharded_writer, &sharded);
+		pthread_create(&threads[3], NULL, sharded_writer, &sharded);
+		usleep(1000);
+		assert(TQueueDestroySharded(&sharded) == 0);
+		assert(TQueueDestroySharded(&sharded) == -1);
+		for (int i = 0; i < 4; ++i)
+			pthread_join(threads[i], NULL);
+	}
+	printf("sharded destroy: ok\n");
+}
+
+// a subscription failing on one shard is undone on the shards before it
+void test_sharded_subscribe(void) {
+	TQueueSharded tqueue;
+	pthread_t thread = pthread_self();
+	int shards = 3;
+	int size = 4;
+
+	TQueueCreateSharded(&tqueue, &shards, &size);
+	assert(TQueueSubscribe(tqueue.shards[2], &thread) == 0);
+	assert(TQueueShardedSubscribe(&tqueue, &thread) == -2);
+	assert(TQueueUnsubscribe(tqueue.shards[0], &thread) == -2);
+	assert(TQueueUnsubscribe(tqueue.shards[1], &thread) == -2);
+	assert(TQueueUnsubscribe(tqueue.shards[2], &thread) == 0);
+	assert(TQueueShardedSubscribe(&tqueue, &thread) == 0);
+	assert(TQueueShardedUnsubscribe(&tqueue, &thread) == 0);
+	assert(TQueueDestroySharded(&tqueue) == 0);
+	printf("sharded subscribe: ok\n");
+}
+
+void noop_put(void *slot, void *msg) {
+	(void)slot;
+	(void)msg;
+}
+
+// a typed queue or a queue of values which cannot be created is
+// reported instead of being left half made
+void test_values_create(void) {
+	TQueueValueOps ops = { noop_put, NULL, NULL, NULL, NULL };
+	TQueue tqueue;
+	int size = 4;
+	int elem_size = -1;
+
+	assert(TQueueCreateQueueTyped(&tqueue, &size, &elem_size) == -2);
+	elem_size = 0;
+	assert(TQueueCreateQueueTyped(&tqueue, &size, &elem_size) == -2);
+	assert(TQueueCreateQueueValues(&tqueue, &size, &elem_size, &ops) == -2);
+	elem_size = 8;
+	assert(TQueueCreateQueueValues(&tqueue, &size, &elem_size, NULL) == -2);
+	assert(TQueueCreateQueueValues(&tqueue, &size, &elem_size, &ops) == 0);
+	assert(TQueueDestroyQueue(&tqueue) == 0);
+	printf("values create: ok\n");
+}
+
+// sizes below 1 are taken as 1 instead of wrapping around to a ring
+// which cannot be sized, and the ring of the largest size is allocated
+// as far as it can be, on both engines
+void test_sizes(void) {
+	TQueue tqueue;
+	int size = -1;
+	int hashmap_size = 4;
+	pthread_t a = 1;
+	void *msg;
+
+	TQueueCreateQueue(&tqueue, &size);
+	assert(TQueuePeekMaxSize(&tqueue) == 1);
+	assert(TQueueSubscribe(&tqueue, &a) == 0);
+	assert(TQueueTryPut(&tqueue, (void *)1) == 0);
+	assert(TQueueTryPut(&tqueue, (void *)2) == -4);
+	size = 0;
+	assert(TQueueSetSize(&tqueue, &size) == 0);
+	assert(TQueuePeekMaxSize(&tqueue) == 1);
+	assert(TQueueTryGet(&tqueue, &a, &msg) == 0 && msg == (void *)1);
+	assert(TQueueDestroyQueue(&tqueue) == 0);
+
+	size = INT_MAX;
+	TQueueCreateQueue(&tqueue, &size);
+	assert(TQueueSubscribe(&tqueue, &a) == 0);
+	for (long i = 1; i <= 100; ++i)
+		assert(TQueueTryPut(&tqueue, (void *)i) == 0);
+	for (long i = 1; i <= 100; ++i)
+		assert(TQueueTryGet(&tqueue, &a, &msg) == 0 && msg == (void *)i);
+	size = -1;
+	assert(TQueueSetSize(&tqueue, &size) == 0);
+	size = INT_MAX;
+	assert(TQueueSetSize(&tqueue, &size) == 0);
+	assert(TQueueTryPut(&tqueue, (void *)1) == 0);
+	assert(TQueueDestroyQueue(&tqueue) == 0);
+
+	TQueueCreateQueueEngine(&tqueue, &size, &hashmap_size,
+							TQUEUE_ENGINE_LOCKFREE);
+	assert(TQueuePeekMaxSize(&tqueue) >= 1);
+	assert(TQueueSubscribe(&tqueue, &a) == 0);
+	assert(TQueueTryPut(&tqueue, (void *)1) == 0);
+	assert(TQueueTryGet(&tqueue, &a, &msg) == 0 && msg == (void *)1);
+	assert(TQueueDestroyQueue(&tqueue) == 0);
+	printf("sizes: ok\n");
+}
+
+// peeks read the queue without its mutex while a lock-free queue is
+// being destroyed, they find it destroyed
+void *peeker(void *arg) {
+	while (TQueuePeekMaxSize(arg) != -1) ;
+	return arg;
+}
+
+void test_lockfree_peek_destroy(void) {
+	TQueue tqueue;
+	pthread_t thread;
+	int size = 4;
+	int hashmap_size = 4;
+
+	TQueueCreateQueueEngine(&tqueue, &size, &hashmap_size,
+							TQUEUE_ENGINE_LOCKFREE);
+	pthread_create(&thread, NULL, peeker, &tqueue);
+	usleep(1000);
+	assert(TQueueDestroyQueue_1(&tqueue) == 0);
+	pthread_join(thread, NULL);
+	TQueueDestroyQueue_2(&tqueue);
+	printf("lock-free peek destroy: ok\n");
+}
+
+// publishers, one of them putting batches, and subscribers, some reading
+// batches through handles, share a lock-free queue which wraps around
+// many times, every subscriber sees every message in publishing order
+#define LOCKFREE_PUBLISHERS 3
+#define LOCKFREE_SUBSCRIBERS 4
+#define LOCKFREE_MESSAGES 5000
+
+TQueue lockfree;
+pthread_t lockfree_ids[LOCKFREE_SUBSCRIBERS];
+TQueueSubscription *lockfree_handles[LOCKFREE_SUBSCRIBERS];
+
+// messages carry the publisher in the high bits and the sequence number,
+// from one so that none is NULL, in the low ones
+void *lockfree_msg(long publisher, long seq) {
+	return (void *)(publisher << 20 | (seq + 1));
+}
+
+void *lockfree_publisher(void *arg) {
+	long publisher = (long)arg;
+	void *msgs[3];
+	long seq = 0;
+
+	if (publisher != 0) {
+		for (; seq < LOCKFREE_MESSAGES; ++seq)
+			assert(TQueuePut(&lockfree, lockfree_msg(publisher, seq)) == 0);
+		return arg;
+	}
+	while (seq < LOCKFREE_MESSAGES) {
+		int n = 0;
+		int put;
+
+		for (; n < 3 && seq + n < LOCKFREE_MESSAGES; ++n)
+			msgs[n] = lockfree_msg(publisher, seq + n);
+		put = TQueuePutBatch(&lockfree, msgs, n);
+		assert(put > 0 && put <= n);
+		seq += put;
+	}
+	return arg;
+}
+
+void *lockfree_subscriber(void *arg) {
+	long subscriber = (long)arg;
+	long next[LOCKFREE_PUBLISHERS] = { 0 };
+	void *msgs[5];
+
+	for (long seen = 0; seen < LOCKFREE_PUBLISHERS * LOCKFREE_MESSAGES;) {
+		int n = 1;
+
+		if (lockfree_handles[subscriber] != NULL)
+			n = TQueueGetBatchHandle(&lockfree, lockfree_handles[subscriber],
+									 msgs, 5);
+		else
+			msgs[0] = TQueueGet(&lockfree, &lockfree_ids[subscriber]);
+		assert(n > 0 && msgs[0] != NULL);
+		for (int i = 0; i < n; ++i) {
+			long publisher = (long)msgs[i] >> 20;
+			long seq = ((long)msgs[i] & ((1 << 20) - 1)) - 1;
+
+			assert(publisher < LOCKFREE_PUBLISHERS);
+			assert(seq == next[publisher]);
+			++next[publisher];
+		}
+		seen += n;
+	}
+	return arg;
+}
+
+void test_lockfree_order(void) {
+	pthread_t publishers[LOCKFREE_PUBLISHERS];
+	pthread_t subscribers[LOCKFREE_SUBSCRIBERS];
+	int size = 4;
+	int hashmap_size = 4;
+
+	TQueueCreateQueueEngine(&lockfree, &size, &hashmap_size,
+							TQUEUE_ENGINE_LOCKFREE);
+	for (long i = 0; i < LOCKFREE_SUBSCRIBERS; ++i) {
+		if (i % 2) {
+			lockfree_handles[i] = TQueueSubscribeHandle(&lockfree);
+			assert(lockfree_handles[i] != NULL);
+		} else {
+			lockfree_ids[i] = i + 1;
+			assert(TQueueSubscribe(&lockfree, &lockfree_ids[i]) == 0);
+		}
+	}
+	for (long i = 0; i < LOCKFREE_SUBSCRIBERS; ++i)
+		pthread_create(&subscribers[i], NULL, lockfree_subscriber, (void *)i);
+	for (long i = 0; i < LOCKFREE_PUBLISHERS; ++i)
+		pthread_create(&publishers[i], NULL, lockfree_publisher, (void *)i);
+	for (int i = 0; i < LOCKFREE_PUBLISHERS; ++i)
+		pthread_join(publishers[i], NULL);
+	for (int i = 0; i < LOCKFREE_SUBSCRIBERS; ++i)
+		pthread_join(subscribers[i], NULL);
+
+	for (int i = 0; i < LOCKFREE_SUBSCRIBERS; ++i)
+		if (lockfree_handles[i] != NULL)
+			assert(TQueueGetAvailableHandle(&lockfree, lockfree_handles[i])
+				   == 0);
+		else
+			assert(TQueueGetAvailable(&lockfree, &lockfree_ids[i]) == 0);
+	assert(TQueueDestroyQueue(&lockfree) == 0);
+	printf("lock-free order: ok\n");
+}
+
+// publishers rotating segments on every put while another one flushes
+// the journal keep every value in it
+TQueue journaled;
+
+void *journal_writer(void *arg) {
+	for (long long value = 0; value < 2000; ++value)
+		assert(TQueuePut(&journaled, &value) == 0);
+	return arg;
+}
+
+void test_journal_rotate(void) {
+	pthread_t threads[3];
+	char path[64];
+	int size = 16;
+	int elem_size = sizeof(long long);
+	int segment_size = 1;
+	int segments = 2;
+	int sync = 1;
+
+	snprintf(path, sizeof(path), "/tmp/tqueue_test_%d", (int)getpid());
+	TQueueCreateQueueTyped(&journaled, &size, &elem_size);
+	assert(TQueueOpenJournal(&journaled, path, &segment_size, &segments,
+							 &sync) == 0);
+	for (int i = 0; i < 3; ++i)
+		pthread_create(&threads[i], NULL, journal_writer, NULL);
+	for (int i = 0; i < 3; ++i)
+		pthread_join(threads[i], NULL);
+	assert(TQueueDestroyQueue(&journaled) == 0);
+
+	// the journal is opened again where it ended, then removed
+	TQueueCreateQueueTyped(&journaled, &size, &elem_size);
+	assert(TQueueOpenJournal(&journaled, path, &segment_size, &segments,
+							 &sync) == 0);
+	assert(journaled.tail == 6000);
+	assert(TQueueDestroyQueue(&journaled) == 0);
+	for (int k = 5997; k <= 6000; ++k) {
+		snprintf(path, sizeof(path), "/tmp/tqueue_test_%d.%d", (int)getpid(),
+				 k);
+		unlink(path);
+	}
+	printf("journal rotate: ok\n");
+}
+
+// members of a group claim messages while puts evict them, each message
+// is either read by one member or counted as skipped by the group
+#define GROUP_MESSAGES 20000
+
+TQueue grouped;
+int group_done;
+unsigned char group_seen[GROUP_MESSAGES + 1];
+long group_read;
+
+void *group_member(void *arg) {
+	TQueueSubscription *subscription = arg;
+	void *msg;
+	int ret;
+
+	while ((ret = TQueueTryGetHandle(&grouped, subscription, &msg)) == 0
+		   || !__atomic_load_n(&group_done, __ATOMIC_ACQUIRE)) {
+		if (ret) {
+			sched_yield();
+			continue;
+		}
+		assert(!__atomic_exchange_n(&group_seen[(long)msg], 1,
+									__ATOMIC_RELAXED));
+		__atomic_fetch_add(&group_read, 1, __ATOMIC_RELAXED);
+	}
+	return arg;
+}
+
+void test_group_claim(void) {
+	TQueueSubscription *subscriptions[4];
+	pthread_t threads[4];
+	int size = 8;
+	int max_lag = 0;
+	int skipped;
+
+	TQueueCreateQueuePolicy(&grouped, &size, TQUEUE_POLICY_OVERWRITE,
+							&max_lag);
+	for (int i = 0; i < 4; ++i) {
+		subscriptions[i] = TQueueSubscribeGroupHandle(&grouped, "group");
+		pthread_create(&threads[i], NULL, group_member, subscriptions[i]);
+	}
+	// members get to run between the puts, even on a single cpu
+	for (long value = 1; value <= GROUP_MESSAGES; ++value) {
+		assert(TQueuePut(&grouped, (void *)value) == 0);
+		sched_yield();
+	}
+	__atomic_store_n(&group_done, 1, __ATOMIC_RELEASE);
+	for (int i = 0; i < 4; ++i)
+		pthread_join(threads[i], NULL);
+	skipped = TQueueGetSkippedHandle(&grouped, subscriptions[0]);
+	assert(group_read + skipped == GROUP_MESSAGES);
+	assert(TQueueDestroyQueue(&grouped) == 0);
+	printf("group claim: ok\n");
+}
+
+// members of a group found by their thread claim with the mutex held,
+// each message still goes to one of them and to every plain subscriber
+void test_group_thread(void) {
+	TQueue tqueue;
+	pthread_t members[2] = { 1, 2 };
+	pthread_t plain = 3;
+	void *msgs[4];
+	void *msg;
+	int size = 8;
+
+	TQueueCreateQueue(&tqueue, &size);
+	assert(TQueueSubscribeGroup(&tqueue, &members[0], "group") == 0);
+	assert(TQueueSubscribeGroup(&tqueue, &members[1], "group") == 0);
+	assert(TQueueSubscribe(&tqueue, &plain) == 0);
+	for (long value = 1; value <= 4; ++value)
+		assert(TQueuePut(&tqueue, (void *)value) == 0);
+	assert(TQueueTryGet(&tqueue, &members[0], &msg) == 0);
+	assert(msg == (void *)1);
+	assert(TQueueGetBatch(&tqueue, &members[1], msgs, 2) == 2);
+	assert(msgs[0] == (void *)2 && msgs[1] == (void *)3);
+	assert(TQueueTryGet(&tqueue, &members[0], &msg) == 0);
+	assert(msg == (void *)4);
+	assert(TQueueTryGet(&tqueue, &members[1], &msg) == -4);
+	assert(TQueueGetBatch(&tqueue, &plain, msgs, 4) == 4);
+	assert(msgs[3] == (void *)4);
+	assert(TQueuePeekSize(&tqueue) == 0);
+	assert(TQueueDestroyQueue(&tqueue) == 0);
+	printf("group thread: ok\n");
+}
+
+// removed messages are left as tombstones which reads step over, a
+// ticket stops matching once its message has left the queue
+void test_remove_ticket(void) {
+	TQueue tqueue;
+	TQueueSubscription *subscription;
+	unsigned long long tickets[6];
+	void *msg;
+	int size = 8;
+
+	TQueueCreateQueue(&tqueue, &size);
+	subscription = TQueueSubscribeHandle(&tqueue);
+	for (long value = 1; value <= 5; ++value)
+		assert(TQueuePutTicket(&tqueue, (void *)value, &tickets[value]) == 0);
+	assert(TQueueRemoveTicket(&tqueue, tickets[2]) == 0);
+	assert(TQueueRemoveTicket(&tqueue, tickets[2]) == -2);
+	assert(TQueueRemoveTicket(&tqueue, tickets[4]) == 0);
+	assert(TQueueGetAvailableHandle(&tqueue, subscription) == 3);
+	assert(TQueueTryGetHandle(&tqueue, subscription, &msg) == 0);
+	assert(msg == (void *)1);
+	assert(TQueueRemoveTicket(&tqueue, tickets[1]) == -2);
+	assert(TQueueTryGetHandle(&tqueue, subscription, &msg) == 0);
+	assert(msg == (void *)3);
+	assert(TQueueTryGetHandle(&tqueue, subscription, &msg) == 0);
+	assert(msg == (void *)5);
+	assert(TQueueTryGetHandle(&tqueue, subscription, &msg) == -4);
+	assert(TQueuePeekSize(&tqueue) == 0);
+	assert(TQueueDestroyQueue(&tqueue) == 0);
+	printf("remove ticket: ok\n");
+}
+
+// removed messages behind a subscriber which does not read take up the
+// ring only up to a bound, then puts wait or, when the policy lets them,
+// evict the message the subscriber holds up
+void test_remove_churn(void) {
+	TQueue tqueue;
+	TQueueSubscription *subscription;
+	unsigned long long ticket;
+	void *msg;
+	int size = 4;
+	int max_lag = 0;
+	int ret = 0;
+	int i;
+
+	TQueueCreateQueue(&tqueue, &size);
+	subscription = TQueueSubscribeHandle(&tqueue);
+	assert(TQueuePut(&tqueue, (void *)1) == 0);
+	for (i = 0; i < 1000 && !ret; ++i)
+		if (!(ret = TQueueTryPut(&tqueue, (void *)2)))
+			assert(TQueueRemoveMsg(&tqueue, (void *)2) == 0);
+	assert(ret == -4);
+	assert(i < 16);
+	assert(tqueue.ring_mask + 1 <= 16);
+	assert(TQueueTryGetHandle(&tqueue, subscription, &msg) == 0);
+	assert(msg == (void *)1);
+	assert(TQueueTryPut(&tqueue, (void *)3) == 0);
+	assert(TQueueDestroyQueue(&tqueue) == 0);
+
+	TQueueCreateQueuePolicy(&tqueue, &size, TQUEUE_POLICY_OVERWRITE,
+							&max_lag);
+	subscription = TQueueSubscribeHandle(&tqueue);
+	assert(TQueuePut(&tqueue, (void *)1) == 0);
+	for (i = 0; i < 1000; ++i) {
+		assert(TQueuePutTicket(&tqueue, (void *)2, &ticket) == 0);
+		assert(TQueueRemoveTicket(&tqueue, ticket) == 0);
+	}
+	assert(tqueue.ring_mask + 1 <= 16);
+	assert(TQueueGetSkippedHandle(&tqueue, subscription) == 1);
+	assert(TQueueTryGetHandle(&tqueue, subscription, &msg) == -4);
+	assert(TQueueDestroyQueue(&tqueue) == 0);
+	printf("remove churn: ok\n");
+}
+
+// shrinking the queue evicts the oldest messages at once, subscribers
+// behind the new head catch up on their next read and count what they
+// missed as skipped
+void test_shrink_skipped(void) {
+	TQueue tqueue;
+	TQueueSubscription *ahead;
+	TQueueSubscription *behind;
+	void *msg;
+	int size = 8;
+
+	TQueueCreateQueue(&tqueue, &size);
+	ahead = TQueueSubscribeHandle(&tqueue);
+	behind = TQueueSubscribeHandle(&tqueue);
+	for (long value = 1; value <= 6; ++value)
+		assert(TQueuePut(&tqueue, (void *)value) == 0);
+	assert(TQueueTryGetHandle(&tqueue, ahead, &msg) == 0);
+	assert(TQueueTryGetHandle(&tqueue, ahead, &msg) == 0);
+	size = 2;
+	assert(TQueueSetSize(&tqueue, &size) == 0);
+	assert(TQueuePeekSize(&tqueue) == 2);
+	assert(TQueueGetSkippedHandle(&tqueue, ahead) == 2);
+	assert(TQueueGetSkippedHandle(&tqueue, ahead) == 0);
+	assert(TQueueTryGetHandle(&tqueue, behind, &msg) == 0);
+	assert(msg == (void *)5);
+	assert(TQueueGetSkippedHandle(&tqueue, behind) == 4);
+	assert(TQueueTryGetHandle(&tqueue, ahead, &msg) == 0);
+	assert(msg == (void *)5);
+	assert(TQueueTryGetHandle(&tqueue, behind, &msg) == 0);
+	assert(msg == (void *)6);
+	assert(TQueueDestroyQueue(&tqueue) == 0);
+	printf("shrink skipped: ok\n");
+}
+
+// puts never block under the overwrite and max lag policies, they evict
+// the oldest messages, on a full queue or once a subscriber falls more
+// than max_lag messages behind
+void test_policies(void) {
+	TQueue tqueue;
+	TQueueSubscription *subscription;
+	void *msg;
+	int size = 4;
+	int max_lag = 2;
+
+	assert(TQueueCreateQueuePolicy(&tqueue, &size, 3, &max_lag) == -2);
+	assert(TQueueCreateQueuePolicy(&tqueue, &size, TQUEUE_POLICY_MAX_LAG,
+								   NULL) == -2);
+	// only the max lag policy reads max_lag
+	assert(TQueueCreateQueuePolicy(&tqueue, &size, TQUEUE_POLICY_OVERWRITE,
+								   NULL) == 0);
+	subscription = TQueueSubscribeHandle(&tqueue);
+	for (long value = 1; value <= 6; ++value)
+		assert(TQueueTryPut(&tqueue, (void *)value) == 0);
+	assert(TQueuePeekSize(&tqueue) == 4);
+	for (long value = 3; value <= 6; ++value) {
+		assert(TQueueTryGetHandle(&tqueue, subscription, &msg) == 0);
+		assert(msg == (void *)value);
+	}
+	assert(TQueueGetSkippedHandle(&tqueue, subscription) == 2);
+	assert(TQueueDestroyQueue(&tqueue) == 0);
+
+	size = 8;
+	max_lag = 2;
+	TQueueCreateQueuePolicy(&tqueue, &size, TQUEUE_POLICY_MAX_LAG,
+							&max_lag);
+	subscription = TQueueSubscribeHandle(&tqueue);
+	for (long value = 1; value <= 5; ++value)
+		assert(TQueueTryPut(&tqueue, (void *)value) == 0);
+	assert(TQueuePeekSize(&tqueue) == 2);
+	for (long value = 4; value <= 5; ++value) {
+		assert(TQueueTryGetHandle(&tqueue, subscription, &msg) == 0);
+		assert(msg == (void *)value);
+	}
+	assert(TQueueGetSkippedHandle(&tqueue, subscription) == 3);
+	assert(TQueueDestroyQueue(&tqueue) == 0);
+	printf("policies: ok\n");
+}
+
+// a message put on a topic goes only to the inboxes of subscribers of
+// that topic and to plain subscribers, the others never see or hold it
+void test_topic_delivery(void) {
+	TQueue tqueue;
+	TQueueSubscription *plain;
+	TQueueSubscription *odd;
+	TQueueSubscription *other;
+	void *msg;
+	int size = 8;
+
+	TQueueCreateQueue(&tqueue, &size);
+	plain = TQueueSubscribeHandle(&tqueue);
+	odd = TQueueSubscribeTopicsHandle(&tqueue,
+									  TQUEUE_TOPIC(1) | TQUEUE_TOPIC(3));
+	other = TQueueSubscribeTopicsHandle(&tqueue, TQUEUE_TOPIC(5));
+	assert(TQueuePutTopic(&tqueue, 1, (void *)1) == 0);
+	assert(TQueuePutTopic(&tqueue, 2, (void *)2) == 0);
+	assert(TQueuePutTopic(&tqueue, 3, (void *)3) == 0);
+	assert(TQueuePut(&tqueue, (void *)4) == 0);
+	assert(TQueuePutTopic(&tqueue, TQUEUE_TOPICS, (void *)5) == -2);
+	assert(TQueueGetAvailableHandle(&tqueue, odd) == 2);
+	assert(TQueueGetAvailableHandle(&tqueue, other) == 0);
+	for (long value = 1; value <= 4; ++value) {
+		assert(TQueueTryGetHandle(&tqueue, plain, &msg) == 0);
+		assert(msg == (void *)value);
+	}
+	// the topic subscriber holds only the messages delivered to it
+	assert(TQueueTryGetHandle(&tqueue, odd, &msg) == 0);
+	assert(msg == (void *)1);
+	assert(TQueuePeekSize(&tqueue) == 2);
+	assert(TQueueTryGetHandle(&tqueue, odd, &msg) == 0);
+	assert(msg == (void *)3);
+	assert(TQueueTryGetHandle(&tqueue, odd, &msg) == -4);
+	assert(TQueueTryGetHandle(&tqueue, other, &msg) == -4);
+	assert(TQueuePeekSize(&tqueue) == 0);
+	assert(TQueueDestroyQueue(&tqueue) == 0);
+	printf("topic delivery: ok\n");
+}
+
+// a group reads every message exactly once between its members while
+// a plain subscriber of the same queue reads all of them in order
+#define SHARED_MESSAGES 5000
+
+TQueue shared_group;
+unsigned char shared_seen[SHARED_MESSAGES + 1];
+long shared_read;
+
+void *shared_member(void *arg) {
+	TQueueSubscription *subscription = arg;
+	void *msg;
+
+	while (__atomic_load_n(&shared_read, __ATOMIC_RELAXED)
+		   < SHARED_MESSAGES) {
+		if (TQueueTryGetHandle(&shared_group, subscription, &msg)) {
+			sched_yield();
+			continue;
+		}
+		assert(!__atomic_exchange_n(&shared_seen[(long)msg], 1,
+									__ATOMIC_RELAXED));
+		__atomic_fetch_add(&shared_read, 1, __ATOMIC_RELAXED);
+	}
+	return arg;
+}
+
+void *shared_plain(void *arg) {
+	TQueueSubscription *subscription = arg;
+	void *msg;
+
+	for (long value = 1; value <= SHARED_MESSAGES; ++value) {
+		while (TQueueTryGetHandle(&shared_group, subscription, &msg))
+			sched_yield();
+		assert(msg == (void *)value);
+	}
+	return arg;
+}
+
+void test_group_shared(void) {
+	TQueueSubscription *subscriptions[5];
+	pthread_t threads[5];
+	int size = 16;
+
+	TQueueCreateQueue(&shared_group, &size);
+	for (int i = 0; i < 4; ++i) {
+		subscriptions[i] =
+			TQueueSubscribeGroupHandle(&shared_group, "group");
+		pthread_create(&threads[i], NULL, shared_member, subscriptions[i]);
+	}
+	subscriptions[4] = TQueueSubscribeHandle(&shared_group);
+	pthread_create(&threads[4], NULL, shared_plain, subscriptions[4]);
+	for (long value = 1; value <= SHARED_MESSAGES; ++value)
+		assert(TQueuePut(&shared_group, (void *)value) == 0);
+	for (int i = 0; i < 5; ++i)
+		pthread_join(threads[i], NULL);
+	assert(shared_read == SHARED_MESSAGES);
+	assert(TQueueGetSkippedHandle(&shared_group, subscriptions[0]) == 0);
+	assert(TQueuePeekSize(&shared_group) == 0);
+	assert(TQueueDestroyQueue(&shared_group) == 0);
+	printf("group shared: ok\n");
+}
+
+// each subscriber of a weighted priority queue follows the schedule on
+// its own, reads of one do not take the turns of the other
+void test_priority_weighted(void) {
+	TQueueSharded tqueue;
+	pthread_t first = 1;
+	pthread_t second = 2;
+	int lanes = 2;
+	int sizes[2] = { 8, 8 };
+	int weights[2] = { 2, 1 };
+	// the schedule of weights 2:1 is lane 0, lane 1, lane 0
+	long expected[9] = { 1, 101, 2, 3, 102, 4, 5, 103, 6 };
+	void *msg;
+
+	assert(TQueueCreatePriority(&tqueue, &lanes, sizes,
+								TQUEUE_PRIORITY_WEIGHTED, weights) == 0);
+	assert(TQueueShardedSubscribe(&tqueue, &first) == 0);
+	assert(TQueueShardedSubscribe(&tqueue, &second) == 0);
+	for (long value = 1; value <= 6; ++value)
+		assert(TQueuePutPriority(&tqueue, (void *)value, 0) == 0);
+	for (long value = 101; value <= 103; ++value)
+		assert(TQueuePutPriority(&tqueue, (void *)value, 1) == 0);
+	for (int i = 0; i < 9; ++i) {
+		assert(TQueueShardedTryGet(&tqueue, &first, &msg) == 0);
+		assert(msg == (void *)expected[i]);
+		assert(TQueueShardedTryGet(&tqueue, &second, &msg) == 0);
+		assert(msg == (void *)expected[i]);
+	}
+	assert(TQueueShardedTryGet(&tqueue, &first, &msg) == -4);
+	// an empty poll does not move the turn on
+	assert(TQueuePutPriority(&tqueue, (void *)104, 1) == 0);
+	assert(TQueuePutPriority(&tqueue, (void *)7, 0) == 0);
+	assert(TQueueShardedTryGet(&tqueue, &first, &msg) == 0);
+	assert(msg == (void *)7);
+	assert(TQueueDestroySharded(&tqueue) == 0);
+	printf("priority weighted: ok\n");
+}
+
+// the release callback is called once for every message, with the
+// reason it left the queue for
+#define RELEASE_MESSAGES 16
+
+int released[RELEASE_MESSAGES][TQUEUE_RELEASE_DESTROYED + 1];
+
+void count_release(void *msg, int reason, void *arg) {
+	assert(arg == (void *)released);
+	++released[(long)msg][reason];
+}
+
+// checks that msg has been released once, for reason
+void assert_released(long msg, int reason) {
+	for (int i = 0; i <= TQUEUE_RELEASE_DESTROYED; ++i)
+		assert(released[msg][i] == (i == reason));
+}
+
+void test_release_once(void) {
+	TQueue tqueue;
+	TQueueSubscription *first;
+	TQueueSubscription *second;
+	unsigned long long tickets[7];
+	void *msg;
+	int size = 8;
+	int max_lag = 0;
+
+	TQueueCreateQueue(&tqueue, &size);
+	assert(TQueueSetRelease(&tqueue, count_release, released) == 0);
+	assert(TQueuePut(&tqueue, (void *)1) == 0);
+	first = TQueueSubscribeHandle(&tqueue);
+	second = TQueueSubscribeHandle(&tqueue);
+	for (long value = 2; value <= 6; ++value)
+		assert(TQueuePutTicket(&tqueue, (void *)value, &tickets[value]) == 0);
+	assert(TQueueRemoveTicket(&tqueue, tickets[3]) == 0);
+	assert(TQueueTryGetHandle(&tqueue, first, &msg) == 0);
+	assert(released[2][TQUEUE_RELEASE_CONSUMED] == 0);
+	// the removed message reaches the head with the consumed one
+	assert(TQueueTryGetHandle(&tqueue, second, &msg) == 0);
+	size = 2;
+	assert(TQueueSetSize(&tqueue, &size) == 0);
+	// a removed message behind the head is still in the ring when the
+	// queue is destroyed
+	assert(TQueueRemoveTicket(&tqueue, tickets[6]) == 0);
+	assert(TQueueDestroyQueue(&tqueue) == 0);
+	assert_released(1, TQUEUE_RELEASE_DROPPED);
+	assert_released(2, TQUEUE_RELEASE_CONSUMED);
+	assert_released(3, TQUEUE_RELEASE_REMOVED);
+	assert_released(4, TQUEUE_RELEASE_EVICTED);
+	assert_released(5, TQUEUE_RELEASE_DESTROYED);
+	assert_released(6, TQUEUE_RELEASE_REMOVED);
+
+	size = 2;
+	TQueueCreateQueuePolicy(&tqueue, &size, TQUEUE_POLICY_OVERWRITE,
+							&max_lag);
+	assert(TQueueSetRelease(&tqueue, count_release, released) == 0);
+	first = TQueueSubscribeHandle(&tqueue);
+	for (long value = 11; value <= 13; ++value)
+		assert(TQueuePut(&tqueue, (void *)value) == 0);
+	assert(TQueueDestroyQueue(&tqueue) == 0);
+	assert_released(11, TQUEUE_RELEASE_EVICTED);
+	assert_released(12, TQUEUE_RELEASE_DESTROYED);
+	assert_released(13, TQUEUE_RELEASE_DESTROYED);
+	printf("release once: ok\n");
+}
+
+// subscribers keep being found, by gets and by peeks without the mutex,
+// while hundreds of others subscribe and unsubscribe and the hashmap
+// grows from its smallest size, leaving deleted slots behind
+#define CHURN_STABLE 64
+#define CHURN_WORKERS 4
+#define CHURN_IDS 200
+
+TQueue churned;
+pthread_t churn_ids[CHURN_STABLE + CHURN_WORKERS * CHURN_IDS];
+int churn_done;
+
+void *churn_peeker(void *arg) {
+	while (!__atomic_load_n(&churn_done, __ATOMIC_ACQUIRE))
+		for (int i = 0; i < CHURN_STABLE; ++i)
+			assert(TQueuePeekAvailable(&churned, &churn_ids[i]) == 0);
+	return arg;
+}
+
+void *churn_worker(void *arg) {
+	pthread_t *ids = arg;
+	void *msg;
+
+	for (int i = 0; i < CHURN_IDS; ++i) {
+		assert(TQueueSubscribe(&churned, &ids[i]) == 0);
+		assert(TQueueTryGet(&churned, &ids[i], &msg) == -4);
+		assert(TQueuePeekAvailable(&churned, &ids[i]) == 0);
+		// every other subscriber leaves a deleted slot behind
+		if (i % 2)
+			assert(TQueueUnsubscribe(&churned, &ids[i]) == 0);
+	}
+	return arg;
+}
+
+void test_hashmap_churn(void) {
+	pthread_t peeker;
+	pthread_t workers[CHURN_WORKERS];
+	int size = 4;
+	int hashmap_size = 2;
+	void *msg;
+
+	TQueueCreateQueueHash(&churned, &size, &hashmap_size);
+	for (int i = 0; i < CHURN_STABLE + CHURN_WORKERS * CHURN_IDS; ++i)
+		churn_ids[i] = i + 1;
+	for (int i = 0; i < CHURN_STABLE; ++i)
+		assert(TQueueSubscribe(&churned, &churn_ids[i]) == 0);
+	pthread_create(&peeker, NULL, churn_peeker, NULL);
+	for (int i = 0; i < CHURN_WORKERS; ++i)
+		pthread_create(&workers[i], NULL, churn_worker,
+					   &churn_ids[CHURN_STABLE + i * CHURN_IDS]);
+	for (int i = 0; i < CHURN_WORKERS; ++i)
+		pthread_join(workers[i], NULL);
+	__atomic_store_n(&churn_done, 1, __ATOMIC_RELEASE);
+	pthread_join(peeker, NULL);
+
+	assert(TQueuePeekSubscribers(&churned)
+		   == CHURN_STABLE + CHURN_WORKERS * CHURN_IDS / 2);
+	for (int i = 0; i < CHURN_STABLE + CHURN_WORKERS * CHURN_IDS; ++i) {
+		int left = i >= CHURN_STABLE && (i - CHURN_STABLE) % 2;
+		assert(TQueueTryGet(&churned, &churn_ids[i], &msg)
+			   == (left ? -2 : -4));
+		assert(TQueuePeekAvailable(&churned, &churn_ids[i])
+			   == (left ? -2 : 0));
+	}
+	assert(TQueueDestroyQueue(&churned) == 0);
+	printf("hashmap churn: ok\n");
+}
+
+// reads the counter of a non-blocking eventfd, 0 if it is not readable
+unsigned long long eventfd_take(int fd) {
+	unsigned long long value;
+
+	if (read(fd, &value, sizeof(value)) != sizeof(value))
+		return 0;
+	return value;
+}
+
+// a burst of puts writes once to the eventfd of a subscriber which found
+// no message, it is only written again after the subscriber drains it
+void test_ready_fd(void) {
+	TQueue tqueue;
+	int size = 8;
+	pthread_t a = 1;
+	int fd;
+	void *msg;
+
+	TQueueCreateQueue(&tqueue, &size);
+	assert(TQueueSubscribe(&tqueue, &a) == 0);
+	assert(TQueueGetReadyFd(&tqueue, &a, &fd) == 0);
+	assert(eventfd_take(fd) == 0);
+
+	for (long i = 1; i <= 4; ++i)
+		assert(TQueueTryPut(&tqueue, (void *)i) == 0);
+	assert(eventfd_take(fd) == 1);
+	assert(eventfd_take(fd) == 0);
+
+	// reading only a part does not arm the eventfd again
+	assert(TQueueTryGet(&tqueue, &a, &msg) == 0 && msg == (void *)1);
+	assert(TQueueTryPut(&tqueue, (void *)5) == 0);
+	assert(eventfd_take(fd) == 0);
+
+	for (long i = 2; i <= 5; ++i)
+		assert(TQueueTryGet(&tqueue, &a, &msg) == 0 && msg == (void *)i);
+	assert(TQueueTryGet(&tqueue, &a, &msg) == -4);
+	assert(eventfd_take(fd) == 0);
+	assert(TQueueTryPut(&tqueue, (void *)6) == 0);
+	assert(TQueueTryPut(&tqueue, (void *)7) == 0);
+	assert(eventfd_take(fd) == 1);
+	assert(eventfd_take(fd) == 0);
+
+	assert(TQueueDestroyQueue(&tqueue) == 0);
+	printf("ready fd: ok\n");
+}
+
+// a put finding the queue full arms the space eventfd, the next get
+// which frees a slot makes it readable
+void test_space_fd(void) {
+	TQueue tqueue;
+	int size = 2;
+	pthread_t a = 1;
+	int fd;
+	void *msg;
+
+	TQueueCreateQueue(&tqueue, &size);
+	assert(TQueueSubscribe(&tqueue, &a) == 0);
+	assert(TQueueTryPut(&tqueue, (void *)1) == 0);
+	assert(TQueueTryPut(&tqueue, (void *)2) == 0);
+	assert(TQueueGetSpaceFd(&tqueue, &fd) == 0);
+	assert(eventfd_take(fd) == 0);
+
+	assert(TQueueTryPut(&tqueue, (void *)3) == -4);
+	assert(eventfd_take(fd) == 0);
+	assert(TQueueTryGet(&tqueue, &a, &msg) == 0 && msg == (void *)1);
+	assert(eventfd_take(fd) == 1);
+
+	// the eventfd stays quiet until a put finds the queue full again
+	assert(TQueueTryGet(&tqueue, &a, &msg) == 0 && msg == (void *)2);
+	assert(eventfd_take(fd) == 0);
+	assert(TQueueTryPut(&tqueue, (void *)3) == 0);
+	assert(TQueueTryPut(&tqueue, (void *)4) == 0);
+	assert(TQueueTryPut(&tqueue, (void *)5) == -4);
+	assert(TQueueTryGet(&tqueue, &a, &msg) == 0 && msg == (void *)3);
+	assert(eventfd_take(fd) == 1);
+
+	assert(TQueueDestroyQueue(&tqueue) == 0);
+	printf("space fd: ok\n");
+}
+
+// timed puts and gets return -4 when their deadline passes and stop
+// being counted as waiters, so destroying the queue does not wait for
+// them, while those still waiting when it is destroyed return -1
+TQueue timed;
+pthread_t timed_reader = 1;
+pthread_t timed_writer = 2;
+
+struct timespec timed_deadline(long ms) {
+	struct timespec deadline;
+
+	clock_gettime(CLOCK_REALTIME, &deadline);
+	deadline.tv_sec += ms / 1000;
+	deadline.tv_nsec += ms % 1000 * 1000000;
+	if (deadline.tv_nsec >= 1000000000) {
+		++deadline.tv_sec;
+		deadline.tv_nsec -= 1000000000;
+	}
+	return deadline;
+}
+
+void *timed_put(void *arg) {
+	struct timespec deadline = timed_deadline(60000);
+
+	assert(TQueueTimedPut(&timed, (void *)2, &deadline) == -1);
+	return arg;
+}
+
+void *timed_get(void *arg) {
+	struct timespec deadline = timed_deadline(60000);
+	void *msg;
+
+	assert(TQueueTimedGet(&timed, &timed_reader, &msg, &deadline) == -1);
+	return arg;
+}
+
+void test_timed_destroy(void) {
+	TQueue tqueue;
+	TQueueSubscription *subscription;
+	struct timespec deadline;
+	struct timespec start;
+	struct timespec end;
+	pthread_t threads[2];
+	pthread_t a = 1;
+	int size = 1;
+	void *msg;
+
+	TQueueCreateQueue(&tqueue, &size);
+	assert(TQueueSubscribe(&tqueue, &a) == 0);
+	subscription = TQueueSubscribeHandle(&tqueue);
+	assert(TQueueTryPut(&tqueue, (void *)1) == 0);
+	deadline = timed_deadline(20);
+	assert(TQueueTimedPut(&tqueue, (void *)2, &deadline) == -4);
+	assert(TQueueTryGet(&tqueue, &a, &msg) == 0 && msg == (void *)1);
+	deadline = timed_deadline(20);
+	assert(TQueueTimedGet(&tqueue, &a, &msg, &deadline) == -4);
+	assert(TQueueTryGetHandle(&tqueue, subscription, &msg) == 0);
+	deadline = timed_deadline(20);
+	assert(TQueueTimedGetHandle(&tqueue, subscription, &msg, &deadline)
+		   == -4);
+	assert(tqueue.get_locked == 0 && tqueue.put_locked == 0);
+	assert(TQueueDestroyQueue(&tqueue) == 0);
+
+	// the reader has read the message the writer still holds the queue
+	// full with, so both wait until the queue is destroyed
+	TQueueCreateQueue(&timed, &size);
+	assert(TQueueSubscribe(&timed, &timed_reader) == 0);
+	assert(TQueueSubscribe(&timed, &timed_writer) == 0);
+	assert(TQueueTryPut(&timed, (void *)1) == 0);
+	assert(TQueueTryGet(&timed, &timed_reader, &msg) == 0);
+	pthread_create(&threads[0], NULL, timed_put, NULL);
+	pthread_create(&threads[1], NULL, timed_get, NULL);
+	while (__atomic_load_n(&timed.put_locked, __ATOMIC_ACQUIRE) == 0
+		   || __atomic_load_n(&timed.get_locked, __ATOMIC_ACQUIRE) == 0)
+		usleep(1000);
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	assert(TQueueDestroyQueue(&timed) == 0);
+	pthread_join(threads[0], NULL);
+	pthread_join(threads[1], NULL);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	assert(end.tv_sec - start.tv_sec < 30);
+	printf("timed destroy: ok\n");
+}
+
+// a known sequence of puts, gets, drops, removals and a shrink shows up
+// in every counter of the stats
+void test_stats(void) {
+	TQueue tqueue;
+	TQueueStats stats;
+	TQueueSubscription *subscription;
+	struct timespec deadline;
+	pthread_t a = 1;
+	int size = 4;
+	int timing = 1;
+	void *msg;
+
+	TQueueCreateQueue(&tqueue, &size);
+	assert(TQueueTryPut(&tqueue, (void *)9) == 0);
+	assert(TQueueSubscribe(&tqueue, &a) == 0);
+	subscription = TQueueSubscribeHandle(&tqueue);
+	for (long i = 1; i <= 3; ++i)
+		assert(TQueueTryPut(&tqueue, (void *)i) == 0);
+	assert(TQueueTryGet(&tqueue, &a, &msg) == 0 && msg == (void *)1);
+	assert(TQueueTryGet(&tqueue, &a, &msg) == 0 && msg == (void *)2);
+	assert(TQueueTryGetHandle(&tqueue, subscription, &msg) == 0);
+	assert(TQueueRemoveMsg(&tqueue, (void *)3) == 0);
+	assert(TQueueTryPut(&tqueue, (void *)4) == 0);
+	assert(TQueueTryPut(&tqueue, (void *)5) == 0);
+	// messages 2 and 4 are evicted, 5 is left for both subscribers
+	size = 1;
+	assert(TQueueSetSize(&tqueue, &size) == 0);
+
+	assert(TQueueGetStats(&tqueue, &stats) == 0);
+	assert(stats.puts == 5 && stats.gets == 3 && stats.drops == 1);
+	assert(stats.removals == 1 && stats.evictions == 2);
+	assert(stats.depth[0] == 1 && stats.depth[1] == 2
+		   && stats.depth[2] == 2);
+	for (int i = 3; i < TQUEUE_STATS_DEPTHS; ++i)
+		assert(stats.depth[i] == 0);
+	assert(stats.size == 1 && stats.subscribers == 2);
+	assert(stats.max_lag == 1 && stats.total_lag == 2);
+	assert(stats.put_waits == 0 && stats.get_waits == 0);
+	assert(stats.lock_contended == 0 && stats.lock_wait_ns == 0);
+	assert(stats.lock_hold_ns == 0);
+
+	// a put waits on the full queue and a get on an empty subscription
+	deadline = timed_deadline(5);
+	assert(TQueueTimedPut(&tqueue, (void *)6, &deadline) == -4);
+	assert(TQueueTryGet(&tqueue, &a, &msg) == 0 && msg == (void *)5);
+	deadline = timed_deadline(5);
+	assert(TQueueTimedGet(&tqueue, &a, &msg, &deadline) == -4);
+	assert(TQueueSetStatsTiming(&tqueue, &timing) == 0);
+	assert(TQueueGetAvailable(&tqueue, &a) == 0);
+
+	assert(TQueueGetStats(&tqueue, &stats) == 0);
+	assert(stats.gets == 4);
+	assert(stats.put_waits >= 1 && stats.put_wait_ns > 0);
+	assert(stats.get_waits >= 1 && stats.get_wait_ns > 0);
+	assert(stats.lock_hold_ns > 0);
+	assert(stats.max_lag == 1 && stats.total_lag == 1);
+	assert(TQueueDestroyQueue(&tqueue) == 0);
+	printf("stats: ok\n");
+}
+
+int main(void) {
+	test_async_destroy();
+	test_shared_elem_size();
+	test_sharded_destroy();
+	test_sharded_subscribe();
+	test_values_create();
+	test_sizes();
+	test_lockfree_peek_destroy();
+	test_lockfree_order();
+	test_journal_rotate();
+	test_group_claim();
+	test_group_thread();
+	test_timed_destroy();
+	test_stats();
+	test_remove_ticket();
+	test_remove_churn();
+	test_shrink_skipped();
+	test_policies();
+	test_topic_delivery();
+	test_group_shared();
+	test_priority_weighted();
+	test_release_once();
+	test_hashmap_churn();
+	test_ready_fd();
+	test_space_fd();
+	return 0;
+}
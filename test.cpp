@@ -0,0 +1,262 @@
+#include <atomic>
+#include <cassert>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <pthread.h>
+
+#include "tqueue.hpp"
+
+// a value counting how many of its kind are alive and how often it has
+// been copied and moved
+struct Tracked {
+	static int live;
+	static int copies;
+	static int moves;
+
+	explicit Tracked(int value = 0) noexcept : value(value) {
+		++live;
+	}
+
+	Tracked(const Tracked & other) noexcept : value(other.value) {
+		++live;
+		++copies;
+	}
+
+	Tracked(Tracked && other) noexcept : value(other.value) {
+		other.value = -1;
+		++live;
+		++moves;
+	}
+
+	Tracked &operator=(const Tracked & other) noexcept {
+		value = other.value;
+		++copies;
+		return *this;
+	}
+
+	Tracked &operator=(Tracked && other) noexcept {
+		value = other.value;
+		other.value = -1;
+		++moves;
+		return *this;
+	}
+
+	~Tracked() {
+		--live;
+	}
+
+	bool operator==(const Tracked & other) const noexcept {
+		return value == other.value;
+	}
+
+	int value;
+};
+
+int Tracked::live = 0;
+int Tracked::copies = 0;
+int Tracked::moves = 0;
+
+// every subscriber but the last one to read a value gets a copy, the
+// last one gets it moved out, and values leave the queue by ticket and
+// by comparison
+void test_queue_copy(void) {
+	tqueue::Queue<Tracked, 4> queue;
+	TQueueSubscription *a = queue.subscribe();
+	TQueueSubscription *b = queue.subscribe();
+	unsigned long long ticket;
+	Tracked value;
+	int copies;
+
+	assert(a != nullptr && b != nullptr);
+	assert(queue.put(Tracked(1)) == 0);
+	assert(queue.emplace(2) == 0);
+	assert(queue.put_ticket(Tracked(3), ticket) == 0);
+	assert(queue.emplace(4) == 0);
+	assert(queue.remove(ticket) == 0);
+	assert(queue.remove(Tracked(4)) == 0);
+	assert(queue.available(a) == 2 && queue.available(b) == 2);
+
+	copies = Tracked::copies;
+	assert(queue.get(a, value) == 0 && value.value == 1);
+	assert(queue.try_get(a, value) == 0 && value.value == 2);
+	assert(Tracked::copies == copies + 2);
+	assert(queue.get(b, value) == 0 && value.value == 1);
+	assert(queue.try_get(b, value) == 0 && value.value == 2);
+	assert(Tracked::copies == copies + 2);
+	assert(queue.try_get(b, value) == -4);
+	printf("queue copy: ok\n");
+}
+
+// a value which cannot be copied has one reader at a time
+void test_queue_move_only(void) {
+	tqueue::Queue<std::unique_ptr<int>, 4> queue;
+	TQueueSubscription *subscription = queue.subscribe();
+	std::unique_ptr<int> value;
+	pthread_t a = 1;
+
+	assert(subscription != nullptr);
+	assert(queue.subscribe() == nullptr);
+	assert(queue.subscribe(&a) == -2);
+	assert(queue.put(std::make_unique<int>(5)) == 0);
+	assert(queue.emplace(new int(6)) == 0);
+	assert(queue.get(subscription, value) == 0 && *value == 5);
+	assert(queue.try_get(subscription, value) == 0 && *value == 6);
+	assert(queue.unsubscribe(subscription) == 0);
+	assert(queue.subscribe(&a) == 0);
+	assert(queue.subscribe() == nullptr);
+	assert(queue.unsubscribe(&a) == 0);
+	printf("queue move only: ok\n");
+}
+
+// values still queued are destroyed with the queue
+void test_queue_destroy(void) {
+	int live = Tracked::live;
+
+	{
+		tqueue::Queue<Tracked, 4> queue;
+		TQueueSubscription *subscription = queue.subscribe();
+		Tracked value;
+
+		for (int i = 1; i <= 3; ++i)
+			assert(queue.emplace(i) == 0);
+		assert(queue.get(subscription, value) == 0 && value.value == 1);
+		assert(Tracked::live == live + 3);
+	}
+	assert(Tracked::live == live);
+	printf("queue destroy: ok\n");
+}
+
+// a coroutine which starts right away and frees itself when it ends
+struct Task {
+	struct promise_type {
+		Task get_return_object() noexcept {
+			return Task {};
+		}
+
+		std::suspend_never initial_suspend() noexcept {
+			return {};
+		}
+
+		std::suspend_never final_suspend() noexcept {
+			return {};
+		}
+
+		void return_void() noexcept {
+		}
+
+		void unhandled_exception() noexcept {
+			abort();
+		}
+	};
+};
+
+// result of a coroutine, done is set once it has been resumed
+struct Outcome {
+	std::atomic<int> done {0};
+	int status = 0;
+	void *msg = nullptr;
+};
+
+Task getter(TQueue & queue, TQueueSubscription * subscription,
+			Outcome * outcome) {
+	tqueue::Received received = co_await tqueue::get(queue, subscription);
+
+	outcome->status = received.status;
+	outcome->msg = received.msg;
+	outcome->done.store(1);
+}
+
+Task putter(TQueue & queue, void *msg, Outcome * outcome) {
+	outcome->status = co_await tqueue::put(queue, msg);
+	outcome->done.store(1);
+}
+
+TQueue awaited;
+TQueueSubscription *awaited_subscription;
+
+void *awaited_put(void *arg) {
+	assert(TQueuePut(&awaited, arg) == 0);
+	return arg;
+}
+
+void *awaited_get(void *arg) {
+	assert(TQueueGetHandle(&awaited, awaited_subscription) == arg);
+	return arg;
+}
+
+// a coroutine suspended in get is resumed by a put on another thread
+void test_await_get(void) {
+	Outcome outcome;
+	pthread_t thread;
+	int size = 1;
+
+	TQueueCreateQueue(&awaited, &size);
+	awaited_subscription = TQueueSubscribeHandle(&awaited);
+	getter(awaited, awaited_subscription, &outcome);
+	assert(outcome.done.load() == 0);
+	pthread_create(&thread, nullptr, awaited_put, (void *)7);
+	pthread_join(thread, nullptr);
+	assert(outcome.done.load() == 1);
+	assert(outcome.status == 0 && outcome.msg == (void *)7);
+	assert(TQueueDestroyQueue(&awaited) == 0);
+	printf("await get: ok\n");
+}
+
+// a coroutine suspended in put on a full queue is resumed by the get
+// which frees a slot, and puts its message then
+void test_await_put(void) {
+	Outcome outcome;
+	pthread_t thread;
+	void *msg;
+	int size = 1;
+
+	TQueueCreateQueue(&awaited, &size);
+	awaited_subscription = TQueueSubscribeHandle(&awaited);
+	assert(TQueueTryPut(&awaited, (void *)1) == 0);
+	putter(awaited, (void *)2, &outcome);
+	assert(outcome.done.load() == 0);
+	pthread_create(&thread, nullptr, awaited_get, (void *)1);
+	pthread_join(thread, nullptr);
+	assert(outcome.done.load() == 1 && outcome.status == 0);
+	assert(TQueueTryGetHandle(&awaited, awaited_subscription, &msg) == 0);
+	assert(msg == (void *)2);
+	assert(TQueueDestroyQueue(&awaited) == 0);
+	printf("await put: ok\n");
+}
+
+// destroying the queue resumes suspended gets and puts with -1
+void test_await_destroy(void) {
+	TQueue queue;
+	TQueueSubscription *reader;
+	TQueueSubscription *writer;
+	Outcome got;
+	Outcome put;
+	void *msg;
+	int size = 1;
+
+	// the reader has read the message the writer holds the queue full with
+	TQueueCreateQueue(&queue, &size);
+	reader = TQueueSubscribeHandle(&queue);
+	writer = TQueueSubscribeHandle(&queue);
+	assert(writer != nullptr);
+	assert(TQueueTryPut(&queue, (void *)1) == 0);
+	assert(TQueueTryGetHandle(&queue, reader, &msg) == 0);
+	getter(queue, reader, &got);
+	putter(queue, (void *)2, &put);
+	assert(got.done.load() == 0 && put.done.load() == 0);
+	assert(TQueueDestroyQueue(&queue) == 0);
+	assert(got.done.load() == 1 && got.status == -1 && got.msg == nullptr);
+	assert(put.done.load() == 1 && put.status == -1);
+	printf("await destroy: ok\n");
+}
+
+int main(void) {
+	test_queue_copy();
+	test_queue_move_only();
+	test_queue_destroy();
+	test_await_get();
+	test_await_put();
+	test_await_destroy();
+	return 0;
+}
@@ -1,5 +1,20 @@
 #include <stdlib.h>
 #include <stdio.h>
+#include <stdatomic.h>
+#include <sched.h>
+#include <errno.h>
+#include <time.h>
+#include <string.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
 
 #include "tqueue.h"
 
@@ -12,9 +27,246 @@ void TQueuePrint(TQueue * tqueue);
 #define dbgTQueuePrint(x)
 #endif
 
+// deadline passed by the non-blocking variants
+static const struct timespec nowait;
+#define TQUEUE_NOWAIT (&nowait)
+
+#if defined(__x86_64__) || defined(__i386__)
+#define cpu_relax() __builtin_ia32_pause()
+#elif defined(__aarch64__)
+#define cpu_relax() __asm__ __volatile__("yield")
+#else
+#define cpu_relax() sched_yield()
+#endif
+
+// fields written under the mutex and read by spinning threads without it
+#define TQueueLoad(x) __atomic_load_n(&(x), __ATOMIC_RELAXED)
+#define TQueueStore(x, v) __atomic_store_n(&(x), (v), __ATOMIC_RELAXED)
+
+// sequence numbers of messages delivered to a topic subscriber, in the
+// order they were put, and the condition variable it waits on
+struct TQueueInbox {
+	unsigned long long topics;
+	unsigned long long *seqs;
+	unsigned mask;
+	unsigned first;
+	unsigned count;
+	// evicted messages dropped while delivering, before the subscriber
+	// could count them
+	unsigned long long skipped;
+	pthread_cond_t cond;
+	TQueueInbox *next;
+	TQueueRetired retired;
+};
+
+// consumer group, cursor is counted on messages as a single subscriber
+// and read by all members, which claim messages by moving it with a
+// compare and swap and wait on cond, so a put wakes as many of them as
+// it has put messages
+struct TQueueGroup {
+	TQueueThread cursor;
+	unsigned members;
+	unsigned waiting;
+	pthread_cond_t cond;
+	TQueueGroup *next;
+	char name[];
+};
+
+// eventfd of a subscriber, written to when the subscriber is armed (has
+// found no message to read) and a message for it is put
+struct TQueueReady {
+	int fd;
+	unsigned char armed;
+	TQueueThread *thread;
+	TQueueReady *next;
+};
+
+// marks a removed subscriber in the hashmap so that probing goes on
+static TQueueThread deleted_thread;
+#define DELETED_THREAD (&deleted_thread)
+// old hashmap slots moved to the new one by each operation while it grows
+#define REHASH_STEP 8
+// kinds of memory retired while peeks may still read it
+#define RETIRED_NODE 0
+#define RETIRED_INBOX 1
+#define RETIRED_GROUP 2
+#define RETIRED_HASHMAP 3
+// removed messages keep their slots until they reach the head, together
+// with the messages they span at most this many times max_size slots
+#define TOMBSTONE_SPAN 2
+
 unsigned TQueueHash(TQueue * queue, pthread_t * thread);
+unsigned TQueueHashSize(pthread_t * thread, unsigned size);
+TQueueThread **TQueueHashmapSlot(TQueueThread ** hashmap, unsigned size,
+								 pthread_t * thread);
+void TQueueHashmapPut(TQueue * queue, TQueueThread * thread_ptr);
+void TQueueHashmapInsert(TQueue * queue, TQueueThread * thread_ptr);
+void TQueueHashmapResize(TQueue * queue, unsigned size);
+void TQueueRehashStep(TQueue * queue, unsigned n);
+void TQueueHashmapVersion(TQueue * queue);
+TQueueThread *TQueueNextThread(TQueue * queue, unsigned *i);
 void TQueueSubscriptionsCleanUp(TQueue * queue);
-void TQueueIdCleanup(TQueue * queue);
+unsigned long long TQueueNow(void);
+void TQueueLock(TQueue * queue);
+void TQueueUnlock(TQueue * queue);
+int TQueueCondWait(TQueue * queue, pthread_cond_t * cond,
+				   const struct timespec *deadline);
+void TQueueLag(TQueueStats * stats, unsigned long long lag);
+void TQueuePoolInit(TQueuePool * pool, unsigned node_size, unsigned n);
+void *TQueuePoolChunk(TQueuePool * pool, unsigned n);
+void TQueuePoolAdd(TQueuePool * pool, void *chunk, unsigned n);
+void *TQueuePoolAlloc(TQueuePool * pool);
+void TQueuePoolFree(TQueuePool * pool, void *node);
+void TQueuePoolDestroy(TQueuePool * pool);
+int TQueueReserveNode(TQueue * queue);
+int TQueueReserveInbox(TQueue * queue, TQueueInbox ** inbox);
+TQueueInbox *TQueueInboxCreate(unsigned capacity);
+void TQueueInboxDestroy(TQueueInbox * inbox);
+int TQueueInboxResize(TQueueInbox * inbox, unsigned capacity);
+unsigned long long *TQueueInboxSeq(TQueueInbox * inbox, unsigned i);
+int TQueueTopicSubscribed(TQueue * queue, int topic);
+void TQueueDeliver(TQueue * queue, int topic);
+int TQueueNextMessage(TQueue * queue, TQueueThread * thread_ptr);
+void TQueueInboxSkip(TQueue * queue, TQueueInbox * inbox,
+					 TQueueThread * thread_ptr);
+int TQueueTakeSkipped(TQueue * queue, TQueueThread * thread_ptr);
+void TQueueEvict(TQueue * queue, unsigned n);
+unsigned long long TQueuePending(TQueue * queue, TQueueThread * thread_ptr);
+int TQueuePeekEnter(TQueue * queue);
+void TQueuePeekLeave(TQueue * queue);
+void TQueuePeekDrain(TQueue * queue);
+int TQueuePeekQuiescent(TQueue * queue);
+void TQueueRetire(TQueue * queue, void *ptr, unsigned char kind);
+void TQueueReclaim(TQueue * queue);
+TQueueThread **TQueueHashmapAlloc(unsigned size);
+void TQueueHashmapFree(TQueueThread ** hashmap);
+void TQueueFreeRetired(TQueue * queue, void *ptr, unsigned char kind);
+void TQueueFutexWait(unsigned *addr, unsigned val);
+void TQueueFutexWake(unsigned *addr);
+TQueueThread *TQueuePeekFind(TQueue * queue, pthread_t * thread);
+TQueueThread *TQueuePeekSlot(TQueueThread ** hashmap, unsigned size,
+							 pthread_t * thread);
+int TQueuePeekPending(TQueue * queue, TQueueThread * thread_ptr);
+void TQueueRemoveRead(TQueue * queue);
+void TQueueRemoveSlot(TQueue * queue, unsigned long long num);
+TQueueThread *TQueueSubscribeNode(TQueue * queue, pthread_t * thread,
+								  unsigned long long topics,
+								  unsigned long long *from,
+								  const char *group, int *ret);
+void TQueueJoin(TQueue * queue, TQueueThread * thread_ptr);
+TQueueGroup *TQueueGroupCreate(const char *name);
+void TQueueGroupDestroy(TQueueGroup * group);
+TQueueThread *TQueueReader(TQueueThread * thread_ptr);
+void TQueueLeaveGroup(TQueue * queue, TQueueThread * thread_ptr);
+void TQueueWakeGroups(TQueue * queue, unsigned long long n);
+int TQueueGroupNext(TQueue * queue, TQueueGroup * group);
+unsigned TQueueGroupClaim(TQueue * queue, TQueueGroup * group,
+						  unsigned long long *num, unsigned max);
+unsigned TQueueGroupPreclaim(TQueue * queue, TQueueThread * thread_ptr,
+							 unsigned max, unsigned long long *num,
+							 TQueueGroup ** group);
+int TQueueGroupTake(TQueue * queue, TQueueGroup * group,
+					unsigned long long num, unsigned n, void **msgs);
+int TQueueGroupRead(TQueue * queue, TQueueGroup * group, void **msgs,
+					int max, unsigned long long num, unsigned n,
+					const struct timespec *deadline);
+void TQueueJournalWrite(TQueue * queue, unsigned long long num);
+void TQueueJournalFlush(TQueue * queue);
+unsigned TQueueJournalRoom(TQueue * queue);
+int TQueueJournalWait(TQueue * queue, const struct timespec *deadline);
+int TQueueJournalFlushing(TQueueJournal * journal);
+char *TQueueJournalRecord(TQueueJournal * journal, unsigned long long num);
+void TQueueJournalClose(TQueueJournal * journal);
+void TQueueReadyArm(TQueue * queue, TQueueThread * thread_ptr);
+void TQueueReadyNotify(TQueue * queue);
+void TQueueReadyUnlink(TQueue * queue, TQueueReady * ready);
+void TQueueReadyDestroy(TQueueReady * ready);
+void TQueueReadyClose(TQueue * queue);
+void TQueueSpaceArm(TQueue * queue);
+void TQueueSignalFd(int fd);
+void TQueueWakeGetters(TQueue * queue);
+void TQueueWakePutters(TQueue * queue, unsigned long long n);
+void TQueueWakeAll(TQueue * queue);
+void TQueueResume(TQueueWaiter * woken);
+TQueueMessage *TQueueSlot(TQueue * queue, unsigned long long num);
+char *TQueuePayload(TQueue * queue, unsigned long long num);
+int TQueueMatch(TQueue * queue, unsigned long long num, void *msg);
+void TQueueReleaseMessage(TQueue * queue, unsigned long long num,
+						  int reason);
+void TQueueReleaseDropped(TQueue * queue, void *msg);
+void **TQueueOut(TQueue * queue, void **msgs, int i);
+unsigned TQueueRingCapacity(unsigned max_size);
+void *TQueueRingAlloc(unsigned *capacity, size_t slot);
+unsigned TQueueRingCapacityLocked(TQueue * queue);
+int TQueueRingResize(TQueue * queue, unsigned capacity);
+unsigned TQueueRingRoom(TQueue * queue, unsigned n);
+int TQueueFull(TQueue * queue);
+void TQueueRemoveHead(TQueue * queue);
+TQueueThread *TQueueFind(TQueue * queue, pthread_t * thread);
+void TQueueAddThread(TQueue * queue, TQueueThread * new_thread);
+void TQueueRemoveThread(TQueue * queue, TQueueThread * thread_ptr);
+void TQueueHashmapRemove(TQueue * queue, TQueueThread * thread_ptr);
+void TQueueLeave(TQueue * queue, TQueueThread * thread_ptr);
+int TQueuePutDeadline(TQueue * queue, void *msg,
+					  const struct timespec *deadline,
+					  unsigned long long *ticket, TQueueWaiter * waiter);
+int TQueueGetDeadline(TQueue * queue, pthread_t * thread, void **msg,
+					  const struct timespec *deadline);
+int TQueueGetHandleDeadline(TQueue * queue,
+							TQueueSubscription * subscription, void **msg,
+							const struct timespec *deadline);
+void TQueueSpin(TQueue * queue, unsigned long long *field);
+int TQueueWait(TQueue * queue, pthread_cond_t * cond, unsigned *locked,
+			   unsigned long long *field, int spin,
+			   const struct timespec *deadline);
+int TQueueWaitSpace(TQueue * queue, const struct timespec *deadline);
+unsigned TQueueLimit(TQueue * queue);
+void TQueueOverwrite(TQueue * queue, unsigned n);
+int TQueueWaitMessage(TQueue * queue, TQueueThread * thread_ptr,
+					  const struct timespec *deadline);
+void TQueueReadMessage(TQueue * queue, TQueueThread * thread_ptr,
+					   void **msg);
+void TQueueReadSlot(TQueue * queue, unsigned long long num, void **msg);
+int TQueueGetMessage(TQueue * queue, TQueueThread * thread_ptr, void **msg,
+					 const struct timespec *deadline);
+int TQueueGetMessages(TQueue * queue, TQueueThread * thread_ptr,
+					  void **msgs, int max);
+void TQueueAppend(TQueue * queue, void *msg);
+void TQueueSignal(pthread_cond_t * cond, unsigned long long n,
+				  unsigned waiting);
+void TQueueWakeSubscribers(TQueue * queue, unsigned long long n);
+void TQueueWakePublishers(TQueue * queue, unsigned long long freed);
+
+void TQueueLockFreeCreate(TQueue * queue);
+int TQueueLockFreeDestroy(TQueue * queue);
+int TQueueLockFreeSubscribe(TQueue * queue, pthread_t * thread);
+int TQueueLockFreeUnsubscribe(TQueue * queue, pthread_t * thread);
+int TQueueLockFreePut(TQueue * queue, void *msg,
+					  const struct timespec *deadline);
+int TQueueLockFreeGet(TQueue * queue, pthread_t * thread, void **msg,
+					  const struct timespec *deadline);
+int TQueueLockFreeGetAvailable(TQueue * queue, pthread_t * thread);
+int TQueueLockFreeUnsupported(TQueue * queue);
+int TQueueLockFreeSetHashmapSize(TQueue * queue, int *hashmap_size);
+int TQueueLockFreeSetSpin(TQueue * queue, int *spin);
+int TQueueLockFreeGetPoolUsage(TQueue * queue, int *used, int *capacity);
+int TQueueLockFreeGetStats(TQueue * queue, TQueueStats * stats);
+int TQueueLockFreePeekSize(TQueue * queue);
+int TQueueLockFreePeekSubscribers(TQueue * queue);
+TQueueSubscription *TQueueLockFreeSubscribeHandle(TQueue * queue);
+int TQueueLockFreeUnsubscribeHandle(TQueue * queue,
+									TQueueSubscription * subscription);
+int TQueueLockFreeGetHandle(TQueue * queue,
+							TQueueSubscription * subscription, void **msg,
+							const struct timespec *deadline);
+int TQueueLockFreeGetAvailableHandle(TQueue * queue,
+									 TQueueSubscription * subscription);
+int TQueueLockFreePutBatch(TQueue * queue, void **msgs, int n);
+int TQueueLockFreeGetBatch(TQueue * queue, pthread_t * thread, void **msgs,
+						   int max);
+int TQueueLockFreeGetBatchHandle(TQueue * queue,
+								 TQueueSubscription * subscription,
+								 void **msgs, int max);
 
 #define DEFAULT_HASHMAP_SIZE 16
 void TQueueCreateQueue(TQueue * queue, int *size) {
@@ -23,32 +275,135 @@ void TQueueCreateQueue(TQueue * queue, int *size) {
 }
 
 void TQueueCreateQueueHash(TQueue * queue, int *size, int *hashmap_size) {
-	queue->max_size = (unsigned)*size;
+	TQueueCreateQueueEngine(queue, size, hashmap_size, TQUEUE_ENGINE_LOCKED);
+}
+
+void TQueueCreateQueueEngine(TQueue * queue, int *size, int *hashmap_size,
+							 int engine) {
+	unsigned capacity;
+
+	queue->max_size = *size > 0 ? (unsigned)*size : 1;
 	queue->size = 0;
 	queue->subscribers = 0;
 	queue->hashmap_size = (unsigned)*hashmap_size;
-
-	queue->hashmap = malloc(queue->hashmap_size * sizeof(TQueueThread *));
-	for (unsigned i = 0; i < queue->hashmap_size; ++i)
-		queue->hashmap[i] = NULL;
-
-	queue->head = malloc(sizeof(TQueueMessage));
-	queue->tail = queue->head;
-	queue->head->message = NULL;
-	queue->head->next = NULL;
+	queue->engine = engine;
+	queue->lockfree = NULL;
+	queue->elem_size = 0;
+	queue->payload = NULL;
+	queue->ops = NULL;
+	queue->release = NULL;
+	queue->release_arg = NULL;
+	queue->inboxes = NULL;
+	queue->groups = NULL;
+	queue->journal = NULL;
+	queue->readies = NULL;
+	queue->armed = 0;
+	queue->space_fd = -1;
+	queue->space_armed = 0;
+	queue->get_waiters = NULL;
+	queue->put_waiters = NULL;
+	queue->put_waiters_last = &queue->put_waiters;
+	queue->woken = NULL;
+	memset(&queue->stats, 0, sizeof(queue->stats));
+	queue->stats_timing = 0;
+	queue->hashmap_version = 0;
+	queue->peekers = 0;
+	queue->retired = NULL;
+	queue->subscriptions = 0;
 
 	queue->destroyed = 0;
 	queue->put_locked = 0;
 	queue->get_locked = 0;
+	queue->spin = 0;
+	queue->spin_limit = 0;
+	queue->policy = TQUEUE_POLICY_BLOCK;
+	queue->max_lag = 0;
 
 	pthread_cond_init(&queue->get_cond, NULL);
 	pthread_cond_init(&queue->put_cond, NULL);
+	pthread_cond_init(&queue->destroy_cond, NULL);
 	pthread_mutex_init(&queue->lock, NULL);
 
+	if (engine == TQUEUE_ENGINE_LOCKFREE) {
+		queue->hashmap = NULL;
+		queue->old_hashmap = NULL;
+		queue->ring = NULL;
+		TQueueLockFreeCreate(queue);
+		dbgprintf("NEW LOCK-FREE QUEUE\n");
+		return;
+	}
+
+	if (queue->hashmap_size < 2)
+		queue->hashmap_size = 2;
+	queue->hashmap = TQueueHashmapAlloc(queue->hashmap_size);
+	queue->hashmap_used = 0;
+	queue->old_hashmap = NULL;
+	queue->old_hashmap_size = 0;
+	queue->rehashed = 0;
+	TQueuePoolInit(&queue->nodes, sizeof(TQueueThread), queue->hashmap_size);
+
+	queue->head = 0;
+	queue->tail = 0;
+	queue->tombstones = 0;
+	queue->evicted = 0;
+	// a smaller ring is grown by the puts which need it
+	capacity = TQueueRingCapacityLocked(queue);
+	queue->ring = TQueueRingAlloc(&capacity, sizeof(TQueueMessage));
+	queue->ring_mask = capacity - 1;
+	queue->ring->message = NULL;
+	queue->ring->count = 0;
+	queue->ring->unsubscribed = 0;
+	queue->ring->num = 0;
+	queue->ring->removed = 0;
+
 	dbgprintf("NEW QUEUE\n");
 	dbgTQueuePrint(queue);
 }
 
+int TQueueCreateQueuePolicy(TQueue * queue, int *size, int policy,
+							int *max_lag) {
+	// an unknown policy would evict as TQUEUE_POLICY_OVERWRITE does
+	if (policy != TQUEUE_POLICY_BLOCK && policy != TQUEUE_POLICY_OVERWRITE
+		&& policy != TQUEUE_POLICY_MAX_LAG)
+		return -2;
+	if (policy == TQUEUE_POLICY_MAX_LAG && max_lag == NULL)
+		return -2;
+
+	TQueueCreateQueue(queue, size);
+	queue->policy = policy;
+	if (policy == TQUEUE_POLICY_MAX_LAG)
+		queue->max_lag = *max_lag > 0 ? (unsigned)*max_lag : 1;
+
+	return 0;
+}
+
+int TQueueCreateQueueTyped(TQueue * queue, int *size, int *elem_size) {
+	if (*elem_size < 1)
+		return -2;
+
+	TQueueCreateQueue(queue, size);
+	queue->elem_size = (unsigned)*elem_size;
+	queue->payload =
+		malloc((size_t)(queue->ring_mask + 1) * queue->elem_size);
+	// the slots of large values may not fit in memory
+	if (queue->payload == NULL) {
+		TQueueDestroyQueue(queue);
+		return -2;
+	}
+
+	return 0;
+}
+
+int TQueueCreateQueueValues(TQueue * queue, int *size, int *elem_size,
+							const TQueueValueOps * ops) {
+	if (*size < 1 || ops == NULL
+		|| TQueueCreateQueueTyped(queue, size, elem_size))
+		return -2;
+	queue->ops = ops;
+
+	return 0;
+}
+
 int TQueueDestroyQueue(TQueue * queue) {
 	if (TQueueDestroyQueue_1(queue))
 		return -1;
@@ -58,56 +413,75 @@ int TQueueDestroyQueue(TQueue * queue) {
 
 int TQueueDestroyQueue_1(TQueue * queue) {
 	int ret = -1;
-	TQueueThread *hashmap_pos;
-	TQueueThread *next_thread;
-	TQueueMessage *node;
+	TQueueInbox *inbox;
+	TQueueInbox *next_inbox;
+	TQueueGroup *group;
+	TQueueGroup *next_group;
 
-	pthread_mutex_lock(&queue->lock);
+	if (queue->engine == TQUEUE_ENGINE_LOCKFREE)
+		return TQueueLockFreeDestroy(queue);
+
+	TQueueLock(queue);
 
 	dbgprintf("DESTROYING QUEUE (1)\n");
 	dbgTQueuePrint(queue);
 
 	if (queue->destroyed)
 		goto end;
-	queue->destroyed = 1;
+	TQueueStore(queue->destroyed, 1);
 
-	while (queue->get_locked) {
-		dbgprintf("REMOVING SUBSCRIBERS\n");
-		pthread_cond_broadcast(&queue->get_cond);
-		pthread_cond_wait(&queue->put_cond, &queue->lock);
-		dbgprintf("RETRY DESTROYING (1)\n");
-	}
-	while (queue->put_locked) {
-		dbgprintf("REMOVING PUBLISHERS\n");
-		pthread_cond_broadcast(&queue->put_cond);
-		pthread_cond_wait(&queue->get_cond, &queue->lock);
-		dbgprintf("RETRY DESTROYING (2)\n");
+	// waiters are woken once, the last one to leave signals destroy_cond
+	pthread_cond_broadcast(&queue->get_cond);
+	pthread_cond_broadcast(&queue->put_cond);
+	for (inbox = queue->inboxes; inbox != NULL; inbox = inbox->next)
+		pthread_cond_broadcast(&inbox->cond);
+	for (group = queue->groups; group != NULL; group = group->next)
+		pthread_cond_broadcast(&group->cond);
+	// event loops learn about the destruction from their next get, the
+	// eventfds stay open until the second step
+	for (TQueueReady * ready = queue->readies; ready != NULL;
+		 ready = ready->next)
+		TQueueSignalFd(ready->fd);
+	TQueueSignalFd(queue->space_fd);
+	// continuations are resumed once the mutex is released and find the
+	// queue destroyed
+	TQueueWakeAll(queue);
+	// a publisher flushing the journal holds on to it as well
+	while (queue->get_locked || queue->put_locked
+		   || (queue->journal != NULL && TQueueJournalFlushing(queue->journal))) {
+		dbgprintf("REMOVING %u SUBSCRIBERS AND %u PUBLISHERS\n",
+				  queue->get_locked, queue->put_locked);
+		TQueueCondWait(queue, &queue->destroy_cond, NULL);
 	}
+	// peeks starting from now find the queue destroyed
+	TQueuePeekDrain(queue);
+	TQueueReclaim(queue);
 
-	for (unsigned i = 0; i < queue->hashmap_size; ++i) {
-		hashmap_pos = queue->hashmap[i];
-		while (hashmap_pos != NULL) {
-			next_thread = hashmap_pos->next;
-			free(hashmap_pos);
-			hashmap_pos = next_thread;
-		}
+	for (inbox = queue->inboxes; inbox != NULL; inbox = next_inbox) {
+		next_inbox = inbox->next;
+		TQueueInboxDestroy(inbox);
 	}
-	free(queue->hashmap);
-
-	node = queue->head;
-	while (node != NULL) {
-		node = node->next;
-		free(queue->head);
-		queue->head = node;
+	for (group = queue->groups; group != NULL; group = next_group) {
+		next_group = group->next;
+		TQueueGroupDestroy(group);
 	}
+	for (unsigned long long num = queue->head; num != queue->tail; ++num)
+		TQueueReleaseMessage(queue, num, TQUEUE_RELEASE_DESTROYED);
+	TQueuePoolDestroy(&queue->nodes);
+	TQueueHashmapFree(queue->hashmap);
+	TQueueHashmapFree(queue->old_hashmap);
+	free(queue->ring);
+	free(queue->payload);
+	TQueueJournalClose(queue->journal);
 
 	pthread_cond_destroy(&queue->get_cond);
 	pthread_cond_destroy(&queue->put_cond);
+	pthread_cond_destroy(&queue->destroy_cond);
 
 	ret = 0;
 
  end:
-	pthread_mutex_unlock(&queue->lock);
+	TQueueUnlock(queue);
 
 	dbgprintf("DESTROYED QUEUE (1)\n");
 
@@ -115,68 +489,88 @@ int TQueueDestroyQueue_1(TQueue * queue) {
 }
 
 void TQueueDestroyQueue_2(TQueue * queue) {
+	TQueueReadyClose(queue);
+	free(queue->lockfree);
 	pthread_mutex_destroy(&queue->lock);
 	dbgprintf("DESTROYED QUEUE (2)\n");
 }
 
 int TQueueSubscribe(TQueue * queue, pthread_t * thread) {
 	int ret = -1;
-	TQueueThread *thread_ptr;
-	TQueueThread *new_thread;
-	unsigned hash;
 
-	pthread_mutex_lock(&queue->lock);
+	if (queue->engine == TQUEUE_ENGINE_LOCKFREE)
+		return TQueueLockFreeSubscribe(queue, thread);
 
-	hash = TQueueHash(queue, thread);
+	TQueueSubscribeNode(queue, thread, 0, NULL, NULL, &ret);
 
-	if (queue->destroyed)
-		goto end;
-	ret = -2;
+	return ret;
+}
 
-	dbgprintf("BEFORE SUBSCRIBE (%p)\n", thread);
-	dbgTQueuePrint(queue);
+TQueueSubscription *TQueueSubscribeHandle(TQueue * queue) {
+	int ret;
 
-	++queue->subscribers;
+	if (queue->engine == TQUEUE_ENGINE_LOCKFREE)
+		return TQueueLockFreeSubscribeHandle(queue);
 
-	if (queue->subscribers > 0x40000000)
-		TQueueSubscriptionsCleanUp(queue);
+	return (TQueueSubscription *) TQueueSubscribeNode(queue, NULL, 0, NULL,
+													  NULL, &ret);
+}
 
-	new_thread = malloc(sizeof(TQueueThread));
-	new_thread->thread = thread;
-	new_thread->next = NULL;
+int TQueueSubscribeTopics(TQueue * queue, pthread_t * thread,
+						  unsigned long long topics) {
+	int ret = -1;
 
-	thread_ptr = queue->hashmap[hash];
-	if (thread_ptr == NULL)
-		queue->hashmap[hash] = new_thread;
-	else {
-		while (thread_ptr->next != NULL && thread_ptr->thread != thread)
-			thread_ptr = thread_ptr->next;
-		if (thread_ptr->thread == thread)
-			goto end;
-		thread_ptr->next = new_thread;
-	}
-	new_thread->message_ptr = queue->tail;
+	if (queue->engine == TQUEUE_ENGINE_LOCKFREE)
+		return TQueueLockFreeUnsupported(queue);
 
-	dbgprintf("AFTER SUBSCRIBE (%p)\n", thread);
-	dbgTQueuePrint(queue);
-	ret = 0;
+	TQueueSubscribeNode(queue, thread, topics, NULL, NULL, &ret);
 
- end:
-	pthread_mutex_unlock(&queue->lock);
+	return ret;
+}
+
+TQueueSubscription *TQueueSubscribeTopicsHandle(TQueue * queue,
+												unsigned long long topics) {
+	int ret;
+
+	if (queue->engine == TQUEUE_ENGINE_LOCKFREE)
+		return NULL;
+
+	return (TQueueSubscription *) TQueueSubscribeNode(queue, NULL, topics,
+													  NULL, NULL, &ret);
+}
+
+int TQueueSubscribeGroup(TQueue * queue, pthread_t * thread,
+						 const char *group) {
+	int ret = -1;
+
+	if (queue->engine == TQUEUE_ENGINE_LOCKFREE)
+		return TQueueLockFreeUnsupported(queue);
+
+	TQueueSubscribeNode(queue, thread, 0, NULL, group, &ret);
 
 	return ret;
 }
 
+TQueueSubscription *TQueueSubscribeGroupHandle(TQueue * queue,
+											   const char *group) {
+	int ret;
+
+	if (queue->engine == TQUEUE_ENGINE_LOCKFREE)
+		return NULL;
+
+	return (TQueueSubscription *) TQueueSubscribeNode(queue, NULL, 0, NULL,
+													  group, &ret);
+}
+
 int TQueueUnsubscribe(TQueue * queue, pthread_t * thread) {
 	int ret = -1;
 	TQueueThread *thread_ptr;
-	TQueueThread *last_ptr;
-	TQueueMessage *message_ptr;
-	unsigned hash;
+	TQueueReady *ready = NULL;
 
-	pthread_mutex_lock(&queue->lock);
+	if (queue->engine == TQUEUE_ENGINE_LOCKFREE)
+		return TQueueLockFreeUnsubscribe(queue, thread);
 
-	hash = TQueueHash(queue, thread);
+	TQueueLock(queue);
 
 	if (queue->destroyed)
 		goto end;
@@ -185,180 +579,286 @@ int TQueueUnsubscribe(TQueue * queue, pthread_t * thread) {
 	dbgprintf("BEFORE UNSUBSCRIBE (%p)\n", thread);
 	dbgTQueuePrint(queue);
 
-	thread_ptr = queue->hashmap[hash];
+	thread_ptr = TQueueFind(queue, thread);
 	if (thread_ptr == NULL)
 		goto end;
-	if (thread_ptr->thread == thread) {
-		queue->hashmap[hash] = thread_ptr->next;
-	} else {
-		while (thread_ptr != NULL && thread_ptr->thread != thread) {
-			last_ptr = thread_ptr;
-			thread_ptr = thread_ptr->next;
-		}
-		if (thread_ptr == NULL)
-			goto end;
-		last_ptr->next = thread_ptr->next;
-	}
+	ready = thread_ptr->ready;
+	TQueueRemoveThread(queue, thread_ptr);
+
+	dbgprintf("AFTER UNSUBSCRIBE (%p)\n", thread);
+	dbgTQueuePrint(queue);
+	ret = 0;
 
-	message_ptr = thread_ptr->message_ptr;
-	--message_ptr->count;
-	++message_ptr->unsubscribed;
+ end:
+	TQueueUnlock(queue);
+	TQueueReadyDestroy(ready);
 
-	if (message_ptr == queue->head && !message_ptr->count) {
-		dbgprintf("REMOVING_UNSUB\n");
-		while (!message_ptr->count && message_ptr->next != NULL) {
-			queue->head = message_ptr->next;
-			queue->head->count -= message_ptr->unsubscribed;
-			queue->head->unsubscribed += message_ptr->unsubscribed;
-			free(message_ptr);
-			--queue->size;
-			message_ptr = queue->head;
-		}
-		pthread_cond_broadcast(&queue->put_cond);
-	}
+	return ret;
+}
 
-	free(thread_ptr);
+int TQueueUnsubscribeHandle(TQueue * queue, TQueueSubscription * subscription) {
+	int ret = -1;
+	TQueueReady *ready = NULL;
 
-	dbgprintf("AFTER UNSUBSCRIBE (%p)\n", thread);
+	if (queue->engine == TQUEUE_ENGINE_LOCKFREE)
+		return TQueueLockFreeUnsubscribeHandle(queue, subscription);
+
+	TQueueLock(queue);
+
+	if (queue->destroyed)
+		goto end;
+
+	ready = ((TQueueThread *) subscription)->ready;
+	TQueueRemoveThread(queue, (TQueueThread *) subscription);
+
+	dbgprintf("AFTER UNSUBSCRIBE HANDLE (%p)\n", subscription);
 	dbgTQueuePrint(queue);
 	ret = 0;
 
  end:
-	pthread_mutex_unlock(&queue->lock);
+	TQueueUnlock(queue);
+	TQueueReadyDestroy(ready);
 
 	return ret;
 }
 
 int TQueuePut(TQueue * queue, void *msg) {
+	return TQueuePutDeadline(queue, msg, NULL, NULL, NULL);
+}
+
+int TQueueTryPut(TQueue * queue, void *msg) {
+	return TQueuePutDeadline(queue, msg, TQUEUE_NOWAIT, NULL, NULL);
+}
+
+int TQueueTimedPut(TQueue * queue, void *msg,
+				   const struct timespec *deadline) {
+	return TQueuePutDeadline(queue, msg, deadline, NULL, NULL);
+}
+
+int TQueuePutTicket(TQueue * queue, void *msg, unsigned long long *ticket) {
+	if (queue->engine == TQUEUE_ENGINE_LOCKFREE)
+		return TQueueLockFreeUnsupported(queue);
+
+	return TQueuePutDeadline(queue, msg, NULL, ticket, NULL);
+}
+
+int TQueuePutBatch(TQueue * queue, void **msgs, int n) {
 	int ret = -1;
-	TQueueMessage *new_message;
 
-	TQueueMessage *tail;
+	if (queue->engine == TQUEUE_ENGINE_LOCKFREE)
+		return TQueueLockFreePutBatch(queue, msgs, n);
 
-	pthread_mutex_lock(&queue->lock);
+	TQueueLock(queue);
 
 	if (queue->destroyed)
 		goto end;
 
-	dbgprintf("TRY PUT (%p)\n", msg);
+	dbgprintf("TRY PUT BATCH (%d)\n", n);
 	dbgTQueuePrint(queue);
 
-	if (queue->subscribers == queue->tail->unsubscribed) {
+	ret = n < 0 ? -2 : 0;
+	if (n <= 0)
+		goto end;
+
+	// a journal keeps messages for later subscribers
+	if (queue->subscribers == TQueueSlot(queue, queue->tail)->unsubscribed
+		&& queue->journal == NULL) {
 		dbgprintf("NO SUBSCRIBERS\n");
-		ret = 0;
+		for (int i = 0; i < n; ++i)
+			TQueueReleaseDropped(queue, msgs[i]);
 		goto end;
 	}
 
-	while (queue->size >= queue->max_size) {
-		dbgprintf("FAIL PUT (%p)\n", msg);
-		++queue->put_locked;
-		pthread_cond_wait(&queue->put_cond, &queue->lock);
-		--queue->put_locked;
-		dbgprintf("RETRY PUT (%p)\n", msg);
-		if (queue->destroyed) {
-			pthread_cond_broadcast(&queue->get_cond);
-			goto end;
-		}
+	TQueueOverwrite(queue, n);
+	ret = TQueueWaitSpace(queue, NULL);
+	if (ret)
+		goto end;
+
+	ret = n;
+	if ((unsigned)n > TQueueLimit(queue) - queue->size)
+		ret = TQueueLimit(queue) - queue->size;
+	if ((unsigned long long)ret > TOMBSTONE_SPAN
+		* (unsigned long long)queue->max_size - (queue->tail - queue->head))
+		ret = TOMBSTONE_SPAN * (unsigned long long)queue->max_size
+			- (queue->tail - queue->head);
+	ret = TQueueRingRoom(queue, ret);
+	if ((unsigned)ret > TQueueJournalRoom(queue))
+		ret = TQueueJournalRoom(queue);
+	for (int i = 0; i < ret; ++i)
+		TQueueAppend(queue, msgs[i]);
+	if (ret < n)
+		TQueueSpaceArm(queue);
+	TQueueWakeSubscribers(queue, ret);
+	// journaled messages nobody was subscribed to
+	if (queue->journal != NULL) {
+		TQueueRemoveRead(queue);
+		TQueueJournalFlush(queue);
 	}
 
-	dbgprintf("BEFORE PUT (%p)\n", msg);
+	dbgprintf("AFTER PUT BATCH (%d/%d)\n", ret, n);
 	dbgTQueuePrint(queue);
 
-	tail = queue->tail;
-	new_message = malloc(sizeof(TQueueMessage));
-	new_message->next = NULL;
-	new_message->unsubscribed = 0;
-	new_message->count = 0;
-	new_message->num = tail->num + 1;
-	if(new_message->num > 0x40000000)
-		TQueueIdCleanup(queue);
+ end:
+	TQueueUnlock(queue);
 
-	++queue->size;
-	tail->message = msg;
-	tail->count = tail->count + queue->subscribers;
-	tail->next = new_message;
-	queue->tail = tail->next;
-	pthread_cond_broadcast(&queue->get_cond);
+	return ret;
+}
 
-	dbgprintf("AFTER PUT (%p)\n", msg);
+int TQueuePutTopic(TQueue * queue, int topic, void *msg) {
+	int ret = -1;
+
+	if (queue->engine == TQUEUE_ENGINE_LOCKFREE)
+		return TQueueLockFreeUnsupported(queue);
+
+	TQueueLock(queue);
+
+	if (queue->destroyed)
+		goto end;
+	ret = -2;
+	if (topic < 0 || topic >= TQUEUE_TOPICS)
+		goto end;
+
+	dbgprintf("TRY PUT TOPIC (%p) %d\n", msg, topic);
 	dbgTQueuePrint(queue);
+
 	ret = 0;
+	if (queue->subscribers == TQueueSlot(queue, queue->tail)->unsubscribed
+		&& !TQueueTopicSubscribed(queue, topic) && queue->journal == NULL) {
+		dbgprintf("NO SUBSCRIBERS\n");
+		TQueueReleaseDropped(queue, msg);
+		goto end;
+	}
+
+	ret = TQueueWaitSpace(queue, NULL);
+	if (ret)
+		goto end;
+
+	TQueueAppend(queue, msg);
+	TQueueDeliver(queue, topic);
+	TQueueWakeSubscribers(queue, 1);
+	// journaled messages nobody was subscribed to
+	if (queue->journal != NULL) {
+		TQueueRemoveRead(queue);
+		TQueueJournalFlush(queue);
+	}
+
+	dbgprintf("AFTER PUT TOPIC (%p) %d\n", msg, topic);
+	dbgTQueuePrint(queue);
 
  end:
-	pthread_mutex_unlock(&queue->lock);
+	TQueueUnlock(queue);
 
 	return ret;
 }
 
 void *TQueueGet(TQueue * queue, pthread_t * thread) {
-	TQueueThread *thread_ptr;
-	TQueueMessage *message_ptr;
 	void *msg = NULL;
-	unsigned hash;
+	if (!queue->elem_size)
+		TQueueGetDeadline(queue, thread, &msg, NULL);
+	return msg;
+}
+
+void *TQueueGetHandle(TQueue * queue, TQueueSubscription * subscription) {
+	void *msg = NULL;
+	if (!queue->elem_size)
+		TQueueGetHandleDeadline(queue, subscription, &msg, NULL);
+	return msg;
+}
 
-	pthread_mutex_lock(&queue->lock);
+int TQueueGetValue(TQueue * queue, pthread_t * thread, void *value) {
+	return TQueueGetDeadline(queue, thread, value, NULL);
+}
+
+int TQueueGetValueHandle(TQueue * queue, TQueueSubscription * subscription,
+						 void *value) {
+	return TQueueGetHandleDeadline(queue, subscription, value, NULL);
+}
+
+int TQueueTryGet(TQueue * queue, pthread_t * thread, void **msg) {
+	return TQueueGetDeadline(queue, thread, msg, TQUEUE_NOWAIT);
+}
+
+int TQueueTryGetHandle(TQueue * queue, TQueueSubscription * subscription,
+					   void **msg) {
+	return TQueueGetHandleDeadline(queue, subscription, msg, TQUEUE_NOWAIT);
+}
+
+int TQueueTimedGet(TQueue * queue, pthread_t * thread, void **msg,
+				   const struct timespec *deadline) {
+	return TQueueGetDeadline(queue, thread, msg, deadline);
+}
+
+int TQueueTimedGetHandle(TQueue * queue, TQueueSubscription * subscription,
+						 void **msg, const struct timespec *deadline) {
+	return TQueueGetHandleDeadline(queue, subscription, msg, deadline);
+}
 
-	hash = TQueueHash(queue, thread);
+int TQueueGetBatch(TQueue * queue, pthread_t * thread, void **msgs, int max) {
+	TQueueThread *thread_ptr;
+	int ret = -1;
+
+	if (queue->engine == TQUEUE_ENGINE_LOCKFREE)
+		return TQueueLockFreeGetBatch(queue, thread, msgs, max);
+
+	TQueueLock(queue);
 
 	if (queue->destroyed)
 		goto end;
+	ret = -2;
 
-	dbgprintf("TRY GET (%p)\n", thread);
+	dbgprintf("TRY GET BATCH (%p)\n", thread);
 	dbgTQueuePrint(queue);
 
-	thread_ptr = queue->hashmap[hash];
-	while (thread_ptr != NULL && thread_ptr->thread != thread) {
-		thread_ptr = thread_ptr->next;
-	}
-	if (thread_ptr == NULL)
-		goto end;
+	// members of a group found by their thread claim with the mutex held
+	thread_ptr = TQueueFind(queue, thread);
+	if (thread_ptr != NULL)
+		ret = TQueueGetMessages(queue, thread_ptr, msgs, max);
 
-	while (thread_ptr->message_ptr->next == NULL) {
-		dbgprintf("FAIL GET (%p)\n", thread);
-		++queue->get_locked;
-		pthread_cond_wait(&queue->get_cond, &queue->lock);
-		--queue->get_locked;
-		dbgprintf("RETRY GET (%p)\n", thread);
-		if (queue->destroyed) {
-			pthread_cond_broadcast(&queue->put_cond);
-			goto end;
-		}
-	}
+ end:
+	TQueueUnlock(queue);
 
-	dbgprintf("BEFORE GET (%p)\n", thread);
-	dbgTQueuePrint(queue);
+	return ret;
+}
 
-	message_ptr = thread_ptr->message_ptr;
-	msg = message_ptr->message;
-	thread_ptr->message_ptr = message_ptr->next;
+int TQueueGetBatchHandle(TQueue * queue, TQueueSubscription * subscription,
+						 void **msgs, int max) {
+	TQueueGroup *group;
+	unsigned long long num;
+	unsigned n = 0;
+	int ret = -1;
 
-	if (!--message_ptr->count) {
-		queue->head = message_ptr->next;
-		queue->head->count -= message_ptr->unsubscribed;
-		queue->head->unsubscribed += message_ptr->unsubscribed;
-		free(message_ptr);
-		--queue->size;
-		pthread_cond_broadcast(&queue->put_cond);
-	}
+	if (queue->engine == TQUEUE_ENGINE_LOCKFREE)
+		return TQueueLockFreeGetBatchHandle(queue, subscription, msgs, max);
 
-	dbgprintf("AFTER GET (%p)\n", thread);
-	dbgTQueuePrint(queue);
+	if (max > 0)
+		n = TQueueGroupPreclaim(queue, (TQueueThread *) subscription,
+								(unsigned)max, &num, &group);
+
+	TQueueLock(queue);
+
+	if (queue->destroyed)
+		goto end;
+
+	if (n)
+		ret = TQueueGroupRead(queue, group, msgs, max, num, n, NULL);
+	else
+		ret = TQueueGetMessages(queue, (TQueueThread *) subscription, msgs,
+								max);
 
  end:
-	pthread_mutex_unlock(&queue->lock);
+	TQueueUnlock(queue);
 
-	return msg;
+	return ret;
 }
 
 int TQueueGetAvailable(TQueue * queue, pthread_t * thread) {
 	TQueueThread *thread_ptr;
-	TQueueMessage *message_ptr;
 	int available = -1;
-	unsigned hash;
 
-	pthread_mutex_lock(&queue->lock);
+	if (queue->engine == TQUEUE_ENGINE_LOCKFREE)
+		return TQueueLockFreeGetAvailable(queue, thread);
 
-	hash = TQueueHash(queue, thread);
+	TQueueLock(queue);
 
 	if (queue->destroyed)
 		goto end;
@@ -367,208 +867,4718 @@ int TQueueGetAvailable(TQueue * queue, pthread_t * thread) {
 	dbgprintf("BEFORE GET_AVAILABLE (%p)\n", thread);
 	dbgTQueuePrint(queue);
 
-	thread_ptr = queue->hashmap[hash];
-	while (thread_ptr != NULL && thread_ptr->thread != thread) {
-		thread_ptr = thread_ptr->next;
-	}
+	thread_ptr = TQueueFind(queue, thread);
 	if (thread_ptr == NULL)
 		goto end;
-	message_ptr = thread_ptr->message_ptr;
 
-	available = queue->tail->num - message_ptr->num;
+	available = (int)TQueuePending(queue, thread_ptr);
 
 	dbgprintf("AFTER GET_AVAILABLE (%p)\n", thread);
 	dbgTQueuePrint(queue);
 
  end:
-	pthread_mutex_unlock(&queue->lock);
+	TQueueUnlock(queue);
 
 	return available;
 }
 
-int TQueueRemoveMsg(TQueue * queue, void *msg) {
-	int ret = -1;
-	TQueueMessage *last_message;
-	TQueueMessage *message_ptr;
+int TQueueGetSkipped(TQueue * queue, pthread_t * thread) {
 	TQueueThread *thread_ptr;
+	int skipped = -1;
 
-	pthread_mutex_lock(&queue->lock);
+	if (queue->engine == TQUEUE_ENGINE_LOCKFREE)
+		return TQueueLockFreeUnsupported(queue);
+
+	TQueueLock(queue);
 
 	if (queue->destroyed)
 		goto end;
+	skipped = -2;
 
-	dbgprintf("BEFORE REMOVE (%p)\n", msg);
-	dbgTQueuePrint(queue);
-
-	message_ptr = queue->head;
-	if (message_ptr->next == NULL) {
-		ret = -2;
+	thread_ptr = TQueueFind(queue, thread);
+	if (thread_ptr == NULL)
 		goto end;
-	}
-	if (message_ptr->message == msg) {
-		queue->head = message_ptr->next;
-	} else {
-		while (message_ptr->next != NULL && message_ptr->message != msg) {
-			--message_ptr->num;
-			last_message = message_ptr;
-			message_ptr = message_ptr->next;
-		}
-		if (message_ptr->next == NULL) {
-			if(message_ptr->num < 0xbfffffff)
-				TQueueIdCleanup(queue);
-			ret = -2;
-			goto end;
-		}
-		last_message->next = message_ptr->next;
-	}
 
-	message_ptr->next->count -= message_ptr->unsubscribed;
-	message_ptr->next->unsubscribed += message_ptr->unsubscribed;
-
-	for (unsigned i = 0; i < queue->hashmap_size; ++i) {
-		thread_ptr = queue->hashmap[i];
-		while (thread_ptr != NULL) {
-			if (thread_ptr->message_ptr == message_ptr)
-				thread_ptr->message_ptr = message_ptr->next;
-			thread_ptr = thread_ptr->next;
-		}
-	}
-
-	free(message_ptr);
-	--queue->size;
-	pthread_cond_broadcast(&queue->put_cond);
-
-	dbgprintf("AFTER REMOVE (%p)\n", msg);
-	dbgTQueuePrint(queue);
-	ret = 0;
+	skipped = TQueueTakeSkipped(queue, thread_ptr);
 
  end:
-	pthread_mutex_unlock(&queue->lock);
+	TQueueUnlock(queue);
 
-	return ret;
+	return skipped;
 }
 
-int TQueueSetSize(TQueue * queue, int *size) {
-	int ret = -1;
-	TQueueMessage *to_remove;
-	TQueueThread *thread_ptr;
+int TQueueGetSkippedHandle(TQueue * queue, TQueueSubscription * subscription) {
+	int skipped = -1;
 
-	pthread_mutex_lock(&queue->lock);
+	if (queue->engine == TQUEUE_ENGINE_LOCKFREE)
+		return TQueueLockFreeUnsupported(queue);
 
-	if (queue->destroyed)
-		goto end;
+	TQueueLock(queue);
 
-	dbgprintf("BEFORE SET_SIZE (%i)\n", *size);
-	dbgTQueuePrint(queue);
+	if (!queue->destroyed)
+		skipped = TQueueTakeSkipped(queue, (TQueueThread *) subscription);
 
-	queue->max_size = *size;
+	TQueueUnlock(queue);
 
-	while (queue->size > queue->max_size) {
-		to_remove = queue->head;
-		dbgprintf("to remove: %p\n", to_remove);
-		queue->head = to_remove->next;
+	return skipped;
+}
 
-		for (unsigned i = 0; i < queue->hashmap_size; ++i) {
-			thread_ptr = queue->hashmap[i];
-			while (thread_ptr != NULL) {
-				if (thread_ptr->message_ptr == to_remove)
-					thread_ptr->message_ptr = to_remove->next;
-				thread_ptr = thread_ptr->next;
-			}
-		}
+int TQueueGetAvailableHandle(TQueue * queue, TQueueSubscription * subscription) {
+	int available = -1;
 
-		to_remove->next->count -= to_remove->unsubscribed;
-		to_remove->next->unsubscribed += to_remove->unsubscribed;
-		free(to_remove);
-		--queue->size;
-	}
+	if (queue->engine == TQUEUE_ENGINE_LOCKFREE)
+		return TQueueLockFreeGetAvailableHandle(queue, subscription);
 
-	dbgprintf("AFTER SET_SIZE (%i)\n", *size);
-	dbgTQueuePrint(queue);
-	ret = 0;
+	TQueueLock(queue);
 
- end:
-	pthread_mutex_unlock(&queue->lock);
+	if (!queue->destroyed)
+		available = (int)TQueuePending(queue,
+									   (TQueueThread *) subscription);
 
-	return ret;
+	TQueueUnlock(queue);
+
+	return available;
+}
+
+int TQueuePeekAvailable(TQueue * queue, pthread_t * thread) {
+	TQueueThread *thread_ptr;
+	int available = -1;
+
+	if (queue->engine == TQUEUE_ENGINE_LOCKFREE)
+		return TQueueLockFreeGetAvailable(queue, thread);
+
+	if (TQueuePeekEnter(queue))
+		return available;
+	available = -2;
+
+	thread_ptr = TQueuePeekFind(queue, thread);
+	if (thread_ptr != NULL)
+		available = TQueuePeekPending(queue, thread_ptr);
+
+	TQueuePeekLeave(queue);
+
+	return available;
+}
+
+int TQueuePeekAvailableHandle(TQueue * queue,
+							  TQueueSubscription * subscription) {
+	int available;
+
+	if (queue->engine == TQUEUE_ENGINE_LOCKFREE)
+		return TQueueLockFreeGetAvailableHandle(queue, subscription);
+
+	if (TQueuePeekEnter(queue))
+		return -1;
+
+	available = TQueuePeekPending(queue, (TQueueThread *) subscription);
+
+	TQueuePeekLeave(queue);
+
+	return available;
+}
+
+int TQueuePeekSize(TQueue * queue) {
+	if (queue->engine == TQUEUE_ENGINE_LOCKFREE)
+		return TQueueLockFreePeekSize(queue);
+
+	if (TQueueLoad(queue->destroyed))
+		return -1;
+	return (int)TQueueLoad(queue->size);
+}
+
+int TQueuePeekMaxSize(TQueue * queue) {
+	if (TQueueLoad(queue->destroyed))
+		return -1;
+	return (int)TQueueLoad(queue->max_size);
+}
+
+int TQueuePeekSubscribers(TQueue * queue) {
+	if (queue->engine == TQUEUE_ENGINE_LOCKFREE)
+		return TQueueLockFreePeekSubscribers(queue);
+
+	if (TQueueLoad(queue->destroyed))
+		return -1;
+	return (int)TQueueLoad(queue->subscriptions);
+}
+
+int TQueueRemoveMsg(TQueue * queue, void *msg) {
+	int ret = -1;
+	unsigned long long num;
+
+	if (queue->engine == TQUEUE_ENGINE_LOCKFREE)
+		return TQueueLockFreeUnsupported(queue);
+
+	TQueueLock(queue);
+
+	if (queue->destroyed)
+		goto end;
+	ret = -2;
+
+	dbgprintf("BEFORE REMOVE (%p)\n", msg);
+	dbgTQueuePrint(queue);
+
+	num = queue->head;
+	while (num != queue->tail && (TQueueSlot(queue, num)->removed
+								  || !TQueueMatch(queue, num, msg)))
+		++num;
+	if (num == queue->tail)
+		goto end;
+
+	TQueueRemoveSlot(queue, num);
+
+	dbgprintf("AFTER REMOVE (%p)\n", msg);
+	dbgTQueuePrint(queue);
+	ret = 0;
+
+ end:
+	TQueueUnlock(queue);
+
+	return ret;
+}
+
+int TQueueRemoveTicket(TQueue * queue, unsigned long long ticket) {
+	int ret = -1;
+
+	if (queue->engine == TQUEUE_ENGINE_LOCKFREE)
+		return TQueueLockFreeUnsupported(queue);
+
+	TQueueLock(queue);
+
+	if (queue->destroyed)
+		goto end;
+	ret = -2;
+
+	dbgprintf("BEFORE REMOVE TICKET (%llu)\n", ticket);
+	dbgTQueuePrint(queue);
+
+	if (ticket < queue->head || ticket >= queue->tail
+		|| TQueueSlot(queue, ticket)->removed)
+		goto end;
+
+	TQueueRemoveSlot(queue, ticket);
+
+	dbgprintf("AFTER REMOVE TICKET (%llu)\n", ticket);
+	dbgTQueuePrint(queue);
+	ret = 0;
+
+ end:
+	TQueueUnlock(queue);
+
+	return ret;
+}
+
+int TQueueSetSize(TQueue * queue, int *size) {
+	int ret = -1;
+	unsigned long long head;
+	unsigned max_size;
+
+	if (queue->engine == TQUEUE_ENGINE_LOCKFREE)
+		return TQueueLockFreeUnsupported(queue);
+
+	TQueueLock(queue);
+
+	if (queue->destroyed)
+		goto end;
+
+	dbgprintf("BEFORE SET_SIZE (%i)\n", *size);
+	dbgTQueuePrint(queue);
+
+	max_size = *size > 0 ? (unsigned)*size : 1;
+	if (max_size > queue->max_size)
+		TQueueWakePublishers(queue, max_size - queue->max_size);
+	TQueueStore(queue->max_size, max_size);
+
+	if (queue->size > queue->max_size) {
+		TQueueEvict(queue, queue->size - queue->max_size);
+		head = queue->head;
+		TQueueRemoveRead(queue);
+		TQueueWakePublishers(queue, queue->head - head);
+	}
+
+	// a larger ring is allocated by the put which needs it, the larger
+	// one is kept if a smaller one cannot be allocated
+	if (TQueueRingCapacityLocked(queue) < queue->ring_mask + 1)
+		TQueueRingResize(queue, TQueueRingCapacityLocked(queue));
+
+	dbgprintf("AFTER SET_SIZE (%i)\n", *size);
+	dbgTQueuePrint(queue);
+	ret = 0;
+
+ end:
+	TQueueUnlock(queue);
+
+	return ret;
 }
 
 int TQueueSetHashmapSize(TQueue * queue, int *hashmap_size) {
 	int ret = -1;
-	unsigned old_size;
+	unsigned size = (unsigned)*hashmap_size;
+
+	if (queue->engine == TQUEUE_ENGINE_LOCKFREE)
+		return TQueueLockFreeSetHashmapSize(queue, hashmap_size);
+
+	TQueueLock(queue);
+
+	if (queue->destroyed)
+		goto end;
+
+	// the subscribers are moved by the following operations, which have
+	// to be done before the new hashmap fills up
+	if (size < (queue->subscriptions + 1) * 4)
+		size = (queue->subscriptions + 1) * 4;
+	TQueueHashmapResize(queue, size);
+
+	ret = 0;
+ end:
+	TQueueUnlock(queue);
+
+	return ret;
+}
+
+int TQueueSetSpin(TQueue * queue, int *spin) {
+	int ret = -1;
+
+	if (queue->engine == TQUEUE_ENGINE_LOCKFREE)
+		return TQueueLockFreeSetSpin(queue, spin);
+
+	TQueueLock(queue);
+
+	if (queue->destroyed)
+		goto end;
+
+	// on a single CPU the thread waited for cannot run while one spins
+	queue->spin = *spin > 0 && sysconf(_SC_NPROCESSORS_ONLN) > 1
+		? (unsigned)*spin : 0;
+	queue->spin_limit = queue->spin;
+
+	ret = 0;
+ end:
+	TQueueUnlock(queue);
+
+	return ret;
+}
+
+int TQueueGetPoolUsage(TQueue * queue, int *used, int *capacity) {
+	int ret = -1;
+
+	if (queue->engine == TQUEUE_ENGINE_LOCKFREE)
+		return TQueueLockFreeGetPoolUsage(queue, used, capacity);
+
+	TQueueLock(queue);
+
+	if (queue->destroyed)
+		goto end;
+
+	*used = (int)queue->nodes.used;
+	*capacity = (int)queue->nodes.capacity;
+
+	ret = 0;
+ end:
+	TQueueUnlock(queue);
+
+	return ret;
+}
+
+int TQueueGetStats(TQueue * queue, TQueueStats * stats) {
+	int ret = -1;
+	TQueueThread *thread_ptr;
+
+	if (queue->engine == TQUEUE_ENGINE_LOCKFREE)
+		return TQueueLockFreeGetStats(queue, stats);
+
+	TQueueLock(queue);
+
+	if (queue->destroyed)
+		goto end;
+
+	*stats = queue->stats;
+	stats->size = queue->size;
+	stats->subscribers = queue->subscriptions;
+	// a group lags behind once, not once for every member
+	for (unsigned i = 0; (thread_ptr = TQueueNextThread(queue, &i)) != NULL;)
+		if (thread_ptr->group == NULL)
+			TQueueLag(stats, TQueuePending(queue, thread_ptr));
+	for (TQueueGroup * group = queue->groups; group != NULL;
+		 group = group->next)
+		TQueueLag(stats, TQueuePending(queue, &group->cursor));
+
+	ret = 0;
+ end:
+	TQueueUnlock(queue);
+
+	return ret;
+}
+
+int TQueueSetStatsTiming(TQueue * queue, int *timing) {
+	int ret = -1;
+
+	TQueueLock(queue);
+
+	if (queue->destroyed)
+		goto end;
+
+	queue->stats_timing = *timing != 0;
+	queue->locked_at = TQueueNow();
+
+	ret = 0;
+ end:
+	TQueueUnlock(queue);
+
+	return ret;
+}
+
+int TQueueSetRelease(TQueue * queue, TQueueReleaseCallback release,
+					 void *arg) {
+	int ret = -1;
+
+	if (queue->engine == TQUEUE_ENGINE_LOCKFREE)
+		return TQueueLockFreeUnsupported(queue);
+
+	TQueueLock(queue);
+
+	if (queue->destroyed)
+		goto end;
+
+	queue->release = release;
+	queue->release_arg = arg;
+
+	ret = 0;
+ end:
+	TQueueUnlock(queue);
+
+	return ret;
+}
+
+// lock-free engine:
+
+// publishers claim sequence numbers on claim and make them visible in order
+// on published, subscribers only advance their own cursor, space is taken
+// back up to head, the lowest cursor, which is refreshed under the mutex
+// only when the queue looks full; the mutex and condition variables are
+// also used to park waiting threads and to (un)subscribe
+
+#define CACHE_LINE 64
+#define ACTIVE_STRIPES 16
+// times a destruction yields to the operations in progress before it
+// sleeps until one of them leaves
+#define DESTROY_YIELDS 16
+
+typedef struct TQueueCursor TQueueCursor;
+typedef struct TQueueCursorSlot TQueueCursorSlot;
+typedef struct TQueueCursorTable TQueueCursorTable;
+
+struct TQueueCursor {
+	_Alignas(CACHE_LINE) _Atomic unsigned long long num;
+	pthread_t id;
+	// num at subscription, messages read are counted from it
+	unsigned long long start;
+};
+
+struct TQueueCursorSlot {
+	_Atomic(pthread_t *) thread;
+	TQueueCursor *cursor;
+};
+
+// open addressing table of subscribers, replaced tables are kept until
+// the queue is destroyed as lookups do not take the mutex
+struct TQueueCursorTable {
+	unsigned size;
+	unsigned used;
+	TQueueCursorTable *retired;
+	TQueueCursorSlot slots[];
+};
+
+struct TQueueLockFree {
+	void **ring;
+	unsigned ring_mask;
+	_Atomic(TQueueCursorTable *) table;
+	_Atomic int subscribers;
+	_Atomic unsigned long long drops;
+	_Alignas(CACHE_LINE) _Atomic unsigned long long claim;
+	_Alignas(CACHE_LINE) _Atomic unsigned long long published;
+	_Alignas(CACHE_LINE) _Atomic unsigned long long head;
+	_Alignas(CACHE_LINE) _Atomic unsigned put_locked;
+	_Atomic unsigned get_locked;
+	_Atomic unsigned char destroyed;
+	// bumped by operations leaving a destroyed queue, the destroying
+	// thread sleeps on it
+	_Atomic unsigned left;
+	// operations in progress, checked by the destroying thread
+	struct {
+		_Alignas(CACHE_LINE) _Atomic unsigned count;
+	} active[ACTIVE_STRIPES];
+};
+
+static pthread_t tombstone;
+#define TOMBSTONE (&tombstone)
+
+unsigned TQueueStripe(void);
+int TQueueLockFreeEnter(TQueueLockFree * lf);
+void TQueueLockFreeLeave(TQueueLockFree * lf);
+TQueueCursorTable *TQueueCursorTableCreate(unsigned size);
+TQueueCursorSlot *TQueueCursorFind(TQueueCursorTable * table,
+								   pthread_t * thread);
+void TQueueCursorInsert(TQueueCursorTable * table, pthread_t * thread,
+						TQueueCursor * cursor);
+void TQueueCursorRehash(TQueueLockFree * lf, unsigned size);
+void TQueueLockFreeAdd(TQueueLockFree * lf, pthread_t * thread,
+					   TQueueCursor * cursor);
+void TQueueLockFreeRemove(TQueue * queue, TQueueCursorSlot * slot);
+int TQueueLockFreeClaim(TQueue * queue, int n, unsigned long long *num,
+						const struct timespec *deadline);
+void TQueueLockFreePublish(TQueue * queue, unsigned long long num, int n);
+long long TQueueLockFreeWaitRead(TQueue * queue, TQueueCursor * cursor,
+								 const struct timespec *deadline);
+int TQueueLockFreeRead(TQueue * queue, TQueueCursor * cursor, void **msg,
+					   const struct timespec *deadline);
+int TQueueLockFreeReadBatch(TQueue * queue, TQueueCursor * cursor,
+							void **msgs, int max);
+void TQueueLockFreeRefreshHead(TQueueLockFree * lf);
+void TQueueLockFreeWake(TQueue * queue, _Atomic unsigned *locked,
+						pthread_cond_t * cond);
+void TQueueLockFreeWakePublishers(TQueue * queue, unsigned long long num);
+
+void TQueueLockFreeCreate(TQueue * queue) {
+	TQueueLockFree *lf = aligned_alloc(CACHE_LINE, sizeof(TQueueLockFree));
+	unsigned capacity = TQueueRingCapacity(queue->max_size);
+
+	// the ring cannot grow, a smaller one holds fewer messages
+	lf->ring = TQueueRingAlloc(&capacity, sizeof(void *));
+	lf->ring_mask = capacity - 1;
+	if (queue->max_size > lf->ring_mask)
+		queue->max_size = lf->ring_mask;
+	atomic_init(&lf->table, TQueueCursorTableCreate(queue->hashmap_size));
+	TQueuePoolInit(&queue->nodes, sizeof(TQueueCursor), queue->hashmap_size);
+	atomic_init(&lf->subscribers, 0);
+	atomic_init(&lf->drops, 0);
+	atomic_init(&lf->claim, 0);
+	atomic_init(&lf->published, 0);
+	atomic_init(&lf->head, 0);
+	atomic_init(&lf->put_locked, 0);
+	atomic_init(&lf->get_locked, 0);
+	atomic_init(&lf->destroyed, 0);
+	atomic_init(&lf->left, 0);
+	for (int i = 0; i < ACTIVE_STRIPES; ++i)
+		atomic_init(&lf->active[i].count, 0);
+
+	queue->lockfree = lf;
+}
+
+int TQueueLockFreeDestroy(TQueue * queue) {
+	TQueueLockFree *lf = queue->lockfree;
+	TQueueCursorTable *table;
+	TQueueCursorTable *retired;
+	unsigned active;
+	unsigned left;
+
+	TQueueLock(queue);
+
+	dbgprintf("DESTROYING LOCK-FREE QUEUE (1)\n");
+
+	if (atomic_load(&lf->destroyed)) {
+		TQueueUnlock(queue);
+		return -1;
+	}
+	atomic_store(&lf->destroyed, 1);
+	// peeks read it without entering the lock-free engine
+	TQueueStore(queue->destroyed, 1);
+
+	// threads check the flag under the mutex before they park on the
+	// condition variables, so they are woken once
+	pthread_cond_broadcast(&queue->get_cond);
+	pthread_cond_broadcast(&queue->put_cond);
+	TQueueUnlock(queue);
+
+	// operations which have started before the flag was set are waited
+	// for as in TQueueDestroySharded
+	for (unsigned yields = 0;; ++yields) {
+		left = atomic_load(&lf->left);
+		active = 0;
+		for (int i = 0; i < ACTIVE_STRIPES; ++i)
+			active += atomic_load(&lf->active[i].count);
+		if (!active)
+			break;
+		dbgprintf("WAITING FOR %u OPERATIONS\n", active);
+		if (yields < DESTROY_YIELDS)
+			sched_yield();
+		else
+			TQueueFutexWait((unsigned *)&lf->left, left);
+	}
+
+	TQueueLock(queue);
+
+	TQueuePoolDestroy(&queue->nodes);
+	table = atomic_load(&lf->table);
+	while (table != NULL) {
+		retired = table->retired;
+		free(table);
+		table = retired;
+	}
+	free(lf->ring);
+
+	pthread_cond_destroy(&queue->get_cond);
+	pthread_cond_destroy(&queue->put_cond);
+	pthread_cond_destroy(&queue->destroy_cond);
+
+	TQueueUnlock(queue);
+
+	dbgprintf("DESTROYED LOCK-FREE QUEUE (1)\n");
+
+	return 0;
+}
+
+int TQueueLockFreeSubscribe(TQueue * queue, pthread_t * thread) {
+	TQueueLockFree *lf = queue->lockfree;
+	int ret = -1;
+
+	if (TQueueLockFreeEnter(lf))
+		return ret;
+	ret = -2;
+
+	TQueueLock(queue);
+
+	if (TQueueReserveNode(queue)) {
+		ret = -1;
+		goto end;
+	}
+	if (TQueueCursorFind(atomic_load(&lf->table), thread) != NULL)
+		goto end;
+
+	TQueueLockFreeAdd(lf, thread, TQueuePoolAlloc(&queue->nodes));
+
+	dbgprintf("LOCK-FREE SUBSCRIBE (%p)\n", thread);
+	ret = 0;
+
+ end:
+	TQueueUnlock(queue);
+	TQueueLockFreeLeave(lf);
+
+	return ret;
+}
+
+TQueueSubscription *TQueueLockFreeSubscribeHandle(TQueue * queue) {
+	TQueueLockFree *lf = queue->lockfree;
+	TQueueCursor *cursor = NULL;
+
+	if (TQueueLockFreeEnter(lf))
+		return NULL;
+
+	TQueueLock(queue);
+
+	if (TQueueReserveNode(queue))
+		goto end;
+	cursor = TQueuePoolAlloc(&queue->nodes);
+	cursor->id = (pthread_t)cursor;
+	TQueueLockFreeAdd(lf, &cursor->id, cursor);
+
+	dbgprintf("LOCK-FREE SUBSCRIBE HANDLE (%p)\n", cursor);
+
+ end:
+	TQueueUnlock(queue);
+	TQueueLockFreeLeave(lf);
+
+	return (TQueueSubscription *) cursor;
+}
+
+int TQueueLockFreeUnsubscribe(TQueue * queue, pthread_t * thread) {
+	TQueueLockFree *lf = queue->lockfree;
+	TQueueCursorSlot *slot;
+	int ret = -1;
+
+	if (TQueueLockFreeEnter(lf))
+		return ret;
+	ret = -2;
+
+	TQueueLock(queue);
+
+	slot = TQueueCursorFind(atomic_load(&lf->table), thread);
+	if (slot == NULL)
+		goto end;
+	TQueueLockFreeRemove(queue, slot);
+
+	dbgprintf("LOCK-FREE UNSUBSCRIBE (%p)\n", thread);
+	ret = 0;
+
+ end:
+	TQueueUnlock(queue);
+	TQueueLockFreeLeave(lf);
+
+	return ret;
+}
+
+int TQueueLockFreeUnsubscribeHandle(TQueue * queue,
+									TQueueSubscription * subscription) {
+	TQueueLockFree *lf = queue->lockfree;
+	TQueueCursor *cursor = (TQueueCursor *) subscription;
+
+	if (TQueueLockFreeEnter(lf))
+		return -1;
+
+	TQueueLock(queue);
+	TQueueLockFreeRemove(queue,
+						 TQueueCursorFind(atomic_load(&lf->table),
+										  &cursor->id));
+	TQueueUnlock(queue);
+
+	dbgprintf("LOCK-FREE UNSUBSCRIBE HANDLE (%p)\n", cursor);
+
+	TQueueLockFreeLeave(lf);
+
+	return 0;
+}
+
+int TQueueLockFreePut(TQueue * queue, void *msg,
+					  const struct timespec *deadline) {
+	TQueueLockFree *lf = queue->lockfree;
+	unsigned long long num;
+	int ret = -1;
+
+	if (TQueueLockFreeEnter(lf))
+		return ret;
+
+	if (!atomic_load_explicit(&lf->subscribers, memory_order_relaxed)) {
+		dbgprintf("NO SUBSCRIBERS\n");
+		atomic_fetch_add_explicit(&lf->drops, 1, memory_order_relaxed);
+		ret = 0;
+		goto end;
+	}
+
+	ret = TQueueLockFreeClaim(queue, 1, &num, deadline);
+	if (ret < 0)
+		goto end;
+	lf->ring[num & lf->ring_mask] = msg;
+	TQueueLockFreePublish(queue, num, 1);
+
+	dbgprintf("LOCK-FREE PUT (%p) %llu\n", msg, num);
+	ret = 0;
+
+ end:
+	TQueueLockFreeLeave(lf);
+
+	return ret;
+}
+
+int TQueueLockFreePutBatch(TQueue * queue, void **msgs, int n) {
+	TQueueLockFree *lf = queue->lockfree;
+	unsigned long long num;
+	int ret = -1;
+
+	if (TQueueLockFreeEnter(lf))
+		return ret;
+
+	ret = n < 0 ? -2 : 0;
+	if (n <= 0)
+		goto end;
+	if (!atomic_load_explicit(&lf->subscribers, memory_order_relaxed)) {
+		atomic_fetch_add_explicit(&lf->drops, n, memory_order_relaxed);
+		goto end;
+	}
+
+	ret = TQueueLockFreeClaim(queue, n, &num, NULL);
+	if (ret < 0)
+		goto end;
+	for (int i = 0; i < ret; ++i)
+		lf->ring[(num + i) & lf->ring_mask] = msgs[i];
+	TQueueLockFreePublish(queue, num, ret);
+
+	dbgprintf("LOCK-FREE PUT BATCH (%d/%d) %llu\n", ret, n, num);
+
+ end:
+	TQueueLockFreeLeave(lf);
+
+	return ret;
+}
+
+int TQueueLockFreeGet(TQueue * queue, pthread_t * thread, void **msg,
+					  const struct timespec *deadline) {
+	TQueueLockFree *lf = queue->lockfree;
+	TQueueCursorSlot *slot;
+	int ret = -1;
+
+	if (TQueueLockFreeEnter(lf))
+		return ret;
+	ret = -2;
+
+	slot = TQueueCursorFind(atomic_load_explicit(&lf->table,
+												 memory_order_acquire),
+							thread);
+	if (slot != NULL)
+		ret = TQueueLockFreeRead(queue, slot->cursor, msg, deadline);
+
+	TQueueLockFreeLeave(lf);
+
+	return ret;
+}
+
+int TQueueLockFreeGetHandle(TQueue * queue,
+							TQueueSubscription * subscription, void **msg,
+							const struct timespec *deadline) {
+	TQueueLockFree *lf = queue->lockfree;
+	int ret;
+
+	if (TQueueLockFreeEnter(lf))
+		return -1;
+
+	ret = TQueueLockFreeRead(queue, (TQueueCursor *) subscription, msg,
+							 deadline);
+
+	TQueueLockFreeLeave(lf);
+
+	return ret;
+}
+
+int TQueueLockFreeGetAvailable(TQueue * queue, pthread_t * thread) {
+	TQueueLockFree *lf = queue->lockfree;
+	TQueueCursorSlot *slot;
+	int available = -1;
+
+	if (TQueueLockFreeEnter(lf))
+		return available;
+	available = -2;
+
+	slot = TQueueCursorFind(atomic_load_explicit(&lf->table,
+												 memory_order_acquire),
+							thread);
+	if (slot != NULL)
+		available = (int)(atomic_load(&lf->published)
+						  - atomic_load(&slot->cursor->num));
+
+	TQueueLockFreeLeave(lf);
+
+	return available;
+}
+
+int TQueueLockFreeGetAvailableHandle(TQueue * queue,
+									 TQueueSubscription * subscription) {
+	TQueueLockFree *lf = queue->lockfree;
+	int available;
+
+	if (TQueueLockFreeEnter(lf))
+		return -1;
+
+	available = (int)(atomic_load(&lf->published)
+					  - atomic_load(&((TQueueCursor *) subscription)->num));
+
+	TQueueLockFreeLeave(lf);
+
+	return available;
+}
+
+int TQueueLockFreeGetBatch(TQueue * queue, pthread_t * thread, void **msgs,
+						   int max) {
+	TQueueLockFree *lf = queue->lockfree;
+	TQueueCursorSlot *slot;
+	int ret = -1;
+
+	if (TQueueLockFreeEnter(lf))
+		return ret;
+	ret = -2;
+
+	slot = TQueueCursorFind(atomic_load_explicit(&lf->table,
+												 memory_order_acquire),
+							thread);
+	if (slot != NULL)
+		ret = TQueueLockFreeReadBatch(queue, slot->cursor, msgs, max);
+
+	TQueueLockFreeLeave(lf);
+
+	return ret;
+}
+
+int TQueueLockFreeGetBatchHandle(TQueue * queue,
+								 TQueueSubscription * subscription,
+								 void **msgs, int max) {
+	TQueueLockFree *lf = queue->lockfree;
+	int ret;
+
+	if (TQueueLockFreeEnter(lf))
+		return -1;
+
+	ret = TQueueLockFreeReadBatch(queue, (TQueueCursor *) subscription,
+								  msgs, max);
+
+	TQueueLockFreeLeave(lf);
+
+	return ret;
+}
+
+int TQueueLockFreeUnsupported(TQueue * queue) {
+	if (atomic_load(&queue->lockfree->destroyed))
+		return -1;
+	return -3;
+}
+
+int TQueueLockFreeSetHashmapSize(TQueue * queue, int *hashmap_size) {
+	TQueueLockFree *lf = queue->lockfree;
+
+	if (TQueueLockFreeEnter(lf))
+		return -1;
+
+	TQueueLock(queue);
+	TQueueCursorRehash(lf, (unsigned)*hashmap_size);
+	TQueueUnlock(queue);
+
+	TQueueLockFreeLeave(lf);
+
+	return 0;
+}
+
+int TQueueLockFreeGetPoolUsage(TQueue * queue, int *used, int *capacity) {
+	TQueueLockFree *lf = queue->lockfree;
+
+	if (TQueueLockFreeEnter(lf))
+		return -1;
+
+	TQueueLock(queue);
+	*used = (int)queue->nodes.used;
+	*capacity = (int)queue->nodes.capacity;
+	TQueueUnlock(queue);
+
+	TQueueLockFreeLeave(lf);
+
+	return 0;
+}
+
+int TQueueLockFreeGetStats(TQueue * queue, TQueueStats * stats) {
+	TQueueLockFree *lf = queue->lockfree;
+	TQueueCursorTable *table;
+	TQueueCursor *cursor;
+	pthread_t *key;
+	unsigned long long published;
+
+	if (TQueueLockFreeEnter(lf))
+		return -1;
+
+	TQueueLock(queue);
+	*stats = queue->stats;
+	published = atomic_load(&lf->published);
+	stats->puts = published;
+	stats->drops = atomic_load(&lf->drops);
+	stats->size = (unsigned)(published - atomic_load(&lf->head));
+	stats->subscribers = (unsigned)atomic_load(&lf->subscribers);
+	table = atomic_load(&lf->table);
+	for (unsigned i = 0; i < table->size; ++i) {
+		key = atomic_load(&table->slots[i].thread);
+		if (key == NULL || key == TOMBSTONE)
+			continue;
+		cursor = table->slots[i].cursor;
+		stats->gets += atomic_load(&cursor->num) - cursor->start;
+		TQueueLag(stats, published - atomic_load(&cursor->num));
+	}
+	TQueueUnlock(queue);
+
+	TQueueLockFreeLeave(lf);
+
+	return 0;
+}
+
+// read without the mutex by spinning threads
+int TQueueLockFreePeekSize(TQueue * queue) {
+	TQueueLockFree *lf = queue->lockfree;
+	unsigned long long head;
+	int size;
+
+	if (TQueueLockFreeEnter(lf))
+		return -1;
+
+	// head is read first, it never passes published
+	head = atomic_load(&lf->head);
+	size = (int)(atomic_load(&lf->published) - head);
+
+	TQueueLockFreeLeave(lf);
+
+	return size;
+}
+
+int TQueueLockFreePeekSubscribers(TQueue * queue) {
+	TQueueLockFree *lf = queue->lockfree;
+	int subscribers;
+
+	if (TQueueLockFreeEnter(lf))
+		return -1;
+
+	subscribers = atomic_load(&lf->subscribers);
+
+	TQueueLockFreeLeave(lf);
+
+	return subscribers;
+}
+
+int TQueueLockFreeSetSpin(TQueue * queue, int *spin) {
+	TQueueLockFree *lf = queue->lockfree;
+
+	if (TQueueLockFreeEnter(lf))
+		return -1;
+
+	TQueueStore(queue->spin, *spin > 0 && sysconf(_SC_NPROCESSORS_ONLN) > 1
+				? (unsigned)*spin : 0);
+
+	TQueueLockFreeLeave(lf);
+
+	return 0;
+}
+
+unsigned TQueueStripe(void) {
+	static _Atomic unsigned next_stripe;
+	static _Thread_local int stripe = -1;
+	if (stripe < 0)
+		stripe = atomic_fetch_add(&next_stripe, 1) % ACTIVE_STRIPES;
+	return stripe;
+}
+
+int TQueueLockFreeEnter(TQueueLockFree * lf) {
+	unsigned stripe = TQueueStripe();
+	atomic_fetch_add(&lf->active[stripe].count, 1);
+	if (atomic_load(&lf->destroyed)) {
+		TQueueLockFreeLeave(lf);
+		return -1;
+	}
+	return 0;
+}
+
+// the operation emptying a stripe of a destroyed queue wakes the
+// destroying thread
+void TQueueLockFreeLeave(TQueueLockFree * lf) {
+	if (atomic_fetch_sub(&lf->active[TQueueStripe()].count, 1) == 1
+		&& atomic_load(&lf->destroyed)) {
+		atomic_fetch_add(&lf->left, 1);
+		TQueueFutexWake((unsigned *)&lf->left);
+	}
+}
+
+TQueueCursorTable *TQueueCursorTableCreate(unsigned size) {
+	TQueueCursorTable *table;
+	if (size < 2)
+		size = 2;
+	table = malloc(sizeof(TQueueCursorTable) + size * sizeof(TQueueCursorSlot));
+	table->size = size;
+	table->used = 0;
+	table->retired = NULL;
+	for (unsigned i = 0; i < size; ++i) {
+		atomic_init(&table->slots[i].thread, NULL);
+		table->slots[i].cursor = NULL;
+	}
+	return table;
+}
+
+TQueueCursorSlot *TQueueCursorFind(TQueueCursorTable * table,
+								   pthread_t * thread) {
+	unsigned i = TQueueHashSize(thread, table->size);
+	pthread_t *key;
+	while ((key = atomic_load_explicit(&table->slots[i].thread,
+									   memory_order_acquire)) != NULL) {
+		if (key == thread)
+			return &table->slots[i];
+		i = (i + 1) % table->size;
+	}
+	return NULL;
+}
+
+// called with the mutex held, the cursor is written before the key
+// so that a lookup finding the key also sees the cursor
+void TQueueCursorInsert(TQueueCursorTable * table, pthread_t * thread,
+						TQueueCursor * cursor) {
+	unsigned i = TQueueHashSize(thread, table->size);
+	pthread_t *key;
+	while ((key = atomic_load(&table->slots[i].thread)) != NULL
+		   && key != TOMBSTONE)
+		i = (i + 1) % table->size;
+	if (key == NULL)
+		++table->used;
+	table->slots[i].cursor = cursor;
+	atomic_store_explicit(&table->slots[i].thread, thread,
+						  memory_order_release);
+}
+
+// called with the mutex held, tombstones are dropped
+void TQueueCursorRehash(TQueueLockFree * lf, unsigned size) {
+	TQueueCursorTable *old_table = atomic_load(&lf->table);
+	TQueueCursorTable *table;
+	pthread_t *key;
+	unsigned live = 0;
+
+	for (unsigned i = 0; i < old_table->size; ++i) {
+		key = atomic_load(&old_table->slots[i].thread);
+		if (key != NULL && key != TOMBSTONE)
+			++live;
+	}
+	if (size < live * 2 + 2)
+		size = live * 2 + 2;
+
+	table = TQueueCursorTableCreate(size);
+	for (unsigned i = 0; i < old_table->size; ++i) {
+		key = atomic_load(&old_table->slots[i].thread);
+		if (key != NULL && key != TOMBSTONE)
+			TQueueCursorInsert(table, key, old_table->slots[i].cursor);
+	}
+	table->retired = old_table;
+	atomic_store_explicit(&lf->table, table, memory_order_release);
+}
+
+// called with the mutex held, a new cursor is never behind head, so
+// publishers which have computed head earlier still cannot overwrite
+// its messages
+void TQueueLockFreeAdd(TQueueLockFree * lf, pthread_t * thread,
+					   TQueueCursor * cursor) {
+	TQueueCursorTable *table = atomic_load(&lf->table);
+
+	if ((table->used + 1) * 2 > table->size) {
+		TQueueCursorRehash(lf, table->size * 2);
+		table = atomic_load(&lf->table);
+	}
+
+	atomic_init(&cursor->num, atomic_load(&lf->published));
+	cursor->start = atomic_load(&cursor->num);
+	TQueueCursorInsert(table, thread, cursor);
+	atomic_fetch_add(&lf->subscribers, 1);
+}
+
+// called with the mutex held
+void TQueueLockFreeRemove(TQueue * queue, TQueueCursorSlot * slot) {
+	TQueueLockFree *lf = queue->lockfree;
+
+	atomic_store(&slot->thread, TOMBSTONE);
+	// reads of live cursors are counted when the stats are taken
+	queue->stats.gets += atomic_load(&slot->cursor->num) - slot->cursor->start;
+	TQueuePoolFree(&queue->nodes, slot->cursor);
+	atomic_fetch_sub(&lf->subscribers, 1);
+
+	if (atomic_load(&lf->put_locked)) {
+		TQueueLockFreeRefreshHead(lf);
+		pthread_cond_broadcast(&queue->put_cond);
+	}
+}
+
+// claims up to n sequence numbers starting at *num, waiting until at least
+// one is free, returns the number of claimed ones, -1 if the queue gets
+// destroyed or -4 if the deadline passes; while spinning head is refreshed
+// only when the mutex happens to be free
+int TQueueLockFreeClaim(TQueue * queue, int n, unsigned long long *num,
+						const struct timespec *deadline) {
+	TQueueLockFree *lf = queue->lockfree;
+	unsigned long long head;
+	unsigned long long claimed;
+	unsigned spin = 0;
+	int full;
+	int rc = 0;
+
+	if (deadline != TQUEUE_NOWAIT)
+		spin = TQueueLoad(queue->spin);
+
+	*num = atomic_load_explicit(&lf->claim, memory_order_relaxed);
+	for (;;) {
+		head = atomic_load_explicit(&lf->head, memory_order_acquire);
+		if (*num < head + queue->max_size) {
+			claimed = head + queue->max_size - *num;
+			if (claimed > (unsigned long long)n)
+				claimed = n;
+			if (atomic_compare_exchange_weak(&lf->claim, num,
+											 *num + claimed))
+				return (int)claimed;
+			continue;
+		}
+
+		if (spin) {
+			if (atomic_load_explicit(&lf->destroyed, memory_order_relaxed))
+				return -1;
+			if (!(--spin % 16) && !pthread_mutex_trylock(&queue->lock)) {
+				TQueueLockFreeRefreshHead(lf);
+				pthread_mutex_unlock(&queue->lock);
+			}
+			cpu_relax();
+			*num = atomic_load_explicit(&lf->claim, memory_order_relaxed);
+			continue;
+		}
+
+		TQueueLock(queue);
+		atomic_fetch_add(&lf->put_locked, 1);
+		TQueueLockFreeRefreshHead(lf);
+		while ((full = *num >= atomic_load(&lf->head) + queue->max_size)) {
+			dbgprintf("FAIL LOCK-FREE PUT\n");
+			if (atomic_load(&lf->destroyed) || deadline == TQUEUE_NOWAIT
+				|| rc == ETIMEDOUT)
+				break;
+			rc = TQueueCondWait(queue, &queue->put_cond, deadline);
+			// whoever woke the publisher has refreshed head already
+			if (rc == ETIMEDOUT)
+				TQueueLockFreeRefreshHead(lf);
+		}
+		atomic_fetch_sub(&lf->put_locked, 1);
+		TQueueUnlock(queue);
+		if (atomic_load(&lf->destroyed))
+			return -1;
+		if (full)
+			return -4;
+		*num = atomic_load_explicit(&lf->claim, memory_order_relaxed);
+	}
+}
+
+// makes claimed messages visible, earlier claims have to be published first
+void TQueueLockFreePublish(TQueue * queue, unsigned long long num, int n) {
+	TQueueLockFree *lf = queue->lockfree;
+
+	while (atomic_load_explicit(&lf->published, memory_order_acquire) != num)
+		sched_yield();
+	atomic_store(&lf->published, num + n);
+
+	TQueueLockFreeWake(queue, &lf->get_locked, &queue->get_cond);
+}
+
+// returns the number of available messages of the cursor, waiting until
+// there is at least one, -1 if the queue gets destroyed or -4 if the
+// deadline passes
+long long TQueueLockFreeWaitRead(TQueue * queue, TQueueCursor * cursor,
+								 const struct timespec *deadline) {
+	TQueueLockFree *lf = queue->lockfree;
+	unsigned long long num;
+	unsigned long long published;
+	unsigned spin = 0;
+	int rc = 0;
+
+	if (deadline != TQUEUE_NOWAIT)
+		spin = TQueueLoad(queue->spin);
+
+	num = atomic_load_explicit(&cursor->num, memory_order_relaxed);
+	for (unsigned i = 0;; ++i) {
+		published = atomic_load_explicit(&lf->published,
+										 memory_order_acquire);
+		if (published != num)
+			return published - num;
+		if (i >= spin)
+			break;
+		if (atomic_load_explicit(&lf->destroyed, memory_order_relaxed))
+			return -1;
+		cpu_relax();
+	}
+	if (deadline == TQUEUE_NOWAIT)
+		return atomic_load(&lf->destroyed) ? -1 : -4;
+
+	TQueueLock(queue);
+	atomic_fetch_add(&lf->get_locked, 1);
+	while ((published = atomic_load(&lf->published)) == num
+		   && !atomic_load(&lf->destroyed) && rc != ETIMEDOUT) {
+		dbgprintf("FAIL LOCK-FREE GET (%p)\n", cursor);
+		rc = TQueueCondWait(queue, &queue->get_cond, deadline);
+	}
+	atomic_fetch_sub(&lf->get_locked, 1);
+	TQueueUnlock(queue);
+
+	if (atomic_load(&lf->destroyed))
+		return -1;
+	if (published == num)
+		return -4;
+	return published - num;
+}
+
+// returns 0 on success, -1 if the queue gets destroyed or -4 if
+// the deadline passes while waiting for a message
+int TQueueLockFreeRead(TQueue * queue, TQueueCursor * cursor, void **msg,
+					   const struct timespec *deadline) {
+	TQueueLockFree *lf = queue->lockfree;
+	unsigned long long num;
+	long long available;
+
+	available = TQueueLockFreeWaitRead(queue, cursor, deadline);
+	if (available < 0)
+		return (int)available;
+
+	num = atomic_load_explicit(&cursor->num, memory_order_relaxed);
+	*msg = lf->ring[num & lf->ring_mask];
+	atomic_store(&cursor->num, num + 1);
+
+	TQueueLockFreeWakePublishers(queue, num);
+
+	dbgprintf("LOCK-FREE GET (%p) %llu\n", cursor, num);
+
+	return 0;
+}
+
+int TQueueLockFreeReadBatch(TQueue * queue, TQueueCursor * cursor,
+							void **msgs, int max) {
+	TQueueLockFree *lf = queue->lockfree;
+	unsigned long long num;
+	long long available;
+
+	if (max <= 0)
+		return max < 0 ? -2 : 0;
+	available = TQueueLockFreeWaitRead(queue, cursor, NULL);
+	if (available < 0)
+		return -1;
+	if (available < max)
+		max = (int)available;
+
+	num = atomic_load_explicit(&cursor->num, memory_order_relaxed);
+	for (int i = 0; i < max; ++i)
+		msgs[i] = lf->ring[(num + i) & lf->ring_mask];
+	atomic_store(&cursor->num, num + max);
+
+	TQueueLockFreeWakePublishers(queue, num);
+
+	dbgprintf("LOCK-FREE GET BATCH (%p) %llu %d\n", cursor, num, max);
+
+	return max;
+}
+
+// called with the mutex held
+void TQueueLockFreeRefreshHead(TQueueLockFree * lf) {
+	TQueueCursorTable *table = atomic_load(&lf->table);
+	unsigned long long head = atomic_load(&lf->published);
+	unsigned long long num;
+	pthread_t *key;
+
+	for (unsigned i = 0; i < table->size; ++i) {
+		key = atomic_load(&table->slots[i].thread);
+		if (key == NULL || key == TOMBSTONE)
+			continue;
+		num = atomic_load(&table->slots[i].cursor->num);
+		if (num < head)
+			head = num;
+	}
+	atomic_store(&lf->head, head);
+}
+
+// waiters increment the counter under the mutex before checking their
+// condition, so checking it after publishing progress cannot miss them
+void TQueueLockFreeWake(TQueue * queue, _Atomic unsigned *locked,
+						pthread_cond_t * cond) {
+	if (!atomic_load(locked))
+		return;
+	TQueueLock(queue);
+	pthread_cond_broadcast(cond);
+	TQueueUnlock(queue);
+}
+
+// called after a cursor has moved from num, publishers wait only for head,
+// so unless the cursor was at head nothing has been freed, otherwise head
+// is refreshed for them and as many are woken as slots have been freed
+void TQueueLockFreeWakePublishers(TQueue * queue, unsigned long long num) {
+	TQueueLockFree *lf = queue->lockfree;
+	unsigned long long head;
+
+	if (!atomic_load(&lf->put_locked))
+		return;
+	TQueueLock(queue);
+	head = atomic_load(&lf->head);
+	if (num == head) {
+		TQueueLockFreeRefreshHead(lf);
+		TQueueSignal(&queue->put_cond, atomic_load(&lf->head) - head,
+					 atomic_load(&lf->put_locked));
+	}
+	TQueueUnlock(queue);
+}
+
+// readiness:
+
+TQueueReady *TQueueReadyCreate(void);
+int TQueueReadyAttach(TQueue * queue, TQueueThread * thread_ptr,
+					  TQueueReady ** ready, int *fd);
+
+int TQueueGetReadyFd(TQueue * queue, pthread_t * thread, int *fd) {
+	int ret = -1;
+	TQueueThread *thread_ptr;
+	TQueueReady *ready;
+
+	if (queue->engine == TQUEUE_ENGINE_LOCKFREE)
+		return TQueueLockFreeUnsupported(queue);
+
+	// created with the mutex released, dropped if the thread has one
+	ready = TQueueReadyCreate();
+
+	TQueueLock(queue);
+
+	if (queue->destroyed)
+		goto end;
+	ret = -2;
+
+	thread_ptr = TQueueFind(queue, thread);
+	if (thread_ptr == NULL)
+		goto end;
+	ret = TQueueReadyAttach(queue, thread_ptr, &ready, fd);
+
+ end:
+	TQueueUnlock(queue);
+	TQueueReadyDestroy(ready);
+
+	return ret;
+}
+
+int TQueueGetReadyFdHandle(TQueue * queue, TQueueSubscription * subscription,
+						   int *fd) {
+	int ret = -1;
+	TQueueReady *ready;
+
+	if (queue->engine == TQUEUE_ENGINE_LOCKFREE)
+		return TQueueLockFreeUnsupported(queue);
+
+	ready = TQueueReadyCreate();
+
+	TQueueLock(queue);
+
+	if (!queue->destroyed)
+		ret = TQueueReadyAttach(queue, (TQueueThread *) subscription, &ready,
+								fd);
+
+	TQueueUnlock(queue);
+	TQueueReadyDestroy(ready);
+
+	return ret;
+}
+
+int TQueueGetSpaceFd(TQueue * queue, int *fd) {
+	int ret = -1;
+	int new_fd;
+
+	if (queue->engine == TQUEUE_ENGINE_LOCKFREE)
+		return TQueueLockFreeUnsupported(queue);
+
+	new_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+	TQueueLock(queue);
+
+	if (queue->destroyed)
+		goto end;
+	ret = -2;
+
+	if (queue->space_fd < 0) {
+		if (new_fd < 0)
+			goto end;
+		queue->space_fd = new_fd;
+		new_fd = -1;
+		// room which is already there is signalled right away
+		if (!TQueueFull(queue))
+			TQueueSignalFd(queue->space_fd);
+		else
+			queue->space_armed = 1;
+	}
+	*fd = queue->space_fd;
+
+	ret = 0;
+ end:
+	TQueueUnlock(queue);
+	if (new_fd >= 0)
+		close(new_fd);
+
+	return ret;
+}
+
+TQueueReady *TQueueReadyCreate(void) {
+	TQueueReady *ready;
+	int fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+	if (fd < 0)
+		return NULL;
+	ready = malloc(sizeof(TQueueReady));
+	ready->fd = fd;
+	ready->armed = 0;
+	ready->thread = NULL;
+	ready->next = NULL;
+	return ready;
+}
+
+void TQueueReadyDestroy(TQueueReady * ready) {
+	if (ready == NULL)
+		return;
+	close(ready->fd);
+	free(ready);
+}
+
+// called with the mutex held, gives the thread the eventfd in ready
+// unless it already has one, ready is set to NULL once it is taken
+int TQueueReadyAttach(TQueue * queue, TQueueThread * thread_ptr,
+					  TQueueReady ** ready, int *fd) {
+	// members of a group share its eventfd
+	thread_ptr = TQueueReader(thread_ptr);
+	if (thread_ptr->ready == NULL) {
+		if (*ready == NULL)
+			return -2;
+		thread_ptr->ready = *ready;
+		*ready = NULL;
+		thread_ptr->ready->thread = thread_ptr;
+		thread_ptr->ready->next = queue->readies;
+		queue->readies = thread_ptr->ready;
+		// messages which are already there are signalled right away
+		if (TQueueNextMessage(queue, thread_ptr))
+			TQueueSignalFd(thread_ptr->ready->fd);
+		else
+			TQueueReadyArm(queue, thread_ptr);
+	}
+	*fd = thread_ptr->ready->fd;
+	return 0;
+}
+
+// the thread has found no message, the next one put for it writes to
+// its eventfd
+void TQueueReadyArm(TQueue * queue, TQueueThread * thread_ptr) {
+	TQueueReady *ready = thread_ptr->ready;
+
+	if (ready == NULL || ready->armed)
+		return;
+	ready->armed = 1;
+	++queue->armed;
+}
+
+// called with the mutex held after a put, writes to the eventfds of armed
+// subscribers which have a message now and disarms them, so following
+// puts do not write again until the subscriber runs out of messages
+void TQueueReadyNotify(TQueue * queue) {
+	for (TQueueReady * ready = queue->readies; ready != NULL;
+		 ready = ready->next) {
+		if (!ready->armed || !TQueueNextMessage(queue, ready->thread))
+			continue;
+		ready->armed = 0;
+		--queue->armed;
+		TQueueSignalFd(ready->fd);
+	}
+}
+
+void TQueueReadyUnlink(TQueue * queue, TQueueReady * ready) {
+	TQueueReady **link;
+
+	for (link = &queue->readies; *link != ready; link = &(*link)->next) ;
+	*link = ready->next;
+	if (ready->armed)
+		--queue->armed;
+}
+
+// called in the second step of the destruction, when no thread uses the
+// eventfds any more
+void TQueueReadyClose(TQueue * queue) {
+	TQueueReady *next;
+
+	for (TQueueReady * ready = queue->readies; ready != NULL; ready = next) {
+		next = ready->next;
+		TQueueReadyDestroy(ready);
+	}
+	queue->readies = NULL;
+	if (queue->space_fd >= 0)
+		close(queue->space_fd);
+	queue->space_fd = -1;
+}
+
+// a put has found the queue full, the next freed slot writes to the space
+// eventfd
+void TQueueSpaceArm(TQueue * queue) {
+	if (queue->space_fd >= 0)
+		queue->space_armed = 1;
+}
+
+// the eventfd counter is non-blocking, it only fails to grow when it is
+// about to overflow, and then it is readable anyway
+void TQueueSignalFd(int fd) {
+	unsigned long long one = 1;
+
+	if (fd < 0)
+		return;
+	if (write(fd, &one, sizeof(one)) < 0) {
+		dbgprintf("EVENTFD WRITE FAILED (%d)\n", fd);
+	}
+}
+
+// asynchronous operations:
+
+int TQueueGetAsync(TQueue * queue, TQueueSubscription * subscription,
+				   void **msg, TQueueWaiter * waiter) {
+	int ret = -1;
+	TQueueThread *thread_ptr;
+
+	if (queue->engine == TQUEUE_ENGINE_LOCKFREE)
+		return TQueueLockFreeUnsupported(queue);
+
+	TQueueLock(queue);
+
+	// waiters are woken by the destruction after the nodes have been freed
+	if (queue->destroyed)
+		goto end;
+
+	thread_ptr = TQueueReader((TQueueThread *) subscription);
+	ret = TQueueGetMessage(queue, thread_ptr, msg, TQUEUE_NOWAIT);
+	if (ret == -4) {
+		waiter->thread = thread_ptr;
+		waiter->next = queue->get_waiters;
+		queue->get_waiters = waiter;
+	}
+
+ end:
+	TQueueUnlock(queue);
+
+	return ret;
+}
+
+int TQueuePutAsync(TQueue * queue, void *msg, TQueueWaiter * waiter) {
+	if (queue->engine == TQUEUE_ENGINE_LOCKFREE)
+		return TQueueLockFreeUnsupported(queue);
+
+	return TQueuePutDeadline(queue, msg, TQUEUE_NOWAIT, NULL, waiter);
+}
+
+// called with the mutex held after a put, moves the waiters of
+// subscribers which have a message now to woken
+void TQueueWakeGetters(TQueue * queue) {
+	TQueueWaiter **link = &queue->get_waiters;
+	TQueueWaiter *waiter;
+
+	while ((waiter = *link) != NULL) {
+		if (!TQueueNextMessage(queue, waiter->thread)) {
+			link = &waiter->next;
+			continue;
+		}
+		*link = waiter->next;
+		waiter->next = queue->woken;
+		queue->woken = waiter;
+	}
+}
+
+// called with the mutex held when n slots have been freed, moves as many
+// of the oldest waiting puts to woken
+void TQueueWakePutters(TQueue * queue, unsigned long long n) {
+	TQueueWaiter *waiter;
+
+	while (n-- && (waiter = queue->put_waiters) != NULL) {
+		queue->put_waiters = waiter->next;
+		waiter->next = queue->woken;
+		queue->woken = waiter;
+	}
+	if (queue->put_waiters == NULL)
+		queue->put_waiters_last = &queue->put_waiters;
+}
+
+// called when the queue is destroyed
+void TQueueWakeAll(TQueue * queue) {
+	TQueueWakePutters(queue, ~0ULL);
+	while (queue->get_waiters != NULL) {
+		TQueueWaiter *waiter = queue->get_waiters;
+		queue->get_waiters = waiter->next;
+		waiter->next = queue->woken;
+		queue->woken = waiter;
+	}
+}
+
+// woken holds the waiters in reverse order, the oldest is resumed first,
+// a waiter is not touched after its wake function has been called
+void TQueueResume(TQueueWaiter * woken) {
+	TQueueWaiter *waiters = NULL;
+	TQueueWaiter *next;
+
+	while (woken != NULL) {
+		next = woken->next;
+		woken->next = waiters;
+		waiters = woken;
+		woken = next;
+	}
+	while (waiters != NULL) {
+		next = waiters->next;
+		waiters->wake(waiters);
+		waiters = next;
+	}
+}
+
+// journal:
+
+// segment k of the journal is the file path.k holding values with sequence
+// numbers from k * records on after a header, segments are mapped when
+// they are opened and values are copied to them by the publisher holding
+// the mutex, the oldest segment is retired when one more than count would
+// be kept; after its put a publisher flushes the journal with the mutex
+// released, removing the retired segments, mapping the next one ahead of
+// time and writing values back with msync; puts only take the segment
+// mapped ahead of time, one which needs it before it is there waits for it
+
+#define JOURNAL_HEADER 64
+#define JOURNAL_RETIRED 2
+
+typedef struct TQueueSegment TQueueSegment;
+typedef struct TQueueSegmentHeader TQueueSegmentHeader;
+
+// values are written from first on, count of them is updated after
+// every value
+struct TQueueSegmentHeader {
+	unsigned long long first;
+	unsigned long long count;
+	unsigned elem_size;
+	unsigned records;
+};
+
+struct TQueueSegment {
+	unsigned long long k;
+	char *map;
+};
+
+struct TQueueJournal {
+	char *path;
+	unsigned elem_size;
+	unsigned records;
+	unsigned sync;
+	unsigned char failed;
+	// oldest value kept, first value not written yet and first value
+	// not written back to the file with msync
+	unsigned long long first;
+	unsigned long long written;
+	unsigned long long synced;
+	// the segment after the one being written mapped ahead of time, the
+	// segments new ones have taken the place of which have not been
+	// removed yet, whether a publisher is flushing with the mutex released
+	// and whether puts are waiting for it to map the spare one
+	TQueueSegment spare;
+	TQueueSegment retired[JOURNAL_RETIRED];
+	unsigned retiring;
+	unsigned char flushing;
+	unsigned char waiting;
+	unsigned count;
+	TQueueSegment segments[];
+};
+
+size_t TQueueJournalLength(TQueueJournal * journal);
+void TQueueJournalName(TQueueJournal * journal, unsigned long long k,
+					   char *name);
+char *TQueueJournalMap(TQueueJournal * journal, unsigned long long k,
+					   int create);
+void TQueueJournalRemove(TQueueJournal * journal, TQueueSegment * segment);
+int TQueueJournalStart(TQueueJournal * journal, unsigned long long num,
+					   char *map);
+unsigned TQueueJournalDirty(TQueueJournal * journal, char **maps,
+							size_t *lengths);
+void TQueueJournalSync(TQueueJournal * journal);
+void TQueueJournalRelease(TQueueJournal * journal);
+int TQueueJournalBlank(TQueueJournal * journal, unsigned long long k);
+void TQueueJournalFail(TQueueJournal * journal, unsigned long long num);
+int TQueueJournalFind(TQueueJournal * journal, unsigned long long *oldest,
+					  unsigned long long *newest);
+int TQueueJournalRecover(TQueue * queue, TQueueJournal * journal);
+void TQueueMoveTail(TQueue * queue, unsigned long long num);
+
+int TQueueOpenJournal(TQueue * queue, const char *path, int *segment_size,
+					  int *segments, int *sync) {
+	int ret = -1;
+	TQueueJournal *journal = NULL;
+	unsigned count = *segments > 0 ? (unsigned)*segments : 1;
+
+	if (queue->engine == TQUEUE_ENGINE_LOCKFREE)
+		return TQueueLockFreeUnsupported(queue);
+
+	TQueueLock(queue);
+
+	if (queue->destroyed)
+		goto end;
+	ret = -2;
+	if (!queue->elem_size || queue->ops != NULL || queue->journal != NULL)
+		goto end;
+
+	journal = malloc(sizeof(TQueueJournal) + count * sizeof(TQueueSegment));
+	journal->path = strdup(path);
+	journal->elem_size = queue->elem_size;
+	journal->records = *segment_size > 0 ? (unsigned)*segment_size : 1;
+	journal->sync = *sync > 0 ? (unsigned)*sync : 0;
+	journal->failed = 0;
+	journal->spare.map = NULL;
+	journal->retiring = 0;
+	journal->flushing = 0;
+	journal->waiting = 0;
+	journal->count = count;
+	for (unsigned i = 0; i < count; ++i)
+		journal->segments[i].map = NULL;
+
+	if (TQueueJournalRecover(queue, journal))
+		goto end;
+	queue->journal = journal;
+	journal = NULL;
+
+	dbgprintf("OPENED JOURNAL %s\n", path);
+	dbgTQueuePrint(queue);
+	ret = 0;
+
+ end:
+	TQueueUnlock(queue);
+	TQueueJournalClose(journal);
+
+	return ret;
+}
+
+int TQueueSubscribeFrom(TQueue * queue, pthread_t * thread,
+						unsigned long long seq) {
+	int ret = -1;
+
+	if (queue->engine == TQUEUE_ENGINE_LOCKFREE)
+		return TQueueLockFreeUnsupported(queue);
+
+	TQueueSubscribeNode(queue, thread, 0, &seq, NULL, &ret);
+
+	return ret;
+}
+
+size_t TQueueJournalLength(TQueueJournal * journal) {
+	return JOURNAL_HEADER + (size_t)journal->records * journal->elem_size;
+}
+
+// name has to have room for the path and 21 more characters
+void TQueueJournalName(TQueueJournal * journal, unsigned long long k,
+					   char *name) {
+	sprintf(name, "%s.%llu", journal->path, k);
+}
+
+// returns NULL if the segment cannot be opened or created
+char *TQueueJournalMap(TQueueJournal * journal, unsigned long long k,
+					   int create) {
+	char name[strlen(journal->path) + 22];
+	void *map;
+	int fd;
+
+	TQueueJournalName(journal, k, name);
+	fd = open(name, create ? O_RDWR | O_CREAT : O_RDWR, 0644);
+	if (fd < 0)
+		return NULL;
+	if (create && ftruncate(fd, TQueueJournalLength(journal))) {
+		close(fd);
+		return NULL;
+	}
+	map = mmap(NULL, TQueueJournalLength(journal), PROT_READ | PROT_WRITE,
+			   MAP_SHARED, fd, 0);
+	close(fd);
+	return map == MAP_FAILED ? NULL : map;
+}
+
+void TQueueJournalRemove(TQueueJournal * journal, TQueueSegment * segment) {
+	char name[strlen(journal->path) + 22];
+
+	munmap(segment->map, TQueueJournalLength(journal));
+	segment->map = NULL;
+	TQueueJournalName(journal, segment->k, name);
+	unlink(name);
+}
+
+// called with the mutex held after the payload of message num has been
+// stored, TQueueJournalRoom has to have allowed it
+void TQueueJournalWrite(TQueue * queue, unsigned long long num) {
+	TQueueJournal *journal = queue->journal;
+	unsigned long long k = num / journal->records;
+	TQueueSegment *segment = &journal->segments[k % journal->count];
+	TQueueSegmentHeader *header;
+
+	journal->written = num + 1;
+	if (journal->failed) {
+		journal->first = journal->written;
+		return;
+	}
+
+	if (segment->map == NULL || segment->k != k) {
+		// the next flush removes it, a flush running meanwhile may be
+		// writing it back
+		if (segment->map != NULL) {
+			journal->retired[journal->retiring++] = *segment;
+			segment->map = NULL;
+			if (journal->first < (k - journal->count + 1) * journal->records)
+				journal->first = (k - journal->count + 1) * journal->records;
+		}
+		TQueueJournalStart(journal, num, journal->spare.map);
+		journal->spare.map = NULL;
+	}
+
+	header = (TQueueSegmentHeader *) segment->map;
+	memcpy(TQueueJournalRecord(journal, num), TQueuePayload(queue, num),
+		   journal->elem_size);
+	header->count = num + 1 - header->first;
+}
+
+// starts the segment whose first value will be num in map, returns -1 if
+// it could not be created
+int TQueueJournalStart(TQueueJournal * journal, unsigned long long num,
+					   char *map) {
+	unsigned long long k = num / journal->records;
+	TQueueSegment *segment = &journal->segments[k % journal->count];
+	TQueueSegmentHeader *header;
+
+	segment->k = k;
+	segment->map = map;
+	if (segment->map == NULL)
+		return -1;
+	header = (TQueueSegmentHeader *) segment->map;
+	header->first = num;
+	header->count = 0;
+	header->elem_size = journal->elem_size;
+	header->records = journal->records;
+	return 0;
+}
+
+// the segment holding num has to be mapped
+char *TQueueJournalRecord(TQueueJournal * journal, unsigned long long num) {
+	unsigned long long k = num / journal->records;
+	return journal->segments[k % journal->count].map + JOURNAL_HEADER
+		+ (num - k * journal->records) * journal->elem_size;
+}
+
+// stores the mapped ranges holding values from synced on, together with
+// the headers counting them, there are at most count of them; returns
+// their number
+unsigned TQueueJournalDirty(TQueueJournal * journal, char **maps,
+							size_t *lengths) {
+	unsigned long long k = journal->synced / journal->records;
+	TQueueSegment *segment;
+	unsigned n = 0;
+
+	for (; k * journal->records < journal->written; ++k) {
+		segment = &journal->segments[k % journal->count];
+		if (segment->map == NULL || segment->k != k)
+			continue;
+		maps[n] = segment->map;
+		lengths[n] = TQueueJournalLength(journal);
+		if (journal->written < (k + 1) * journal->records)
+			lengths[n] = JOURNAL_HEADER
+				+ (journal->written - k * journal->records)
+				* journal->elem_size;
+		++n;
+	}
+	return n;
+}
+
+// writes values from synced on back to the files, synced is left where it
+// is if they could not be
+void TQueueJournalSync(TQueueJournal * journal) {
+	char *maps[journal->count];
+	size_t lengths[journal->count];
+	unsigned n = TQueueJournalDirty(journal, maps, lengths);
+
+	for (unsigned i = 0; i < n; ++i)
+		if (msync(maps[i], lengths[i], MS_SYNC))
+			return;
+	journal->synced = journal->written;
+}
+
+// called with the mutex held after a put, removes the retired segments,
+// maps the segment after the one being written and writes the values
+// back once sync of them have been written, all with the mutex released;
+// only one publisher flushes at a time, the others go on with their puts,
+// segments they retire meanwhile are left mapped for the next flush, and
+// destroying the queue waits for it; if a segment cannot be created or
+// values cannot be written back the journal stops keeping values
+void TQueueJournalFlush(TQueue * queue) {
+	TQueueJournal *journal = queue->journal;
+	char *maps[journal->count];
+	size_t lengths[journal->count];
+	unsigned long long k = journal->written / journal->records;
+	unsigned long long synced = journal->synced;
+	TQueueSegment *segment = &journal->segments[k % journal->count];
+	TQueueSegment retired[JOURNAL_RETIRED];
+	unsigned retiring = journal->retiring;
+	TQueueSegment old = journal->spare;
+	TQueueSegment spare;
+	int ahead;
+	int failed = 0;
+	unsigned n = 0;
+
+	if (journal->flushing || journal->failed)
+		return;
+	if (segment->map != NULL && segment->k == k)
+		++k;
+	ahead = old.map == NULL || old.k != k;
+	if (!ahead && !retiring
+		&& (!journal->sync || journal->written - synced < journal->sync))
+		return;
+
+	journal->flushing = 1;
+	memcpy(retired, journal->retired, retiring * sizeof(TQueueSegment));
+	journal->retiring = 0;
+	if (ahead)
+		journal->spare.map = NULL;
+	// the range up to written is in flight until the mutex is taken again
+	if (journal->sync && journal->written - synced >= journal->sync) {
+		n = TQueueJournalDirty(journal, maps, lengths);
+		synced = journal->written;
+	}
+	TQueueUnlock(queue);
+
+	for (unsigned i = 0; i < retiring; ++i)
+		TQueueJournalRemove(journal, &retired[i]);
+	if (ahead && old.map != NULL)
+		munmap(old.map, TQueueJournalLength(journal));
+	if (ahead) {
+		spare.k = k;
+		spare.map = TQueueJournalMap(journal, k, 1);
+		failed = spare.map == NULL;
+	}
+	for (unsigned i = 0; i < n && !failed; ++i)
+		failed = msync(maps[i], lengths[i], MS_SYNC) != 0;
+
+	TQueueLock(queue);
+	journal->flushing = 0;
+	// puts cannot start segment k without the spare, nor go past it
+	if (ahead && spare.map != NULL)
+		journal->spare = spare;
+	if (failed)
+		TQueueJournalFail(journal, journal->written - 1);
+	else
+		journal->synced = synced;
+	if (journal->waiting) {
+		journal->waiting = 0;
+		pthread_cond_broadcast(&queue->put_cond);
+	}
+
+	if (queue->destroyed && !queue->get_locked && !queue->put_locked)
+		pthread_cond_signal(&queue->destroy_cond);
+}
+
+// called with the mutex held, returns how many values can be put before
+// one needs a segment which has not been mapped yet, the spare one takes
+// the place of a segment which is retired as long as there is room for
+// it until the next flush
+unsigned TQueueJournalRoom(TQueue * queue) {
+	TQueueJournal *journal = queue->journal;
+	unsigned long long k, end;
+	TQueueSegment *segment;
+
+	if (journal == NULL || journal->failed)
+		return UINT_MAX;
+	k = journal->written / journal->records;
+	end = k * journal->records;
+	segment = &journal->segments[k % journal->count];
+	if (segment->map != NULL && segment->k == k) {
+		end += journal->records;
+		segment = &journal->segments[++k % journal->count];
+	}
+	if (journal->spare.map != NULL && journal->spare.k == k
+		&& (segment->map == NULL || journal->retiring < JOURNAL_RETIRED))
+		end += journal->records;
+	return end - journal->written < UINT_MAX ?
+		end - journal->written : UINT_MAX;
+}
+
+// called with the mutex held when TQueueJournalRoom does not allow a put,
+// flushes the journal or, if another publisher is already flushing it,
+// waits for it; returns -4 if the deadline passes
+int TQueueJournalWait(TQueue * queue, const struct timespec *deadline) {
+	TQueueJournal *journal = queue->journal;
+
+	if (!journal->flushing) {
+		TQueueJournalFlush(queue);
+		return 0;
+	}
+	journal->waiting = 1;
+	return TQueueWait(queue, &queue->put_cond, &queue->put_locked, NULL, 0,
+					  deadline);
+}
+
+int TQueueJournalFlushing(TQueueJournal * journal) {
+	return journal->flushing;
+}
+
+// a segment could not be created or written back after value num, the
+// journal stops keeping values; called by the publisher which has been
+// flushing, nobody else unmaps segments
+void TQueueJournalFail(TQueueJournal * journal, unsigned long long num) {
+	dbgprintf("JOURNAL FAILED AT %llu\n", num);
+	journal->failed = 1;
+	TQueueJournalRelease(journal);
+	journal->first = num + 1;
+}
+
+// unmaps the segments, removing the ones which are not kept
+void TQueueJournalRelease(TQueueJournal * journal) {
+	for (unsigned i = 0; i < journal->count; ++i)
+		if (journal->segments[i].map != NULL) {
+			munmap(journal->segments[i].map, TQueueJournalLength(journal));
+			journal->segments[i].map = NULL;
+		}
+	if (journal->spare.map != NULL)
+		TQueueJournalRemove(journal, &journal->spare);
+	for (unsigned i = 0; i < journal->retiring; ++i)
+		TQueueJournalRemove(journal, &journal->retired[i]);
+	journal->retiring = 0;
+}
+
+void TQueueJournalClose(TQueueJournal * journal) {
+	if (journal == NULL)
+		return;
+	if (journal->sync && !journal->failed)
+		TQueueJournalSync(journal);
+	TQueueJournalRelease(journal);
+	free(journal->path);
+	free(journal);
+}
+
+// looks for segments of the journal, returns 0 if there are none
+int TQueueJournalFind(TQueueJournal * journal, unsigned long long *oldest,
+					  unsigned long long *newest) {
+	char *base = strrchr(journal->path, '/');
+	char *dir = base == NULL ? strdup(".") : base == journal->path ?
+		strdup("/") : strndup(journal->path, base - journal->path);
+	size_t length;
+	struct dirent *entry;
+	unsigned long long k;
+	char *end;
+	DIR *dir_ptr;
+	int found = 0;
+
+	base = base == NULL ? journal->path : base + 1;
+	length = strlen(base);
+	dir_ptr = opendir(dir);
+	free(dir);
+	if (dir_ptr == NULL)
+		return 0;
+
+	while ((entry = readdir(dir_ptr)) != NULL) {
+		if (strncmp(entry->d_name, base, length)
+			|| entry->d_name[length] != '.'
+			|| entry->d_name[length + 1] < '0'
+			|| entry->d_name[length + 1] > '9')
+			continue;
+		k = strtoull(entry->d_name + length + 1, &end, 10);
+		if (*end != '\0')
+			continue;
+		if (!found || k < *oldest)
+			*oldest = k;
+		if (!found || k > *newest)
+			*newest = k;
+		found = 1;
+	}
+	closedir(dir_ptr);
+	return found;
+}
+
+// maps the newest segments of an existing journal and removes older ones,
+// an empty queue continues with sequence numbers after the journal,
+// returns -1 if the journal does not fit the queue
+int TQueueJournalRecover(TQueue * queue, TQueueJournal * journal) {
+	char name[strlen(journal->path) + 22];
+	unsigned long long oldest, newest, next, k;
+	TQueueSegmentHeader *header;
+	TQueueSegment *segment;
+	int found;
+
+	found = TQueueJournalFind(journal, &oldest, &newest);
+	// the segment mapped ahead of time is not started before its first
+	// value is written
+	if (found && TQueueJournalBlank(journal, newest)) {
+		TQueueJournalName(journal, newest, name);
+		unlink(name);
+		found = newest-- != oldest;
+	}
+	if (!found) {
+		journal->first = queue->tail;
+		journal->written = queue->tail;
+		journal->synced = queue->tail;
+		return TQueueJournalStart(journal, queue->tail,
+								  TQueueJournalMap(journal, queue->tail
+												   / journal->records, 1));
+	}
+
+	for (k = newest; k >= oldest && newest - k < journal->count; --k) {
+		segment = &journal->segments[k % journal->count];
+		segment->k = k;
+		segment->map = TQueueJournalMap(journal, k, 0);
+		header = (TQueueSegmentHeader *) segment->map;
+		if (segment->map == NULL || header->elem_size != journal->elem_size
+			|| header->records != journal->records
+			|| header->first + header->count > (k + 1) * journal->records) {
+			if (segment->map != NULL)
+				munmap(segment->map, TQueueJournalLength(journal));
+			segment->map = NULL;
+			// older values cannot be read past a missing segment
+			if (k == newest)
+				return -1;
+			break;
+		}
+		journal->first = header->first;
+		if (k == 0)
+			break;
+	}
+	for (k = oldest; k + journal->count <= newest; ++k) {
+		TQueueJournalName(journal, k, name);
+		unlink(name);
+	}
+
+	header = (TQueueSegmentHeader *)
+		journal->segments[newest % journal->count].map;
+	next = header->first + header->count;
+	if (next != queue->tail
+		&& (queue->head != queue->tail || next < queue->tail))
+		return -1;
+	if (next != queue->tail)
+		TQueueMoveTail(queue, next);
+	journal->written = next;
+	journal->synced = next;
+	return 0;
+}
+
+// returns 1 if segment k has been created but not started
+int TQueueJournalBlank(TQueueJournal * journal, unsigned long long k) {
+	char *map = TQueueJournalMap(journal, k, 0);
+	int blank;
+
+	if (map == NULL)
+		return 0;
+	blank = ((TQueueSegmentHeader *) map)->records == 0;
+	munmap(map, TQueueJournalLength(journal));
+	return blank;
+}
+
+// the queue has to be empty, subscribers left behind are moved to the
+// new tail when they next read
+void TQueueMoveTail(TQueue * queue, unsigned long long num) {
+	*TQueueSlot(queue, num) = *TQueueSlot(queue, queue->tail);
+	TQueueSlot(queue, num)->num = num;
+	TQueueStore(queue->head, num);
+	TQueueStore(queue->tail, num);
+}
+
+// sharded queue:
+
+// shards are locked queues allocated on separate cache lines, a subscriber
+// looks for a message in all of them starting from a rotating shard, when
+// there is none it registers on waiting and parks on cond until a publisher
+// which has seen it waiting bumps version; a priority queue only differs
+// in the order in which the shards are looked at; every operation is
+// counted in active, as in the lock-free engine, so that destroying the
+// queue frees the shards only when none of them can still use one
+
+#define SHARDED_STRIPE (CACHE_LINE / sizeof(unsigned))
+
+int TQueueShardedEnter(TQueueSharded * queue);
+void TQueueShardedLeave(TQueueSharded * queue);
+int TQueueShardedRead(TQueueSharded * queue, pthread_t * thread, void **msg);
+int TQueueShardedWait(TQueueSharded * queue, pthread_t * thread, void **msg);
+void TQueueShardedInit(TQueueSharded * queue, unsigned count, int *sizes,
+					   int same_size);
+int TQueueShardedPutShard(TQueueSharded * queue, unsigned shard, void *msg);
+int TQueuePriorityRead(TQueueSharded * queue, pthread_t * thread,
+					   void **msg);
+void TQueuePrioritySchedule(TQueueSharded * queue, int *weights);
+
+void TQueueCreateSharded(TQueueSharded * queue, int *shards, int *size) {
+	TQueueShardedInit(queue, *shards > 0 ? (unsigned)*shards : 1, size, 1);
+	dbgprintf("CREATED SHARDED QUEUE %u\n", queue->count);
+}
+
+int TQueueCreatePriority(TQueueSharded * queue, int *lanes, int *sizes,
+						 int order, int *weights) {
+	if (*lanes < 1 || *lanes > TQUEUE_PRIORITIES
+		|| (order != TQUEUE_PRIORITY_STRICT
+			&& order != TQUEUE_PRIORITY_WEIGHTED))
+		return -2;
+	if (order == TQUEUE_PRIORITY_WEIGHTED)
+		for (int i = 0; i < *lanes; ++i)
+			if (weights[i] < 1 || weights[i] > TQUEUE_PRIORITY_WEIGHT_MAX)
+				return -2;
+
+	TQueueShardedInit(queue, *lanes, sizes, 0);
+	queue->order = order;
+	if (order == TQUEUE_PRIORITY_WEIGHTED)
+		TQueuePrioritySchedule(queue, weights);
+	dbgprintf("CREATED PRIORITY QUEUE %u\n", queue->count);
+
+	return 0;
+}
+
+int TQueueDestroySharded(TQueueSharded * queue) {
+	unsigned active;
+	unsigned left;
+
+	// new operations fail from now on, those on the shards are woken by
+	// destroying them, their mutexes are kept until none is in progress
+	if (__atomic_exchange_n(&queue->destroyed, 1, __ATOMIC_SEQ_CST))
+		return -1;
+	for (unsigned i = 0; i < queue->count; ++i)
+		TQueueDestroyQueue_1(queue->shards[i]);
+
+	// subscribers check the flag under the mutex before they park on
+	// cond, so they are woken once
+	pthread_mutex_lock(&queue->lock);
+	pthread_cond_broadcast(&queue->cond);
+	pthread_mutex_unlock(&queue->lock);
+
+	// operations which have started before the flag was set are waited
+	// for, yielding a few times and then sleeping on left, which the
+	// operation emptying a stripe bumps; it is read before the stripes,
+	// so a leave after they are summed is not missed
+	for (unsigned yields = 0;; ++yields) {
+		left = __atomic_load_n(&queue->left, __ATOMIC_SEQ_CST);
+		active = 0;
+		for (int i = 0; i < ACTIVE_STRIPES; ++i)
+			active += __atomic_load_n(&queue->active[i * SHARDED_STRIPE],
+									  __ATOMIC_SEQ_CST);
+		if (!active)
+			break;
+		dbgprintf("WAITING FOR %u SHARDED OPERATIONS\n", active);
+		if (yields < DESTROY_YIELDS)
+			sched_yield();
+		else
+			TQueueFutexWait(&queue->left, left);
+	}
+
+	for (unsigned i = 0; i < queue->count; ++i) {
+		TQueueDestroyQueue_2(queue->shards[i]);
+		free(queue->shards[i]);
+	}
+	free(queue->shards);
+	free(queue->schedule);
+	pthread_cond_destroy(&queue->cond);
+	pthread_mutex_destroy(&queue->lock);
+	dbgprintf("DESTROYED SHARDED QUEUE\n");
+
+	return 0;
+}
+
+int TQueueShardedSubscribe(TQueueSharded * queue, pthread_t * thread) {
+	int ret = 0;
+	unsigned i;
+
+	if (TQueueShardedEnter(queue))
+		return -1;
+	for (i = 0; i < queue->count && !ret; ++i)
+		ret = TQueueSubscribe(queue->shards[i], thread);
+	// the thread is left subscribed to none of the shards
+	if (ret)
+		for (i -= 1; i > 0; --i)
+			TQueueUnsubscribe(queue->shards[i - 1], thread);
+	TQueueShardedLeave(queue);
+
+	return ret;
+}
+
+int TQueueShardedUnsubscribe(TQueueSharded * queue, pthread_t * thread) {
+	int ret = 0;
+
+	if (TQueueShardedEnter(queue))
+		return -1;
+	for (unsigned i = 0; i < queue->count && !ret; ++i)
+		ret = TQueueUnsubscribe(queue->shards[i], thread);
+	TQueueShardedLeave(queue);
+
+	return ret;
+}
+
+int TQueueShardedPut(TQueueSharded * queue, unsigned long long key,
+					 void *msg) {
+	int ret;
+
+	if (TQueueShardedEnter(queue))
+		return -1;
+	ret = TQueueShardedPutShard(queue, key % queue->count, msg);
+	TQueueShardedLeave(queue);
+
+	return ret;
+}
+
+int TQueuePutPriority(TQueueSharded * queue, void *msg, int level) {
+	int ret = -2;
+
+	if (TQueueShardedEnter(queue))
+		return -1;
+	if (level >= 0 && (unsigned)level < queue->count)
+		ret = TQueueShardedPutShard(queue, level, msg);
+	TQueueShardedLeave(queue);
+
+	return ret;
+}
+
+void *TQueueShardedGet(TQueueSharded * queue, pthread_t * thread) {
+	void *msg = NULL;
+
+	if (TQueueShardedEnter(queue))
+		return NULL;
+	if (TQueueShardedRead(queue, thread, &msg) == -4)
+		TQueueShardedWait(queue, thread, &msg);
+	TQueueShardedLeave(queue);
+
+	return msg;
+}
+
+int TQueueShardedTryGet(TQueueSharded * queue, pthread_t * thread,
+						void **msg) {
+	int ret;
+
+	if (TQueueShardedEnter(queue))
+		return -1;
+	ret = TQueueShardedRead(queue, thread, msg);
+	TQueueShardedLeave(queue);
+
+	return ret;
+}
+
+void TQueueShardedInit(TQueueSharded * queue, unsigned count, int *sizes,
+					   int same_size) {
+	size_t stride = (sizeof(TQueue) + CACHE_LINE - 1) & ~(CACHE_LINE - 1);
+
+	queue->count = count;
+	queue->shards = malloc(queue->count * sizeof(TQueue *));
+	for (unsigned i = 0; i < queue->count; ++i) {
+		queue->shards[i] = aligned_alloc(CACHE_LINE, stride);
+		TQueueCreateQueue(queue->shards[i], same_size ? sizes : &sizes[i]);
+	}
+	queue->order = TQUEUE_ORDER_ROTATE;
+	queue->schedule = NULL;
+	queue->schedule_size = 0;
+	queue->waiting = 0;
+	queue->parked = 0;
+	queue->left = 0;
+	queue->version = 0;
+	queue->destroyed = 0;
+	memset(queue->active, 0, sizeof(queue->active));
+	pthread_cond_init(&queue->cond, NULL);
+	pthread_mutex_init(&queue->lock, NULL);
+}
+
+// returns -1 if the queue has been destroyed, otherwise the operation is
+// counted until it leaves
+int TQueueShardedEnter(TQueueSharded * queue) {
+	unsigned *active = &queue->active[TQueueStripe() * SHARDED_STRIPE];
+
+	__atomic_fetch_add(active, 1, __ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&queue->destroyed, __ATOMIC_SEQ_CST)) {
+		TQueueShardedLeave(queue);
+		return -1;
+	}
+	return 0;
+}
+
+// the operation emptying a stripe of a destroyed queue wakes the
+// destroying thread, the last one to leave empties the last stripe
+void TQueueShardedLeave(TQueueSharded * queue) {
+	if (!__atomic_sub_fetch(&queue->active[TQueueStripe() * SHARDED_STRIPE],
+							1, __ATOMIC_SEQ_CST)
+		&& __atomic_load_n(&queue->destroyed, __ATOMIC_SEQ_CST)) {
+		__atomic_add_fetch(&queue->left, 1, __ATOMIC_SEQ_CST);
+		TQueueFutexWake(&queue->left);
+	}
+}
+
+int TQueueShardedPutShard(TQueueSharded * queue, unsigned shard, void *msg) {
+	int ret = TQueuePut(queue->shards[shard], msg);
+
+	// a subscriber registers on waiting before it looks at the shards,
+	// so one which has not seen this message is visible here; it counts
+	// itself in parked before it checks version for the last time, so
+	// only a publisher which sees it parked takes the mutex, and the
+	// first one wakes all of them, each has to read the message
+	if (!ret && TQueueLoad(queue->waiting)) {
+		__atomic_add_fetch(&queue->version, 1, __ATOMIC_SEQ_CST);
+		if (__atomic_load_n(&queue->parked, __ATOMIC_SEQ_CST)) {
+			pthread_mutex_lock(&queue->lock);
+			if (queue->parked) {
+				TQueueStore(queue->parked, 0);
+				pthread_cond_broadcast(&queue->cond);
+			}
+			pthread_mutex_unlock(&queue->lock);
+		}
+	}
+
+	return ret;
+}
+
+// tries all shards once, returns -4 if none had a message for the thread;
+// the shard tried first rotates with every read of the calling thread,
+// which is the subscriber, so readers do not share a counter
+int TQueueShardedRead(TQueueSharded * queue, pthread_t * thread, void **msg) {
+	static _Thread_local unsigned next;
+	unsigned first, shard;
+	int ret;
+
+	if (queue->order != TQUEUE_ORDER_ROTATE)
+		return TQueuePriorityRead(queue, thread, msg);
+
+	first = next++ % queue->count;
+	shard = first;
+
+	do {
+		ret = TQueueTryGet(queue->shards[shard], thread, msg);
+		if (ret != -4)
+			return ret;
+		if (++shard == queue->count)
+			shard = 0;
+	} while (shard != first);
+
+	return -4;
+}
+
+int TQueueShardedWait(TQueueSharded * queue, pthread_t * thread, void **msg) {
+	unsigned long long version;
+	int ret = -1;
+
+	pthread_mutex_lock(&queue->lock);
+	if (TQueueLoad(queue->destroyed))
+		goto end;
+	TQueueStore(queue->waiting, queue->waiting + 1);
+
+	for (;;) {
+		version = __atomic_load_n(&queue->version, __ATOMIC_SEQ_CST);
+		pthread_mutex_unlock(&queue->lock);
+		ret = TQueueShardedRead(queue, thread, msg);
+		pthread_mutex_lock(&queue->lock);
+		if (ret != -4)
+			break;
+		// the publisher waking it resets parked
+		__atomic_store_n(&queue->parked, queue->parked + 1, __ATOMIC_SEQ_CST);
+		if (__atomic_load_n(&queue->version, __ATOMIC_SEQ_CST) != version)
+			TQueueStore(queue->parked, queue->parked - 1);
+		while (__atomic_load_n(&queue->version, __ATOMIC_SEQ_CST) == version
+			   && !TQueueLoad(queue->destroyed))
+			pthread_cond_wait(&queue->cond, &queue->lock);
+		if (TQueueLoad(queue->destroyed)) {
+			ret = -1;
+			break;
+		}
+	}
+
+	TQueueStore(queue->waiting, queue->waiting - 1);
+ end:
+	pthread_mutex_unlock(&queue->lock);
+
+	return ret;
+}
+
+// a weighted queue first tries the lane of the schedule for the turn of
+// the subscriber, kept on its node of lane 0 and advanced only by reads
+// which return a message, so each subscriber sees the weights on its own;
+// lanes are then tried by priority so no message waits while a subscriber
+// has none
+int TQueuePriorityRead(TQueueSharded * queue, pthread_t * thread,
+					   void **msg) {
+	TQueueThread *thread_ptr = NULL;
+	TQueue *lane0 = queue->shards[0];
+	unsigned first = queue->count;
+	int ret = -4;
+
+	if (queue->order == TQUEUE_PRIORITY_WEIGHTED) {
+		TQueueLock(lane0);
+		if (lane0->destroyed || (thread_ptr = TQueueFind(lane0, thread))
+			== NULL) {
+			ret = lane0->destroyed ? -1 : -2;
+			TQueueUnlock(lane0);
+			return ret;
+		}
+		// only the subscriber reads and advances its turn
+		first = queue->schedule[TQueueLoad(thread_ptr->turn)
+								% queue->schedule_size];
+		if (first == 0)
+			ret = TQueueGetMessage(lane0, thread_ptr, msg, TQUEUE_NOWAIT);
+		TQueueUnlock(lane0);
+		if (first != 0)
+			ret = TQueueTryGet(queue->shards[first], thread, msg);
+	}
+
+	for (unsigned lane = 0; lane < queue->count && ret == -4; ++lane)
+		if (lane != first)
+			ret = TQueueTryGet(queue->shards[lane], thread, msg);
+
+	if (!ret && thread_ptr != NULL)
+		TQueueStore(thread_ptr->turn, thread_ptr->turn + 1);
+
+	return ret;
+}
+
+// smooth weighted round robin: on every turn each lane gains its weight
+// and the lane with the most loses the sum of them, so the turns of a
+// lane are spread over the schedule instead of coming in a row
+void TQueuePrioritySchedule(TQueueSharded * queue, int *weights) {
+	int current[TQUEUE_PRIORITIES] = { 0 };
+	unsigned total = 0;
+	unsigned lane;
+
+	for (lane = 0; lane < queue->count; ++lane)
+		total += weights[lane];
+	queue->schedule = malloc(total);
+	queue->schedule_size = total;
+
+	for (unsigned turn = 0; turn < total; ++turn) {
+		unsigned best = 0;
+		for (lane = 0; lane < queue->count; ++lane) {
+			current[lane] += weights[lane];
+			if (current[lane] > current[best])
+				best = lane;
+		}
+		current[best] -= total;
+		queue->schedule[turn] = best;
+	}
+}
+
+// shared memory queue:
+
+// the region starts with this header, followed by the subscriber table
+// and the slots; positions are sequence numbers as in the locked engine,
+// tail is the next one to be put and head a lower bound of the cursors,
+// recomputed when the subscriber at it reads and when the queue looks
+// full, a publisher kept waiting by a full queue checks every
+// SHARED_POLL_MS whether the processes of the subscribers at head are
+// still alive and removes them if not
+
+#define SHARED_MAGIC 0x54517565756553ULL
+#define SHARED_POLL_MS 100
+#define SHARED_NAME_MAX 255
+
+typedef struct TQueueSharedSubscriber {
+	unsigned long long id;
+	unsigned long long num;
+	pid_t pid;
+	int state;
+} TQueueSharedSubscriber;
+
+enum { SHARED_EMPTY, SHARED_USED, SHARED_DELETED };
+
+struct TQueueSharedRegion {
+	_Atomic unsigned long long magic;
+	pthread_mutex_t lock;
+	pthread_cond_t get_cond;
+	pthread_cond_t put_cond;
+	unsigned long long head;
+	unsigned long long tail;
+	size_t length;
+	size_t slots_offset;
+	// values are copied with their size, slots are stride bytes apart
+	unsigned elem_size;
+	unsigned stride;
+	unsigned max_size;
+	unsigned mask;
+	unsigned max_subscribers;
+	unsigned subscribers;
+	unsigned table_size;
+	unsigned char destroyed;
+	char name[SHARED_NAME_MAX + 1];
+};
+
+int TQueueSharedPutDeadline(TQueueShared * queue, void *value,
+							const struct timespec *deadline);
+int TQueueSharedGetDeadline(TQueueShared * queue, unsigned long long id,
+							void *value, const struct timespec *deadline);
+void TQueueSharedLock(TQueueSharedRegion * region);
+int TQueueSharedWait(TQueueSharedRegion * region, pthread_cond_t * cond,
+					 const struct timespec *deadline);
+TQueueSharedSubscriber *TQueueSharedFind(TQueueSharedRegion * region,
+										 unsigned long long id);
+void TQueueSharedHead(TQueueSharedRegion * region);
+int TQueueSharedReap(TQueueSharedRegion * region);
+
+int TQueueCreateShared(TQueueShared * queue, const char *name, int *size,
+					   int *elem_size, int *subscribers) {
+	TQueueSharedRegion *region;
+	pthread_mutexattr_t mutex_attr;
+	pthread_condattr_t cond_attr;
+	unsigned max_size = *size > 0 ? (unsigned)*size : 1;
+	unsigned elem = *elem_size > 0 ? (unsigned)*elem_size : 1;
+	unsigned max_subscribers = *subscribers > 0 ? (unsigned)*subscribers : 1;
+	unsigned stride;
+	unsigned slots = 1, table_size = 1;
+	size_t slots_offset, length;
+	void *map;
+	int fd;
+
+	if (strlen(name) > SHARED_NAME_MAX)
+		return -2;
+	while (slots < max_size)
+		slots <<= 1;
+	// at most half of the table is used, so probing stays short
+	while (table_size < 2 * max_subscribers)
+		table_size <<= 1;
+	stride = (elem + 7) & ~7u;
+	slots_offset = sizeof(TQueueSharedRegion)
+		+ table_size * sizeof(TQueueSharedSubscriber);
+	slots_offset = (slots_offset + CACHE_LINE - 1) & ~(size_t)(CACHE_LINE - 1);
+	length = slots_offset + (size_t)slots * stride;
+
+	fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+	if (fd < 0)
+		return -2;
+	if (ftruncate(fd, length) < 0) {
+		close(fd);
+		shm_unlink(name);
+		return -2;
+	}
+	map = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		shm_unlink(name);
+		return -2;
+	}
+
+	// ftruncate has zeroed the table, all entries are empty
+	region = map;
+	pthread_mutexattr_init(&mutex_attr);
+	pthread_mutexattr_setpshared(&mutex_attr, PTHREAD_PROCESS_SHARED);
+	pthread_mutexattr_setrobust(&mutex_attr, PTHREAD_MUTEX_ROBUST);
+	pthread_mutex_init(&region->lock, &mutex_attr);
+	pthread_mutexattr_destroy(&mutex_attr);
+	pthread_condattr_init(&cond_attr);
+	pthread_condattr_setpshared(&cond_attr, PTHREAD_PROCESS_SHARED);
+	pthread_condattr_setclock(&cond_attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&region->get_cond, &cond_attr);
+	pthread_cond_init(&region->put_cond, &cond_attr);
+	pthread_condattr_destroy(&cond_attr);
+	region->head = 0;
+	region->tail = 0;
+	region->length = length;
+	region->slots_offset = slots_offset;
+	region->elem_size = elem;
+	region->stride = stride;
+	region->max_size = max_size;
+	region->mask = slots - 1;
+	region->max_subscribers = max_subscribers;
+	region->subscribers = 0;
+	region->table_size = table_size;
+	region->destroyed = 0;
+	strcpy(region->name, name);
+	// processes attaching before this see no queue yet
+	atomic_store(&region->magic, SHARED_MAGIC);
+
+	queue->region = region;
+	queue->length = length;
+	dbgprintf("CREATED SHARED QUEUE %s\n", name);
+
+	return 0;
+}
+
+int TQueueAttachShared(TQueueShared * queue, const char *name) {
+	TQueueSharedRegion *region;
+	struct stat st;
+	void *map;
+	int fd;
+
+	fd = shm_open(name, O_RDWR, 0);
+	if (fd < 0)
+		return -2;
+	if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(TQueueSharedRegion)) {
+		close(fd);
+		return -2;
+	}
+	map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		return -2;
+
+	region = map;
+	if (atomic_load(&region->magic) != SHARED_MAGIC
+		|| region->length != (size_t)st.st_size) {
+		munmap(map, st.st_size);
+		return -2;
+	}
+
+	queue->region = region;
+	queue->length = st.st_size;
+	dbgprintf("ATTACHED SHARED QUEUE %s\n", name);
+
+	return 0;
+}
+
+int TQueueDestroyShared(TQueueShared * queue) {
+	TQueueSharedRegion *region = queue->region;
+	int ret = 0;
+
+	TQueueSharedLock(region);
+	if (region->destroyed) {
+		ret = -1;
+		goto end;
+	}
+	region->destroyed = 1;
+	shm_unlink(region->name);
+	pthread_cond_broadcast(&region->get_cond);
+	pthread_cond_broadcast(&region->put_cond);
+	dbgprintf("DESTROYED SHARED QUEUE %s\n", region->name);
+ end:
+	pthread_mutex_unlock(&region->lock);
+
+	return ret;
+}
+
+void TQueueDetachShared(TQueueShared * queue) {
+	munmap(queue->region, queue->length);
+	queue->region = NULL;
+}
+
+int TQueueSharedSubscribe(TQueueShared * queue, unsigned long long id) {
+	TQueueSharedRegion *region = queue->region;
+	TQueueSharedSubscriber *table = (TQueueSharedSubscriber *) (region + 1);
+	TQueueSharedSubscriber *free_entry = NULL;
+	unsigned i = TQueueHashSize((pthread_t *) & id, region->table_size);
+	int ret = -2;
+
+	TQueueSharedLock(region);
+	if (region->destroyed) {
+		ret = -1;
+		goto end;
+	}
+	if (!id || region->subscribers == region->max_subscribers)
+		goto end;
+	for (unsigned n = 0; n < region->table_size; ++n) {
+		if (table[i].state == SHARED_EMPTY) {
+			if (free_entry == NULL)
+				free_entry = &table[i];
+			break;
+		}
+		if (table[i].state == SHARED_DELETED) {
+			if (free_entry == NULL)
+				free_entry = &table[i];
+		} else if (table[i].id == id)
+			goto end;
+		i = (i + 1) & (region->table_size - 1);
+	}
+
+	free_entry->id = id;
+	free_entry->num = region->tail;
+	free_entry->pid = getpid();
+	free_entry->state = SHARED_USED;
+	if (!region->subscribers++)
+		region->head = region->tail;
+	ret = 0;
+	dbgprintf("SHARED SUBSCRIBED %llu\n", id);
+ end:
+	pthread_mutex_unlock(&region->lock);
+
+	return ret;
+}
+
+int TQueueSharedUnsubscribe(TQueueShared * queue, unsigned long long id) {
+	TQueueSharedRegion *region = queue->region;
+	TQueueSharedSubscriber *subscriber;
+	int ret = 0;
+
+	TQueueSharedLock(region);
+	if (region->destroyed) {
+		ret = -1;
+		goto end;
+	}
+	subscriber = TQueueSharedFind(region, id);
+	if (subscriber == NULL) {
+		ret = -2;
+		goto end;
+	}
+	subscriber->state = SHARED_DELETED;
+	--region->subscribers;
+	if (subscriber->num == region->head) {
+		TQueueSharedHead(region);
+		pthread_cond_broadcast(&region->put_cond);
+	}
+	dbgprintf("SHARED UNSUBSCRIBED %llu\n", id);
+ end:
+	pthread_mutex_unlock(&region->lock);
+
+	return ret;
+}
+
+int TQueueSharedPut(TQueueShared * queue, void *value) {
+	return TQueueSharedPutDeadline(queue, value, NULL);
+}
+
+int TQueueSharedTryPut(TQueueShared * queue, void *value) {
+	return TQueueSharedPutDeadline(queue, value, TQUEUE_NOWAIT);
+}
+
+int TQueueSharedGet(TQueueShared * queue, unsigned long long id,
+					void *value) {
+	return TQueueSharedGetDeadline(queue, id, value, NULL);
+}
+
+int TQueueSharedTryGet(TQueueShared * queue, unsigned long long id,
+					   void *value) {
+	return TQueueSharedGetDeadline(queue, id, value, TQUEUE_NOWAIT);
+}
+
+int TQueueSharedGetAvailable(TQueueShared * queue, unsigned long long id) {
+	TQueueSharedRegion *region = queue->region;
+	TQueueSharedSubscriber *subscriber;
+	int ret;
+
+	TQueueSharedLock(region);
+	if (region->destroyed) {
+		ret = -1;
+		goto end;
+	}
+	subscriber = TQueueSharedFind(region, id);
+	ret = subscriber != NULL ? (int)(region->tail - subscriber->num) : -2;
+ end:
+	pthread_mutex_unlock(&region->lock);
+
+	return ret;
+}
+
+// with no subscribers the value is not kept, as in the locked engine
+int TQueueSharedPutDeadline(TQueueShared * queue, void *value,
+							const struct timespec *deadline) {
+	TQueueSharedRegion *region = queue->region;
+	struct timespec poll;
+	unsigned long long tail;
+	int ret = 0;
+
+	TQueueSharedLock(region);
+	while (!region->destroyed && region->subscribers
+		   && region->tail - region->head >= region->max_size) {
+		if (deadline == TQUEUE_NOWAIT) {
+			ret = -4;
+			goto end;
+		}
+		clock_gettime(CLOCK_MONOTONIC, &poll);
+		poll.tv_nsec += SHARED_POLL_MS * 1000000L;
+		if (poll.tv_nsec >= 1000000000L) {
+			++poll.tv_sec;
+			poll.tv_nsec -= 1000000000L;
+		}
+		if (TQueueSharedWait(region, &region->put_cond, &poll) == ETIMEDOUT)
+			TQueueSharedReap(region);
+	}
+	if (region->destroyed) {
+		ret = -1;
+		goto end;
+	}
+
+	tail = region->tail;
+	if (region->subscribers) {
+		memcpy((char *)region + region->slots_offset
+			   + (size_t)(tail & region->mask) * region->stride, value,
+			   region->elem_size);
+		pthread_cond_broadcast(&region->get_cond);
+	} else
+		region->head = tail + 1;
+	region->tail = tail + 1;
+	dbgprintf("SHARED PUT %llu\n", tail);
+ end:
+	pthread_mutex_unlock(&region->lock);
+
+	return ret;
+}
+
+int TQueueSharedGetDeadline(TQueueShared * queue, unsigned long long id,
+							void *value, const struct timespec *deadline) {
+	TQueueSharedRegion *region = queue->region;
+	TQueueSharedSubscriber *subscriber;
+	unsigned long long num;
+	int ret = 0;
+
+	TQueueSharedLock(region);
+	for (;;) {
+		if (region->destroyed) {
+			ret = -1;
+			goto end;
+		}
+		// looked up again after waiting, a publisher may have reaped it
+		subscriber = TQueueSharedFind(region, id);
+		if (subscriber == NULL) {
+			ret = -2;
+			goto end;
+		}
+		if (subscriber->num != region->tail)
+			break;
+		if (deadline == TQUEUE_NOWAIT) {
+			ret = -4;
+			goto end;
+		}
+		TQueueSharedWait(region, &region->get_cond, NULL);
+	}
+
+	num = subscriber->num;
+	memcpy(value, (char *)region + region->slots_offset
+		   + (size_t)(num & region->mask) * region->stride,
+		   region->elem_size);
+	subscriber->num = num + 1;
+	if (num == region->head) {
+		TQueueSharedHead(region);
+		if (region->head != num)
+			pthread_cond_broadcast(&region->put_cond);
+	}
+	dbgprintf("SHARED GOT %llu\n", num);
+ end:
+	pthread_mutex_unlock(&region->lock);
+
+	return ret;
+}
+
+// a process which died holding the mutex leaves the queue consistent,
+// fields are only updated after the value has been copied
+void TQueueSharedLock(TQueueSharedRegion * region) {
+	if (pthread_mutex_lock(&region->lock) == EOWNERDEAD)
+		pthread_mutex_consistent(&region->lock);
+}
+
+int TQueueSharedWait(TQueueSharedRegion * region, pthread_cond_t * cond,
+					 const struct timespec *deadline) {
+	int rc;
+
+	if (deadline == NULL)
+		rc = pthread_cond_wait(cond, &region->lock);
+	else
+		rc = pthread_cond_timedwait(cond, &region->lock, deadline);
+	if (rc == EOWNERDEAD) {
+		pthread_mutex_consistent(&region->lock);
+		rc = 0;
+	}
+
+	return rc;
+}
+
+TQueueSharedSubscriber *TQueueSharedFind(TQueueSharedRegion * region,
+										 unsigned long long id) {
+	TQueueSharedSubscriber *table = (TQueueSharedSubscriber *) (region + 1);
+	unsigned i = TQueueHashSize((pthread_t *) & id, region->table_size);
+
+	for (unsigned n = 0; n < region->table_size; ++n) {
+		if (table[i].state == SHARED_EMPTY)
+			return NULL;
+		if (table[i].state == SHARED_USED && table[i].id == id)
+			return &table[i];
+		i = (i + 1) & (region->table_size - 1);
+	}
+
+	return NULL;
+}
+
+// called with the mutex held
+void TQueueSharedHead(TQueueSharedRegion * region) {
+	TQueueSharedSubscriber *table = (TQueueSharedSubscriber *) (region + 1);
+	unsigned long long head = region->tail;
+
+	for (unsigned i = 0; i < region->table_size; ++i)
+		if (table[i].state == SHARED_USED && table[i].num < head)
+			head = table[i].num;
+	region->head = head;
+}
+
+// called with the mutex held by a publisher kept waiting, removes the
+// subscribers at head whose processes have died, returns their number
+int TQueueSharedReap(TQueueSharedRegion * region) {
+	TQueueSharedSubscriber *table = (TQueueSharedSubscriber *) (region + 1);
+	int reaped = 0;
+
+	for (unsigned i = 0; i < region->table_size; ++i) {
+		if (table[i].state != SHARED_USED || table[i].num != region->head)
+			continue;
+		if (kill(table[i].pid, 0) < 0 && errno == ESRCH) {
+			dbgprintf("SHARED REAPED %llu\n", table[i].id);
+			table[i].state = SHARED_DELETED;
+			--region->subscribers;
+			++reaped;
+		}
+	}
+	if (reaped)
+		TQueueSharedHead(region);
+
+	return reaped;
+}
+
+// non-interface functions:
+
+int TQueuePutDeadline(TQueue * queue, void *msg,
+					  const struct timespec *deadline,
+					  unsigned long long *ticket, TQueueWaiter * waiter) {
+	int ret = -1;
+
+	if (queue->engine == TQUEUE_ENGINE_LOCKFREE)
+		return TQueueLockFreePut(queue, msg, deadline);
+
+	TQueueLock(queue);
+
+	if (queue->destroyed)
+		goto end;
+
+	dbgprintf("TRY PUT (%p)\n", msg);
+	dbgTQueuePrint(queue);
+
+	ret = 0;
+	if (ticket != NULL)
+		*ticket = TQUEUE_NO_TICKET;
+	// a journal keeps messages for later subscribers
+	if (queue->subscribers == TQueueSlot(queue, queue->tail)->unsubscribed
+		&& queue->journal == NULL) {
+		dbgprintf("NO SUBSCRIBERS\n");
+		TQueueReleaseDropped(queue, msg);
+		goto end;
+	}
+
+	ret = TQueueWaitSpace(queue, deadline);
+	if (ret == -4 && waiter != NULL) {
+		waiter->thread = NULL;
+		waiter->next = NULL;
+		*queue->put_waiters_last = waiter;
+		queue->put_waiters_last = &waiter->next;
+	}
+	if (ret)
+		goto end;
+
+	dbgprintf("BEFORE PUT (%p)\n", msg);
+	dbgTQueuePrint(queue);
+
+	if (ticket != NULL)
+		*ticket = queue->tail;
+	TQueueAppend(queue, msg);
+	TQueueWakeSubscribers(queue, 1);
+	// journaled messages nobody was subscribed to
+	if (queue->journal != NULL) {
+		TQueueRemoveRead(queue);
+		TQueueJournalFlush(queue);
+	}
+
+	dbgprintf("AFTER PUT (%p)\n", msg);
+	dbgTQueuePrint(queue);
+
+ end:
+	TQueueUnlock(queue);
+
+	return ret;
+}
+
+int TQueueGetDeadline(TQueue * queue, pthread_t * thread, void **msg,
+					  const struct timespec *deadline) {
+	TQueueThread *thread_ptr;
+	int ret = -1;
+
+	if (queue->engine == TQUEUE_ENGINE_LOCKFREE)
+		return TQueueLockFreeGet(queue, thread, msg, deadline);
+
+	TQueueLock(queue);
+
+	if (queue->destroyed)
+		goto end;
+	ret = -2;
+
+	dbgprintf("TRY GET (%p)\n", thread);
+	dbgTQueuePrint(queue);
+
+	// members of a group found by their thread claim with the mutex held
+	thread_ptr = TQueueFind(queue, thread);
+	if (thread_ptr != NULL)
+		ret = TQueueGetMessage(queue, thread_ptr, msg, deadline);
+
+ end:
+	TQueueUnlock(queue);
+
+	return ret;
+}
+
+int TQueueGetHandleDeadline(TQueue * queue,
+							TQueueSubscription * subscription, void **msg,
+							const struct timespec *deadline) {
+	TQueueGroup *group;
+	unsigned long long num;
+	unsigned n;
+	int ret = -1;
+
+	if (queue->engine == TQUEUE_ENGINE_LOCKFREE)
+		return TQueueLockFreeGetHandle(queue, subscription, msg, deadline);
+
+	// members of a group claim their message before taking the mutex
+	n = TQueueGroupPreclaim(queue, (TQueueThread *) subscription, 1, &num,
+							&group);
+
+	TQueueLock(queue);
+
+	if (queue->destroyed)
+		goto end;
+
+	if (n) {
+		ret = TQueueGroupRead(queue, group, msg, 1, num, n, deadline);
+		ret = ret < 0 ? ret : 0;
+	} else
+		ret = TQueueGetMessage(queue, (TQueueThread *) subscription, msg,
+							   deadline);
+
+ end:
+	TQueueUnlock(queue);
+
+	return ret;
+}
+
+unsigned TQueueHash(TQueue * queue, pthread_t * thread) {
+	return TQueueHashSize(thread, queue->hashmap_size);
+}
+
+unsigned TQueueHashSize(pthread_t * thread, unsigned size) {
+	unsigned long hash = 0xcbf29ce484222325UL;
+	unsigned long prime = 0x100000001b3UL;
+	unsigned long x = *((unsigned long *)thread);
+	do {
+		hash = (hash ^ (x & 0xff)) * prime;
+	} while (x >>= 8);
+	return (unsigned)((hash) % (unsigned long)size);
+}
+
+unsigned long long TQueueNow(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// the time is taken only when the mutex is contended, or on every
+// acquisition when the hold time is measured
+void TQueueLock(TQueue * queue) {
+	unsigned long long start;
+
+	if (pthread_mutex_trylock(&queue->lock)) {
+		start = TQueueNow();
+		pthread_mutex_lock(&queue->lock);
+		++queue->stats.lock_contended;
+		queue->locked_at = TQueueNow();
+		queue->stats.lock_wait_ns += queue->locked_at - start;
+	} else if (queue->stats_timing)
+		queue->locked_at = TQueueNow();
+}
+
+void TQueueUnlock(TQueue * queue) {
+	TQueueWaiter *woken = queue->woken;
+
+	if (queue->stats_timing)
+		queue->stats.lock_hold_ns += TQueueNow() - queue->locked_at;
+	queue->woken = NULL;
+	pthread_mutex_unlock(&queue->lock);
+	// continuations may use the queue again, so they run without the mutex
+	if (woken != NULL)
+		TQueueResume(woken);
+}
+
+// waits on cond without counting the wait as holding the mutex
+int TQueueCondWait(TQueue * queue, pthread_cond_t * cond,
+				   const struct timespec *deadline) {
+	unsigned long long start = TQueueNow();
+	unsigned long long end;
+	int rc;
+
+	if (queue->stats_timing)
+		queue->stats.lock_hold_ns += start - queue->locked_at;
+	if (deadline == NULL)
+		rc = pthread_cond_wait(cond, &queue->lock);
+	else
+		rc = pthread_cond_timedwait(cond, &queue->lock, deadline);
+	end = TQueueNow();
+	queue->locked_at = end;
+
+	if (cond == &queue->put_cond) {
+		++queue->stats.put_waits;
+		queue->stats.put_wait_ns += end - start;
+	} else if (cond != &queue->destroy_cond) {
+		++queue->stats.get_waits;
+		queue->stats.get_wait_ns += end - start;
+	}
+
+	return rc;
+}
+
+void TQueueLag(TQueueStats * stats, unsigned long long lag) {
+	stats->total_lag += lag;
+	if (lag > stats->max_lag)
+		stats->max_lag = lag;
+}
+
+void TQueueSubscriptionsCleanUp(TQueue * queue) {
+	int total_unsubscribed = 0;
+	TQueueMessage *message_ptr;
+	unsigned long long num = queue->head;
+	do {
+		message_ptr = TQueueSlot(queue, num);
+		message_ptr->count -= total_unsubscribed;
+		total_unsubscribed += message_ptr->unsubscribed;
+		message_ptr->unsubscribed = 0;
+	} while (num++ != queue->tail);
+	queue->subscribers -= total_unsubscribed;
+}
+
+// subscribes thread, or a handle if it is NULL, to all messages if topics
+// is 0 and otherwise only to messages put on those topics, starting with
+// message from in the journal if it is not NULL, or as a member of group
+// if it is not NULL, the ret code is stored in ret
+TQueueThread *TQueueSubscribeNode(TQueue * queue, pthread_t * thread,
+								  unsigned long long topics,
+								  unsigned long long *from,
+								  const char *group, int *ret) {
+	TQueueThread *new_thread = NULL;
+	TQueueInbox *inbox = NULL;
+	TQueueGroup *new_group = NULL;
+	TQueueGroup *group_ptr;
+
+	// used if the group does not exist yet, dropped otherwise
+	if (group != NULL)
+		new_group = TQueueGroupCreate(group);
+
+	TQueueLock(queue);
+
+	*ret = -1;
+	// both reservations can release the mutex
+	do {
+		if (queue->destroyed || TQueueReserveNode(queue)
+			|| (topics && TQueueReserveInbox(queue, &inbox)))
+			goto end;
+	} while (queue->nodes.free == NULL);
+	*ret = -3;
+	if (from != NULL && queue->journal == NULL)
+		goto end;
+	*ret = -2;
+
+	dbgprintf("BEFORE SUBSCRIBE (%p)\n", thread);
+	dbgTQueuePrint(queue);
+
+	if (thread != NULL && TQueueFind(queue, thread) != NULL)
+		goto end;
+
+	new_thread = TQueuePoolAlloc(&queue->nodes);
+	if (thread == NULL) {
+		// the handle is keyed by its own id so that it is found
+		// in the hashmap like any other subscriber
+		new_thread->id = (pthread_t)new_thread;
+		thread = &new_thread->id;
+	}
+	new_thread->thread = thread;
+	new_thread->skipped = 0;
+	new_thread->turn = 0;
+	new_thread->replay = 0;
+	new_thread->ready = NULL;
+	new_thread->group = NULL;
+	if (group != NULL) {
+		// members are not counted in subscribers, their group is
+		for (group_ptr = queue->groups; group_ptr != NULL
+			 && strcmp(group_ptr->name, group); group_ptr = group_ptr->next) ;
+		if (group_ptr == NULL) {
+			group_ptr = new_group;
+			new_group = NULL;
+			TQueueJoin(queue, &group_ptr->cursor);
+			group_ptr->next = queue->groups;
+			TQueueStore(queue->groups, group_ptr);
+		}
+		++group_ptr->members;
+		new_thread->num = 0;
+		new_thread->inbox = NULL;
+		new_thread->group = group_ptr;
+		TQueueHashmapInsert(queue, new_thread);
+	} else if (from != NULL && *from < queue->tail) {
+		// the thread is not counted on messages until it has caught up
+		new_thread->num = *from;
+		new_thread->replay = 1;
+		new_thread->inbox = NULL;
+		TQueueHashmapInsert(queue, new_thread);
+	} else if (topics) {
+		// topic subscribers are not counted in subscribers, messages
+		// are counted against them when delivered
+		new_thread->num = queue->tail;
+		new_thread->inbox = inbox;
+		TQueueHashmapInsert(queue, new_thread);
+		inbox->topics = topics;
+		inbox->next = queue->inboxes;
+		queue->inboxes = inbox;
+		inbox = NULL;
+	} else
+		TQueueAddThread(queue, new_thread);
+
+	dbgprintf("AFTER SUBSCRIBE (%p)\n", thread);
+	dbgTQueuePrint(queue);
+	*ret = 0;
+
+ end:
+	TQueueUnlock(queue);
+	TQueueInboxDestroy(inbox);
+	TQueueGroupDestroy(new_group);
+
+	return *ret ? NULL : new_thread;
+}
+
+// the cursor is set up as a handle which is not in the hashmap
+TQueueGroup *TQueueGroupCreate(const char *name) {
+	size_t length = strlen(name) + 1;
+	TQueueGroup *group = malloc(sizeof(TQueueGroup) + length);
+
+	group->cursor.num = 0;
+	group->cursor.skipped = 0;
+	group->cursor.replay = 0;
+	group->cursor.id = (pthread_t)&group->cursor;
+	group->cursor.thread = &group->cursor.id;
+	group->cursor.inbox = NULL;
+	group->cursor.ready = NULL;
+	group->cursor.group = group;
+	group->members = 0;
+	group->waiting = 0;
+	pthread_cond_init(&group->cond, NULL);
+	group->next = NULL;
+	memcpy(group->name, name, length);
+	return group;
+}
+
+void TQueueGroupDestroy(TQueueGroup * group) {
+	if (group == NULL)
+		return;
+	pthread_cond_destroy(&group->cond);
+	free(group);
+}
+
+// the subscriber whose position a thread reads from
+TQueueThread *TQueueReader(TQueueThread * thread_ptr) {
+	if (thread_ptr->group != NULL)
+		return &thread_ptr->group->cursor;
+	return thread_ptr;
+}
+
+// called with the mutex held, the last member to leave removes the group,
+// its eventfd is closed with the mutex held as there is no member left
+// to take it
+void TQueueLeaveGroup(TQueue * queue, TQueueThread * thread_ptr) {
+	TQueueGroup *group = thread_ptr->group;
+	TQueueGroup **link;
+
+	TQueueHashmapRemove(queue, thread_ptr);
+	TQueueRetire(queue, thread_ptr, RETIRED_NODE);
+	if (--group->members)
+		return;
+
+	for (link = &queue->groups; *link != group; link = &(*link)->next) ;
+	TQueueStore(*link, group->next);
+	TQueueLeave(queue, &group->cursor);
+	TQueueReadyDestroy(group->cursor.ready);
+	TQueueRetire(queue, group, RETIRED_GROUP);
+}
+
+// called with the mutex held after n messages have been put, each one
+// can be claimed by one member
+void TQueueWakeGroups(TQueue * queue, unsigned long long n) {
+	for (TQueueGroup * group = queue->groups; group != NULL;
+		 group = group->next)
+		if (group->waiting)
+			TQueueSignal(&group->cond, n, group->waiting);
+}
+
+// members claim messages by moving the cursor of their group with a
+// compare and swap, the mutex is only taken to read the claimed messages
+// and count them as read; a claimed message can be evicted or removed
+// before then, the member claims another one instead
+
+// called with the mutex held, moves the cursor past evicted and removed
+// messages, counting evicted ones as skipped, and returns whether a
+// message can be claimed
+int TQueueGroupNext(TQueue * queue, TQueueGroup * group) {
+	unsigned long long num = TQueueLoad(group->cursor.num);
+
+	while (num != queue->tail) {
+		if (num < queue->head) {
+			if (!__atomic_compare_exchange_n(&group->cursor.num, &num,
+											 queue->head, 0,
+											 __ATOMIC_RELAXED,
+											 __ATOMIC_RELAXED))
+				continue;
+			if (num < queue->evicted)
+				group->cursor.skipped += queue->evicted - num;
+			num = queue->head;
+		} else if (!TQueueSlot(queue, num)->removed)
+			return 1;
+		else if (__atomic_compare_exchange_n(&group->cursor.num, &num,
+											 num + 1, 0, __ATOMIC_RELAXED,
+											 __ATOMIC_RELAXED))
+			++num;
+	}
+	return 0;
+}
+
+// claims up to max messages put before tail, with or without the mutex,
+// returns how many it has claimed from num on
+unsigned TQueueGroupClaim(TQueue * queue, TQueueGroup * group,
+						  unsigned long long *num, unsigned max) {
+	unsigned long long first = TQueueLoad(group->cursor.num);
+	unsigned long long tail;
+	unsigned n;
+
+	do {
+		tail = TQueueLoad(queue->tail);
+		if (first >= tail)
+			return 0;
+		n = tail - first < max ? (unsigned)(tail - first) : max;
+	} while (!__atomic_compare_exchange_n(&group->cursor.num, &first,
+										  first + n, 1, __ATOMIC_RELAXED,
+										  __ATOMIC_RELAXED));
+	*num = first;
+	return n;
+}
+
+// claims up to max messages for a member holding a subscription before
+// the mutex is taken, its group lasts as long as the subscription, so
+// plain subscribers only read their own node; returns how many it has
+// claimed from num on and their group
+unsigned TQueueGroupPreclaim(TQueue * queue, TQueueThread * thread_ptr,
+							 unsigned max, unsigned long long *num,
+							 TQueueGroup ** group) {
+	*group = thread_ptr->group;
+	if (*group == NULL)
+		return 0;
+	return TQueueGroupClaim(queue, *group, num, max);
+}
+
+// called with the mutex held, reads the claimed messages from num on
+// which are still in the queue into msgs, returns how many it has read
+int TQueueGroupTake(TQueue * queue, TQueueGroup * group,
+					unsigned long long num, unsigned n, void **msgs) {
+	int read = 0;
+
+	for (; n; --n, ++num)
+		if (num < queue->head) {
+			if (num < queue->evicted)
+				++group->cursor.skipped;
+		} else if (!TQueueSlot(queue, num)->removed)
+			TQueueReadSlot(queue, num, TQueueOut(queue, msgs, read++));
+	return read;
+}
+
+// called with the mutex held, reads up to max messages for a member of
+// the group, starting with the n it has claimed from num on, and waits
+// for a first one until the deadline, a member which has read fewer than
+// max is armed; returns how many it has read, -1 if the queue gets
+// destroyed and -4 if the deadline passes
+int TQueueGroupRead(TQueue * queue, TQueueGroup * group, void **msgs,
+					int max, unsigned long long num, unsigned n,
+					const struct timespec *deadline) {
+	unsigned long long head = queue->head;
+	int spin = queue->spin != 0;
+	int read = 0;
+	int timeout;
+
+	while (1) {
+		if (n) {
+			read = TQueueGroupTake(queue, group, num, n, msgs);
+			if (read)
+				break;
+			n = 0;
+		}
+		if (TQueueGroupNext(queue, group)) {
+			n = TQueueGroupClaim(queue, group, &num, (unsigned)max);
+			continue;
+		}
+		dbgprintf("FAIL GROUP GET (%s)\n", group->name);
+		if (deadline == TQUEUE_NOWAIT) {
+			TQueueReadyArm(queue, &group->cursor);
+			return -4;
+		}
+		++group->waiting;
+		timeout = TQueueWait(queue, &group->cond, &queue->get_locked,
+							 &queue->tail, spin, deadline);
+		--group->waiting;
+		spin = 0;
+		dbgprintf("RETRY GROUP GET (%s)\n", group->name);
+		if (queue->destroyed)
+			return -1;
+		if (timeout && !TQueueGroupNext(queue, group)) {
+			TQueueReadyArm(queue, &group->cursor);
+			return timeout;
+		}
+		head = queue->head;
+	}
+	if (read < max)
+		TQueueReadyArm(queue, &group->cursor);
+	TQueueWakePublishers(queue, queue->head - head);
+	return read;
+}
+
+// nodes are carved from chunks aligned to a cache line, the first word
+// of a chunk links the chunks and the first word of a free node links
+// the free list
+#define POOL_ALIGN 64
+#define POOL_CHUNK 16
+
+void TQueuePoolInit(TQueuePool * pool, unsigned node_size, unsigned n) {
+	pool->free = NULL;
+	pool->chunks = NULL;
+	pool->node_size = node_size;
+	pool->used = 0;
+	pool->capacity = 0;
+	if (n < POOL_CHUNK)
+		n = POOL_CHUNK;
+	TQueuePoolAdd(pool, TQueuePoolChunk(pool, n), n);
+}
+
+// allocates a chunk for n nodes, the pool itself is not changed
+// so the mutex does not need to be held
+void *TQueuePoolChunk(TQueuePool * pool, unsigned n) {
+	size_t size = POOL_ALIGN + (size_t)n * pool->node_size;
+	return aligned_alloc(POOL_ALIGN,
+						 (size + POOL_ALIGN - 1) / POOL_ALIGN * POOL_ALIGN);
+}
+
+void TQueuePoolAdd(TQueuePool * pool, void *chunk, unsigned n) {
+	char *node = (char *)chunk + POOL_ALIGN;
+
+	*(void **)chunk = pool->chunks;
+	pool->chunks = chunk;
+	for (unsigned i = 0; i < n; ++i, node += pool->node_size) {
+		*(void **)node = pool->free;
+		pool->free = node;
+	}
+	pool->capacity += n;
+}
+
+// returns NULL if no node is free
+void *TQueuePoolAlloc(TQueuePool * pool) {
+	void *node = pool->free;
+	if (node == NULL)
+		return NULL;
+	pool->free = *(void **)node;
+	TQueueStore(pool->used, pool->used + 1);
+	return node;
+}
+
+void TQueuePoolFree(TQueuePool * pool, void *node) {
+	*(void **)node = pool->free;
+	pool->free = node;
+	TQueueStore(pool->used, pool->used - 1);
+}
+
+void TQueuePoolDestroy(TQueuePool * pool) {
+	void *chunk = pool->chunks;
+	void *next;
+	while (chunk != NULL) {
+		next = *(void **)chunk;
+		free(chunk);
+		chunk = next;
+	}
+	pool->chunks = NULL;
+	pool->free = NULL;
+}
+
+// called with the mutex held, makes sure a node can be taken from
+// the pool, if it is empty it is doubled with the mutex released;
+// returns -1 if the queue has been destroyed meanwhile
+int TQueueReserveNode(TQueue * queue) {
+	unsigned n = queue->nodes.capacity;
+	void *chunk;
+
+	if (queue->nodes.free != NULL)
+		return 0;
+
+	TQueueUnlock(queue);
+	chunk = TQueuePoolChunk(&queue->nodes, n);
+	TQueueLock(queue);
+
+	if (queue->destroyed) {
+		free(chunk);
+		return -1;
+	}
+	TQueuePoolAdd(&queue->nodes, chunk, n);
+	dbgprintf("POOL GROWN (%u)\n", queue->nodes.capacity);
+	return 0;
+}
+
+// called with the mutex held, makes sure inbox can hold as many messages
+// as the ring, allocating it with the mutex released; returns -1 if the
+// queue has been destroyed meanwhile
+int TQueueReserveInbox(TQueue * queue, TQueueInbox ** inbox) {
+	unsigned capacity;
+
+	while (*inbox == NULL || (*inbox)->mask < queue->ring_mask) {
+		capacity = queue->ring_mask + 1;
+		TQueueUnlock(queue);
+		TQueueInboxDestroy(*inbox);
+		*inbox = TQueueInboxCreate(capacity);
+		TQueueLock(queue);
+		if (queue->destroyed)
+			return -1;
+	}
+	return 0;
+}
+
+// capacity has to be a power of two
+TQueueInbox *TQueueInboxCreate(unsigned capacity) {
+	TQueueInbox *inbox = malloc(sizeof(TQueueInbox));
+	inbox->topics = 0;
+	inbox->seqs = malloc(capacity * sizeof(unsigned long long));
+	inbox->mask = capacity - 1;
+	inbox->first = 0;
+	inbox->count = 0;
+	inbox->skipped = 0;
+	pthread_cond_init(&inbox->cond, NULL);
+	inbox->next = NULL;
+	return inbox;
+}
+
+void TQueueInboxDestroy(TQueueInbox * inbox) {
+	if (inbox == NULL)
+		return;
+	pthread_cond_destroy(&inbox->cond);
+	free(inbox->seqs);
+	free(inbox);
+}
+
+// only the array of sequence numbers moves, the condition variable
+// may have waiters
+// returns -1 if the inbox cannot be allocated, it is left as it was then
+int TQueueInboxResize(TQueueInbox * inbox, unsigned capacity) {
+	unsigned long long *seqs = malloc(capacity * sizeof(unsigned long long));
+
+	if (seqs == NULL)
+		return -1;
+	for (unsigned i = 0; i < inbox->count; ++i)
+		seqs[i] = *TQueueInboxSeq(inbox, i);
+	free(inbox->seqs);
+	inbox->seqs = seqs;
+	inbox->mask = capacity - 1;
+	inbox->first = 0;
+	return 0;
+}
+
+// i-th oldest message of the inbox
+unsigned long long *TQueueInboxSeq(TQueueInbox * inbox, unsigned i) {
+	return &inbox->seqs[(inbox->first + i) & inbox->mask];
+}
+
+int TQueueTopicSubscribed(TQueue * queue, int topic) {
+	for (TQueueInbox * inbox = queue->inboxes; inbox != NULL;
+		 inbox = inbox->next)
+		if (inbox->topics & TQUEUE_TOPIC(topic))
+			return 1;
+	return 0;
+}
+
+// called after the message has been appended, counts it against the
+// topic subscribers and wakes only those
+void TQueueDeliver(TQueue * queue, int topic) {
+	unsigned long long num = queue->tail - 1;
+	TQueueMessage *message_ptr = TQueueSlot(queue, num);
+
+	for (TQueueInbox * inbox = queue->inboxes; inbox != NULL;
+		 inbox = inbox->next) {
+		if (!(inbox->topics & TQUEUE_TOPIC(topic)))
+			continue;
+		// evicted messages are left to the subscriber, they are only
+		// dropped here to keep the inbox within the ring size
+		while (inbox->count && *TQueueInboxSeq(inbox, 0) < queue->head)
+			TQueueInboxSkip(queue, inbox, NULL);
+		*TQueueInboxSeq(inbox, inbox->count) = num;
+		TQueueStore(inbox->count, inbox->count + 1);
+		++message_ptr->count;
+		pthread_cond_signal(&inbox->cond);
+	}
+}
+
+// drops the oldest message of the inbox, counting it as skipped if it
+// has been evicted
+void TQueueInboxSkip(TQueue * queue, TQueueInbox * inbox,
+					 TQueueThread * thread_ptr) {
+	if (*TQueueInboxSeq(inbox, 0) < queue->evicted) {
+		if (thread_ptr != NULL)
+			++thread_ptr->skipped;
+		else
+			++inbox->skipped;
+	}
+	++inbox->first;
+	TQueueStore(inbox->count, inbox->count - 1);
+}
+
+// moves the thread past removed messages, those already taken off the
+// head included, returns whether it has a message to read, a thread left
+// behind by TQueueEvict counts the evicted messages it has not read
+int TQueueNextMessage(TQueue * queue, TQueueThread * thread_ptr) {
+	TQueueInbox *inbox = thread_ptr->inbox;
+	unsigned long long num;
+
+	if (inbox != NULL) {
+		while (inbox->count && ((num = *TQueueInboxSeq(inbox, 0))
+								< queue->head
+								|| TQueueSlot(queue, num)->removed))
+			TQueueInboxSkip(queue, inbox, thread_ptr);
+		return inbox->count != 0;
+	}
+
+	if (thread_ptr->group != NULL)
+		return TQueueGroupNext(queue, thread_ptr->group);
+
+	if (thread_ptr->replay) {
+		if (thread_ptr->num < queue->journal->first) {
+			thread_ptr->skipped += queue->journal->first - thread_ptr->num;
+			TQueueStore(thread_ptr->num, queue->journal->first);
+		}
+		if (thread_ptr->num != queue->tail)
+			return 1;
+		TQueueJoin(queue, thread_ptr);
+		return 0;
+	}
+
+	if (thread_ptr->num < queue->head) {
+		if (thread_ptr->num < queue->evicted)
+			thread_ptr->skipped += queue->evicted - thread_ptr->num;
+		TQueueStore(thread_ptr->num, queue->head);
+	}
+	while (thread_ptr->num != queue->tail
+		   && TQueueSlot(queue, thread_ptr->num)->removed)
+		TQueueStore(thread_ptr->num, thread_ptr->num + 1);
+	return thread_ptr->num != queue->tail;
+}
+
+// number of messages the thread has not read yet, removed messages
+// further on are only counted when there are any
+unsigned long long TQueuePending(TQueue * queue, TQueueThread * thread_ptr) {
+	TQueueInbox *inbox;
+	unsigned long long first;
+	unsigned long long pending;
+
+	thread_ptr = TQueueReader(thread_ptr);
+	inbox = thread_ptr->inbox;
+
+	if (!TQueueNextMessage(queue, thread_ptr))
+		return 0;
+
+	if (inbox != NULL) {
+		pending = inbox->count;
+		if (queue->tombstones)
+			for (unsigned i = 1; i < inbox->count; ++i)
+				pending -= TQueueSlot(queue,
+									  *TQueueInboxSeq(inbox, i))->removed;
+		return pending;
+	}
+
+	// members of a group may claim messages meanwhile
+	first = TQueueLoad(thread_ptr->num);
+	pending = queue->tail - first;
+	if (queue->tombstones && !thread_ptr->replay)
+		for (unsigned long long num = first + 1; num != queue->tail; ++num)
+			pending -= TQueueSlot(queue, num)->removed;
+	return pending;
+}
+
+// a peek is counted in peekers from before it reads the hashmaps until
+// it is done with the node it has found, returns -1 if the queue has
+// been destroyed
+int TQueuePeekEnter(TQueue * queue) {
+	__atomic_fetch_add(&queue->peekers, 1, __ATOMIC_ACQ_REL);
+	if (TQueueLoad(queue->destroyed)) {
+		TQueuePeekLeave(queue);
+		return -1;
+	}
+	return 0;
+}
+
+// the last peek to leave a destroyed queue wakes TQueuePeekDrain; when
+// something has been retired, a peek takes the mutex before it stops
+// being counted, so that the last one frees it while the queue cannot be
+// destroyed under it
+void TQueuePeekLeave(TQueue * queue) {
+	if (TQueueLoad(queue->retired) == NULL) {
+		if (!__atomic_sub_fetch(&queue->peekers, 1, __ATOMIC_ACQ_REL)
+			&& TQueueLoad(queue->destroyed))
+			TQueueFutexWake(&queue->peekers);
+		return;
+	}
+
+	TQueueLock(queue);
+	if (!__atomic_sub_fetch(&queue->peekers, 1, __ATOMIC_ACQ_REL)) {
+		if (queue->destroyed)
+			TQueueFutexWake(&queue->peekers);
+		else
+			TQueueReclaim(queue);
+	}
+	TQueueUnlock(queue);
+}
+
+// called with the mutex held once the queue has been destroyed, waits
+// for the peeks in progress with the mutex released, nothing else uses
+// the queue by then
+void TQueuePeekDrain(TQueue * queue) {
+	unsigned peekers;
+
+	while ((peekers = __atomic_fetch_add(&queue->peekers, 0,
+										 __ATOMIC_ACQ_REL))) {
+		TQueueUnlock(queue);
+		TQueueFutexWait(&queue->peekers, peekers);
+		TQueueLock(queue);
+	}
+}
+
+// whether no peek is in progress; the counter is updated rather than
+// read, so that a peek which enters later sees everything done before
+int TQueuePeekQuiescent(TQueue * queue) {
+	return !__atomic_fetch_add(&queue->peekers, 0, __ATOMIC_ACQ_REL);
+}
+
+// called with the mutex held once ptr cannot be reached by peeks
+// starting from now, it is freed right away if no peek is in progress,
+// otherwise it is linked to retired through its own link until a later
+// call or the last peek to leave finds none in progress
+void TQueueRetire(TQueue * queue, void *ptr, unsigned char kind) {
+	TQueueRetired *retired;
+
+	if (ptr == NULL)
+		return;
+	if (TQueuePeekQuiescent(queue)) {
+		TQueueReclaim(queue);
+		TQueueFreeRetired(queue, ptr, kind);
+		return;
+	}
+	if (kind == RETIRED_NODE)
+		retired = &((TQueueThread *) ptr)->retired;
+	else if (kind == RETIRED_INBOX)
+		retired = &((TQueueInbox *) ptr)->retired;
+	else if (kind == RETIRED_GROUP)
+		retired = &((TQueueGroup *) ptr)->cursor.retired;
+	else
+		retired = (TQueueRetired *) ptr - 1;
+	retired->ptr = ptr;
+	retired->kind = kind;
+	retired->next = queue->retired;
+	TQueueStore(queue->retired, retired);
+}
+
+// called with the mutex held after peekers has been seen at zero, frees
+// everything retired before
+void TQueueReclaim(TQueue * queue) {
+	TQueueRetired *retired = queue->retired;
+	TQueueRetired *next;
+
+	TQueueStore(queue->retired, NULL);
+	for (; retired != NULL; retired = next) {
+		next = retired->next;
+		TQueueFreeRetired(queue, retired->ptr, retired->kind);
+	}
+}
+
+void TQueueFreeRetired(TQueue * queue, void *ptr, unsigned char kind) {
+	if (kind == RETIRED_NODE)
+		TQueuePoolFree(&queue->nodes, ptr);
+	else if (kind == RETIRED_INBOX)
+		TQueueInboxDestroy(ptr);
+	else if (kind == RETIRED_GROUP)
+		TQueueGroupDestroy(ptr);
+	else
+		TQueueHashmapFree(ptr);
+}
+
+// hashmaps are preceded by the link they are retired with
+TQueueThread **TQueueHashmapAlloc(unsigned size) {
+	TQueueRetired *retired = calloc(1, sizeof(TQueueRetired)
+									+ size * sizeof(TQueueThread *));
+
+	return retired != NULL ? (TQueueThread **) (retired + 1) : NULL;
+}
+
+void TQueueHashmapFree(TQueueThread ** hashmap) {
+	if (hashmap != NULL)
+		free((TQueueRetired *) hashmap - 1);
+}
+
+void TQueueFutexWait(unsigned *addr, unsigned val) {
+	syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, val, NULL, NULL, 0);
+}
+
+void TQueueFutexWake(unsigned *addr) {
+	syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+}
+
+// TQueueFind without the mutex, the hashmaps are taken while
+// hashmap_version is even and unchanged, and a thread which is not found
+// is looked up again if they have been replaced meanwhile, as it may
+// have been moved to a new hashmap
+TQueueThread *TQueuePeekFind(TQueue * queue, pthread_t * thread) {
+	TQueueThread *thread_ptr;
+	TQueueThread **hashmap;
 	TQueueThread **old_hashmap;
-	TQueueThread *hashmap_pos;
-	TQueueThread *next_thread;
+	unsigned size;
+	unsigned old_size;
+	unsigned version;
+
+	for (;;) {
+		version = __atomic_load_n(&queue->hashmap_version, __ATOMIC_ACQUIRE);
+		hashmap = __atomic_load_n(&queue->hashmap, __ATOMIC_ACQUIRE);
+		size = __atomic_load_n(&queue->hashmap_size, __ATOMIC_ACQUIRE);
+		old_hashmap = __atomic_load_n(&queue->old_hashmap, __ATOMIC_ACQUIRE);
+		old_size = __atomic_load_n(&queue->old_hashmap_size,
+								   __ATOMIC_ACQUIRE);
+		if (version & 1 || TQueueLoad(queue->hashmap_version) != version) {
+			cpu_relax();
+			continue;
+		}
+
+		// a thread being moved is put in the new hashmap before its old
+		// slot is deleted, so the old one is looked in first
+		thread_ptr = NULL;
+		if (old_hashmap != NULL)
+			thread_ptr = TQueuePeekSlot(old_hashmap, old_size, thread);
+		if (thread_ptr == NULL)
+			thread_ptr = TQueuePeekSlot(hashmap, size, thread);
+
+		if (thread_ptr != NULL
+			|| TQueueLoad(queue->hashmap_version) == version)
+			return thread_ptr;
+	}
+}
+
+// TQueueHashmapSlot for peeks, slots may change while they are probed so
+// at most size of them are
+TQueueThread *TQueuePeekSlot(TQueueThread ** hashmap, unsigned size,
+							 pthread_t * thread) {
 	TQueueThread *thread_ptr;
-	unsigned hash;
+	unsigned i = TQueueHashSize(thread, size);
 
-	pthread_mutex_lock(&queue->lock);
+	for (unsigned n = 0; n < size; ++n) {
+		thread_ptr = __atomic_load_n(&hashmap[i], __ATOMIC_ACQUIRE);
+		if (thread_ptr == NULL)
+			return NULL;
+		if (thread_ptr != DELETED_THREAD && thread_ptr->thread == thread)
+			return thread_ptr;
+		i = (i + 1) % size;
+	}
+	return NULL;
+}
 
-	if (queue->destroyed)
-		goto end;
+// TQueuePending without the mutex, the position of the thread is not
+// moved, so removed messages ahead of it are counted and so are evicted
+// ones until it reads again; the position is read before the tail, which
+// it cannot pass
+int TQueuePeekPending(TQueue * queue, TQueueThread * thread_ptr) {
+	TQueueInbox *inbox;
+	unsigned long long num;
+	unsigned long long head;
+	unsigned long long tail;
 
-	old_size = queue->hashmap_size;
-	old_hashmap = queue->hashmap;
-	queue->hashmap_size = *hashmap_size;
-	queue->hashmap = malloc(queue->hashmap_size * sizeof(TQueueThread *));
-
-	for (int i = 0; i < old_size; ++i) {
-		hashmap_pos = old_hashmap[i];
-		while (hashmap_pos != NULL) {
-			hash = TQueueHash(queue, hashmap_pos->thread);
-			next_thread = hashmap_pos->next;
-			hashmap_pos->next = NULL;
-			thread_ptr = queue->hashmap[hash];
-			if (thread_ptr == NULL)
-				queue->hashmap[hash] = hashmap_pos;
-			else {
-				while (thread_ptr->next != NULL)
-					thread_ptr = thread_ptr->next;
-				thread_ptr->next = hashmap_pos;
-			}
-			hashmap_pos = next_thread;
-		}
+	thread_ptr = TQueueReader(thread_ptr);
+	inbox = thread_ptr->inbox;
+
+	if (inbox != NULL)
+		return (int)TQueueLoad(inbox->count);
+
+	num = TQueueLoad(thread_ptr->num);
+	head = TQueueLoad(queue->head);
+	// a replaying thread reads from the journal, behind the head
+	if (num < head && !TQueueLoad(thread_ptr->replay))
+		num = head;
+	tail = TQueueLoad(queue->tail);
+	return tail > num ? (int)(tail - num) : 0;
+}
+
+// returns and resets the number of messages the thread has skipped
+int TQueueTakeSkipped(TQueue * queue, TQueueThread * thread_ptr) {
+	unsigned long long skipped;
+
+	thread_ptr = TQueueReader(thread_ptr);
+	TQueueNextMessage(queue, thread_ptr);
+	skipped = thread_ptr->skipped;
+	if (thread_ptr->inbox != NULL) {
+		skipped += thread_ptr->inbox->skipped;
+		thread_ptr->inbox->skipped = 0;
 	}
-	free(old_hashmap);
+	thread_ptr->skipped = 0;
+	return skipped > INT_MAX ? INT_MAX : (int)skipped;
+}
 
-	ret = 0;
- end:
-	pthread_mutex_unlock(&queue->lock);
+// drops the oldest n messages in one step, only the slots are walked to
+// pass their unsubscriptions on, threads left behind the new head catch
+// up in TQueueNextMessage
+void TQueueEvict(TQueue * queue, unsigned n) {
+	unsigned long long num = queue->head;
+	TQueueMessage *message_ptr;
+	int unsubscribed = 0;
 
-	return ret;
+	dbgprintf("to evict: %llu (%u)\n", queue->head, n);
+	TQueueStore(queue->size, queue->size - n);
+	queue->stats.evictions += n;
+	while (n) {
+		TQueueReleaseMessage(queue, num, TQUEUE_RELEASE_EVICTED);
+		message_ptr = TQueueSlot(queue, num++);
+		unsubscribed += message_ptr->unsubscribed;
+		if (message_ptr->removed)
+			--queue->tombstones;
+		else
+			--n;
+	}
+
+	message_ptr = TQueueSlot(queue, num);
+	message_ptr->count -= unsubscribed;
+	message_ptr->unsubscribed += unsubscribed;
+	TQueueStore(queue->head, num);
+	queue->evicted = num;
 }
 
-// non-interface functions:
+// removes messages read by all and removed messages from the head
+void TQueueRemoveRead(TQueue * queue) {
+	TQueueMessage *message_ptr;
 
-unsigned TQueueHash(TQueue * queue, pthread_t * thread) {
-	unsigned long hash = 0xcbf29ce484222325UL;
-	unsigned long prime = 0x100000001b3UL;
-	unsigned long x = *((unsigned long *)thread);
-	do {
-		hash = (hash ^ (x & 0xff)) * prime;
-	} while (x >>= 8);
-	return (unsigned)((hash) % (unsigned long)queue->hashmap_size);
+	while (queue->head != queue->tail) {
+		message_ptr = TQueueSlot(queue, queue->head);
+		if (message_ptr->count && !message_ptr->removed)
+			break;
+		TQueueRemoveHead(queue);
+	}
 }
 
-void TQueueSubscriptionsCleanUp(TQueue * queue) {
-	int total_unsubscribed = 0;
-	TQueueMessage *message_ptr = queue->head;
-	do {
-		message_ptr->count -= total_unsubscribed;
-		total_unsubscribed += message_ptr->unsubscribed;
-		message_ptr->unsubscribed = 0;
-		message_ptr = message_ptr->next;
-	} while (message_ptr != NULL);
-	queue->subscribers -= total_unsubscribed;
+// marks the message as removed, it stays in its slot until it reaches
+// the head, subscribers skip it when they get to it
+void TQueueRemoveSlot(TQueue * queue, unsigned long long num) {
+	TQueueMessage *message_ptr = TQueueSlot(queue, num);
+	unsigned long long head = queue->head;
+
+	TQueueReleaseMessage(queue, num, TQUEUE_RELEASE_REMOVED);
+	message_ptr->removed = 1;
+	message_ptr->message = NULL;
+	++queue->tombstones;
+	TQueueStore(queue->size, queue->size - 1);
+	++queue->stats.removals;
+
+	TQueueRemoveRead(queue);
+	TQueueWakePublishers(queue, 1 + queue->head - head);
+}
+
+TQueueMessage *TQueueSlot(TQueue * queue, unsigned long long num) {
+	return &queue->ring[num & queue->ring_mask];
+}
+
+// inline storage of the slot on typed queues
+char *TQueuePayload(TQueue * queue, unsigned long long num) {
+	return queue->payload + (num & queue->ring_mask) * queue->elem_size;
+}
+
+// called for every message leaving the queue, removed messages have
+// already left it
+void TQueueReleaseMessage(TQueue * queue, unsigned long long num,
+						  int reason) {
+	if (TQueueSlot(queue, num)->removed)
+		return;
+	if (queue->release != NULL)
+		queue->release(queue->elem_size ? TQueuePayload(queue, num)
+					   : TQueueSlot(queue, num)->message, reason,
+					   queue->release_arg);
+	if (queue->ops != NULL)
+		queue->ops->destroy(TQueuePayload(queue, num));
+}
+
+// a message put while nobody is subscribed does not enter the queue
+void TQueueReleaseDropped(TQueue * queue, void *msg) {
+	++queue->stats.drops;
+	if (queue->release != NULL)
+		queue->release(msg, TQUEUE_RELEASE_DROPPED, queue->release_arg);
+}
+
+// typed queues compare the payload msg points to
+int TQueueMatch(TQueue * queue, unsigned long long num, void *msg) {
+	if (queue->ops != NULL)
+		return queue->ops->match != NULL
+			&& queue->ops->match(TQueuePayload(queue, num), msg);
+	if (queue->elem_size)
+		return !memcmp(TQueuePayload(queue, num), msg, queue->elem_size);
+	return TQueueSlot(queue, num)->message == msg;
+}
+
+// position of the i-th message of a batch, typed queues read payloads
+// into consecutive elem_size byte places of the buffer
+void **TQueueOut(TQueue * queue, void **msgs, int i) {
+	if (queue->elem_size)
+		return (void **)((char *)msgs + (size_t)i * queue->elem_size);
+	return &msgs[i];
+}
+
+// the ring holds up to max_size messages and the tail slot, it has at
+// most 2^31 slots as sizes are ints
+unsigned TQueueRingCapacity(unsigned max_size) {
+	unsigned capacity = 1;
+	while (capacity <= max_size && capacity < 1u << 31)
+		capacity <<= 1;
+	return capacity;
+}
+
+// allocates a ring of capacity slots, halving capacity while that fails
+// down to two slots, NULL if even these cannot be allocated
+void *TQueueRingAlloc(unsigned *capacity, size_t slot) {
+	void *ring;
+
+	while ((ring = malloc((size_t)*capacity * slot)) == NULL && *capacity > 2)
+		*capacity >>= 1;
+	return ring;
+}
+
+// removed messages keep their slots until they reach the head,
+// so the ring has to hold them too
+unsigned TQueueRingCapacityLocked(TQueue * queue) {
+	unsigned long long used = queue->tail - queue->head;
+	return TQueueRingCapacity(used > queue->max_size ?
+							  (unsigned)used : queue->max_size);
 }
 
-void TQueueIdCleanup(TQueue * queue) {
-	unsigned lowest_id = queue->head->num;
-	TQueueMessage *message_ptr = queue->head;
+// returns -1 if the ring cannot be allocated, it is left as it was then,
+// inboxes which have been grown meanwhile are only larger than needed
+int TQueueRingResize(TQueue * queue, unsigned capacity) {
+	TQueueMessage *old_ring = queue->ring;
+	unsigned old_mask = queue->ring_mask;
+	unsigned long long num = queue->head;
+	char *old_payload = queue->payload;
+	TQueueMessage *ring;
+	char *payload = NULL;
+	TQueueInbox *inbox;
+
+	if (capacity == old_mask + 1)
+		return 0;
+
+	for (inbox = queue->inboxes; inbox != NULL; inbox = inbox->next)
+		if (inbox->mask + 1 < capacity && TQueueInboxResize(inbox, capacity))
+			return -1;
+	ring = malloc(capacity * sizeof(TQueueMessage));
+	if (queue->elem_size)
+		payload = malloc((size_t)capacity * queue->elem_size);
+	if (ring == NULL || (queue->elem_size && payload == NULL)) {
+		free(ring);
+		free(payload);
+		return -1;
+	}
+
+	queue->ring = ring;
+	queue->ring_mask = capacity - 1;
 	do {
-		message_ptr->num -= lowest_id;
-		message_ptr = message_ptr->next;
-	} while (message_ptr != NULL);
+		*TQueueSlot(queue, num) = old_ring[num & old_mask];
+	} while (num++ != queue->tail);
+	free(old_ring);
+
+	if (queue->elem_size) {
+		queue->payload = payload;
+		for (num = queue->head; num != queue->tail; ++num)
+			if (queue->ops == NULL)
+				memcpy(TQueuePayload(queue, num),
+					   old_payload + (num & old_mask) * queue->elem_size,
+					   queue->elem_size);
+			else if (!TQueueSlot(queue, num)->removed)
+				queue->ops->move(TQueuePayload(queue, num),
+								 old_payload
+								 + (num & old_mask) * queue->elem_size);
+		free(old_payload);
+	}
+
+	return 0;
+}
+
+// called with the mutex held, grows the ring when n more messages do not
+// fit in it, returns how many of them fit, fewer if it cannot be grown
+unsigned TQueueRingRoom(TQueue * queue, unsigned n) {
+	unsigned long long used = queue->tail - queue->head;
+
+	if (used + n > queue->ring_mask)
+		TQueueRingResize(queue, TQueueRingCapacity((unsigned)(used + n)));
+	if (used + n > queue->ring_mask)
+		return queue->ring_mask - (unsigned)used;
+	return n;
+}
+
+// whether a put has to wait: the queue holds max_size messages, removed
+// messages which have not reached the head take up the slots they may
+// span, or the ring cannot grow to take another message
+int TQueueFull(TQueue * queue) {
+	return queue->size >= queue->max_size
+		|| queue->tail - queue->head
+		>= TOMBSTONE_SPAN * (unsigned long long)queue->max_size
+		|| !TQueueRingRoom(queue, 1);
+}
+
+// removes the head message and passes its unsubscriptions on to the next one
+void TQueueRemoveHead(TQueue * queue) {
+	TQueueMessage *message_ptr = TQueueSlot(queue, queue->head);
+	TQueueMessage *next_message = TQueueSlot(queue, queue->head + 1);
+	TQueueReleaseMessage(queue, queue->head, TQUEUE_RELEASE_CONSUMED);
+	next_message->count -= message_ptr->unsubscribed;
+	next_message->unsubscribed += message_ptr->unsubscribed;
+	TQueueStore(queue->head, queue->head + 1);
+	if (message_ptr->removed)
+		--queue->tombstones;
+	else
+		TQueueStore(queue->size, queue->size - 1);
+}
+
+// slot of the hashmap holding thread, NULL if it is not there
+TQueueThread **TQueueHashmapSlot(TQueueThread ** hashmap, unsigned size,
+								 pthread_t * thread) {
+	unsigned i = TQueueHashSize(thread, size);
+	while (hashmap[i] != NULL) {
+		if (hashmap[i] != DELETED_THREAD && hashmap[i]->thread == thread)
+			return &hashmap[i];
+		i = (i + 1) % size;
+	}
+	return NULL;
+}
+
+// a thread is in the new hashmap or, while it grows, still in the old one
+TQueueThread *TQueueFind(TQueue * queue, pthread_t * thread) {
+	TQueueThread **slot;
+
+	TQueueRehashStep(queue, REHASH_STEP);
+	slot = TQueueHashmapSlot(queue->hashmap, queue->hashmap_size, thread);
+	if (slot == NULL && queue->old_hashmap != NULL)
+		slot = TQueueHashmapSlot(queue->old_hashmap, queue->old_hashmap_size,
+								 thread);
+	return slot != NULL ? *slot : NULL;
+}
+
+// deleted slots are not reused, they are dropped when the hashmap is
+// resized
+void TQueueHashmapPut(TQueue * queue, TQueueThread * thread_ptr) {
+	unsigned i = TQueueHash(queue, thread_ptr->thread);
+	while (queue->hashmap[i] != NULL)
+		i = (i + 1) % queue->hashmap_size;
+	// peeks may find the node as soon as it is stored
+	__atomic_store_n(&queue->hashmap[i], thread_ptr, __ATOMIC_RELEASE);
+	++queue->hashmap_used;
+}
+
+// the hashmap is resized once subscribers and deleted slots fill half
+// of it, to at least four times the number of subscribers
+void TQueueHashmapInsert(TQueue * queue, TQueueThread * thread_ptr) {
+	unsigned size = queue->hashmap_size;
+
+	if ((queue->hashmap_used + 1) * 2 > queue->hashmap_size) {
+		while (size < (queue->subscriptions + 1) * 4)
+			size *= 2;
+		TQueueHashmapResize(queue, size);
+	}
+	TQueueHashmapPut(queue, thread_ptr);
+	TQueueStore(queue->subscriptions, queue->subscriptions + 1);
+}
+
+// allocates a new hashmap, the subscribers are moved to it REHASH_STEP
+// old slots at a time by the following operations
+void TQueueHashmapResize(TQueue * queue, unsigned size) {
+	// a resize started earlier is finished first
+	TQueueRehashStep(queue, queue->old_hashmap_size);
+
+	TQueueHashmapVersion(queue);
+	__atomic_store_n(&queue->old_hashmap, queue->hashmap, __ATOMIC_RELEASE);
+	__atomic_store_n(&queue->old_hashmap_size, queue->hashmap_size,
+					 __ATOMIC_RELEASE);
+	queue->rehashed = 0;
+	__atomic_store_n(&queue->hashmap, TQueueHashmapAlloc(size),
+					 __ATOMIC_RELEASE);
+	__atomic_store_n(&queue->hashmap_size, size, __ATOMIC_RELEASE);
+	queue->hashmap_used = 0;
+	TQueueHashmapVersion(queue);
+}
+
+void TQueueRehashStep(TQueue * queue, unsigned n) {
+	TQueueThread **slot;
+
+	if (queue->old_hashmap == NULL)
+		return;
+
+	while (n-- && queue->rehashed < queue->old_hashmap_size) {
+		slot = &queue->old_hashmap[queue->rehashed++];
+		if (*slot != NULL && *slot != DELETED_THREAD) {
+			TQueueHashmapPut(queue, *slot);
+			// lookups in the old hashmap have to probe past it, the
+			// node is in the new one by the time peeks see this
+			__atomic_store_n(slot, DELETED_THREAD, __ATOMIC_RELEASE);
+		}
+	}
+
+	if (queue->rehashed == queue->old_hashmap_size) {
+		slot = queue->old_hashmap;
+		TQueueHashmapVersion(queue);
+		__atomic_store_n(&queue->old_hashmap, NULL, __ATOMIC_RELEASE);
+		__atomic_store_n(&queue->old_hashmap_size, 0, __ATOMIC_RELEASE);
+		TQueueHashmapVersion(queue);
+		TQueueRetire(queue, slot, RETIRED_HASHMAP);
+	}
+}
+
+// called before and after the hashmaps are replaced, peeks only use
+// them while hashmap_version is even and the same before and after; the
+// hashmaps are stored with release and loaded with acquire, so that
+// a peek which sees a new one sees the odd version after it too
+void TQueueHashmapVersion(TQueue * queue) {
+	__atomic_store_n(&queue->hashmap_version, queue->hashmap_version + 1,
+					 __ATOMIC_RELEASE);
+}
+
+// iterates over all subscribers, i starts at 0, returns NULL at the end
+TQueueThread *TQueueNextThread(TQueue * queue, unsigned *i) {
+	TQueueThread *thread_ptr;
+
+	while (*i < queue->old_hashmap_size + queue->hashmap_size) {
+		if (*i < queue->old_hashmap_size)
+			thread_ptr = queue->old_hashmap[*i];
+		else
+			thread_ptr = queue->hashmap[*i - queue->old_hashmap_size];
+		++*i;
+		if (thread_ptr != NULL && thread_ptr != DELETED_THREAD)
+			return thread_ptr;
+	}
+	return NULL;
+}
+
+// the thread is counted on messages put from now on
+void TQueueJoin(TQueue * queue, TQueueThread * thread_ptr) {
+	++queue->subscribers;
+
+	if (queue->subscribers > 0x40000000)
+		TQueueSubscriptionsCleanUp(queue);
+
+	TQueueStore(thread_ptr->num, queue->tail);
+	TQueueStore(thread_ptr->replay, 0);
+}
+
+void TQueueAddThread(TQueue * queue, TQueueThread * new_thread) {
+	TQueueJoin(queue, new_thread);
+	new_thread->inbox = NULL;
+	TQueueHashmapInsert(queue, new_thread);
+}
+
+// unread messages of the thread are treated as read
+void TQueueRemoveThread(TQueue * queue, TQueueThread * thread_ptr) {
+	if (thread_ptr->group != NULL) {
+		TQueueLeaveGroup(queue, thread_ptr);
+		return;
+	}
+
+	TQueueHashmapRemove(queue, thread_ptr);
+	TQueueLeave(queue, thread_ptr);
+	TQueueRetire(queue, thread_ptr->inbox, RETIRED_INBOX);
+	TQueueRetire(queue, thread_ptr, RETIRED_NODE);
+}
+
+void TQueueHashmapRemove(TQueue * queue, TQueueThread * thread_ptr) {
+	TQueueThread **slot;
+
+	slot = TQueueHashmapSlot(queue->hashmap, queue->hashmap_size,
+							 thread_ptr->thread);
+	if (slot == NULL)
+		slot = TQueueHashmapSlot(queue->old_hashmap, queue->old_hashmap_size,
+								 thread_ptr->thread);
+	// a peek which has found the thread may still read its node, inbox
+	// or group, they are retired rather than freed
+	TQueueStore(*slot, DELETED_THREAD);
+	TQueueStore(queue->subscriptions, queue->subscriptions - 1);
+}
+
+// the thread is no longer counted on messages
+void TQueueLeave(TQueue * queue, TQueueThread * thread_ptr) {
+	TQueueMessage *message_ptr;
+	TQueueInbox **inbox;
+	unsigned long long head;
+
+	// removed messages are skipped, so the thread is counted on every
+	// message from its position on
+	TQueueNextMessage(queue, thread_ptr);
+
+	if (thread_ptr->ready != NULL)
+		TQueueReadyUnlink(queue, thread_ptr->ready);
+	if (thread_ptr->inbox != NULL) {
+		// topic subscribers are counted only on delivered messages
+		for (inbox = &queue->inboxes; *inbox != thread_ptr->inbox;
+			 inbox = &(*inbox)->next) ;
+		*inbox = thread_ptr->inbox->next;
+		for (unsigned i = 0; i < thread_ptr->inbox->count; ++i)
+			--TQueueSlot(queue,
+						 *TQueueInboxSeq(thread_ptr->inbox, i))->count;
+	} else if (!thread_ptr->replay) {
+		message_ptr = TQueueSlot(queue, thread_ptr->num);
+		--message_ptr->count;
+		++message_ptr->unsubscribed;
+	}
+
+	if (queue->head != queue->tail && !TQueueSlot(queue, queue->head)->count) {
+		dbgprintf("REMOVING_UNSUB\n");
+		head = queue->head;
+		TQueueRemoveRead(queue);
+		TQueueWakePublishers(queue, queue->head - head);
+	}
+}
+
+#define SPIN_NS 5000
+#define SPIN_MIN 16
+
+// releases the mutex until the value changes, for at most spin_limit
+// iterations and SPIN_NS; a spin which has seen the value change allows
+// twice the iterations it needed next time and one which has not halves
+// the limit, so threads stop spinning on a queue where it does not pay
+void TQueueSpin(TQueue * queue, unsigned long long *field) {
+	unsigned long long value = *field;
+	unsigned long long start = TQueueNow();
+	unsigned limit = queue->spin_limit;
+	unsigned i;
+	int changed = 0;
+
+	TQueueUnlock(queue);
+	for (i = 0; i < limit; ++i) {
+		if (TQueueLoad(*field) != value) {
+			changed = 1;
+			break;
+		}
+		if (TQueueLoad(queue->destroyed)
+			|| ((i & 63) == 63 && TQueueNow() - start > SPIN_NS))
+			break;
+		cpu_relax();
+	}
+	TQueueLock(queue);
+
+	limit = changed ? 2 * i : queue->spin_limit / 2;
+	if (limit < SPIN_MIN)
+		limit = SPIN_MIN;
+	queue->spin_limit = limit < queue->spin ? limit : queue->spin;
+}
+
+// spins on field or waits on cond until woken or the deadline passes,
+// returns -4 when it has passed, the waiter is counted in locked either
+// way so that destroying the queue waits for it, the last one to leave
+// a destroyed queue signals destroy_cond
+int TQueueWait(TQueue * queue, pthread_cond_t * cond, unsigned *locked,
+			   unsigned long long *field, int spin,
+			   const struct timespec *deadline) {
+	int rc = 0;
+
+	++*locked;
+	if (spin)
+		TQueueSpin(queue, field);
+	else
+		rc = TQueueCondWait(queue, cond, deadline);
+	--*locked;
+
+	if (queue->destroyed && !queue->get_locked && !queue->put_locked)
+		pthread_cond_signal(&queue->destroy_cond);
+
+	return rc == ETIMEDOUT ? -4 : 0;
+}
+
+// number of messages puts can fill the queue with, with a lag limit
+// the subscribers may not fall further behind
+unsigned TQueueLimit(TQueue * queue) {
+	if (queue->policy == TQUEUE_POLICY_MAX_LAG
+		&& queue->max_lag < queue->max_size)
+		return queue->max_lag;
+	return queue->max_size;
+}
+
+// makes room for n messages (as many as fit) by evicting the oldest ones
+// if the policy does not make publishers wait for slow subscribers,
+// which skip them
+void TQueueOverwrite(TQueue * queue, unsigned n) {
+	unsigned limit = TQueueLimit(queue);
+
+	if (queue->policy == TQUEUE_POLICY_BLOCK
+		|| (queue->policy == TQUEUE_POLICY_MAX_LAG
+			&& limit == queue->max_size))
+		return;
+
+	if (n > limit)
+		n = limit;
+	if (queue->size + n > limit) {
+		TQueueEvict(queue, queue->size + n - limit);
+		// with topics a newer message can be read by all before the head
+		TQueueRemoveRead(queue);
+	}
+	// removed messages behind a slow subscriber are evicted with it
+	while (queue->size && queue->tail - queue->head + n
+		   > TOMBSTONE_SPAN * (unsigned long long)queue->max_size) {
+		TQueueEvict(queue, 1);
+		TQueueRemoveRead(queue);
+	}
+}
+
+// called with the mutex held, waits until the queue is not full,
+// returns -1 if the queue gets destroyed and -4 if the deadline passes
+int TQueueWaitSpace(TQueue * queue, const struct timespec *deadline) {
+	int spin = queue->spin != 0;
+	int timeout;
+
+	TQueueOverwrite(queue, 1);
+	while (TQueueFull(queue) || !TQueueJournalRoom(queue)) {
+		// try puts wait for the journal as well, it does not depend on
+		// subscribers
+		if (!TQueueFull(queue)) {
+			timeout = TQueueJournalWait(queue, deadline == TQUEUE_NOWAIT ?
+										NULL : deadline);
+			if (queue->destroyed)
+				return -1;
+			if (timeout && !TQueueJournalRoom(queue))
+				return timeout;
+			continue;
+		}
+		dbgprintf("FAIL PUT\n");
+		if (deadline == TQUEUE_NOWAIT) {
+			TQueueSpaceArm(queue);
+			return -4;
+		}
+		timeout = TQueueWait(queue, &queue->put_cond, &queue->put_locked,
+							 &queue->head, spin, deadline);
+		spin = 0;
+		dbgprintf("RETRY PUT\n");
+		if (queue->destroyed)
+			return -1;
+		if (timeout && TQueueFull(queue)) {
+			TQueueSpaceArm(queue);
+			return timeout;
+		}
+	}
+	return 0;
+}
+
+// called with the mutex held, waits until the thread has a message,
+// returns -1 if the queue gets destroyed and -4 if the deadline passes
+int TQueueWaitMessage(TQueue * queue, TQueueThread * thread_ptr,
+					  const struct timespec *deadline) {
+	int spin = queue->spin != 0;
+	int timeout;
+
+	pthread_cond_t *cond = &queue->get_cond;
+
+	if (thread_ptr->inbox != NULL)
+		cond = &thread_ptr->inbox->cond;
+
+	while (!TQueueNextMessage(queue, thread_ptr)) {
+		dbgprintf("FAIL GET (%p)\n", thread_ptr->thread);
+		if (deadline == TQUEUE_NOWAIT) {
+			TQueueReadyArm(queue, thread_ptr);
+			return -4;
+		}
+		timeout = TQueueWait(queue, cond, &queue->get_locked, &queue->tail,
+							 spin, deadline);
+		spin = 0;
+		dbgprintf("RETRY GET (%p)\n", thread_ptr->thread);
+		if (queue->destroyed)
+			return -1;
+		if (timeout && !TQueueNextMessage(queue, thread_ptr)) {
+			TQueueReadyArm(queue, thread_ptr);
+			return timeout;
+		}
+	}
+	return 0;
+}
+
+// reads the next message of the thread, which has to be available,
+// into msg or, on typed queues, into the buffer msg points to
+void TQueueReadMessage(TQueue * queue, TQueueThread * thread_ptr,
+					   void **msg) {
+	TQueueInbox *inbox = thread_ptr->inbox;
+	unsigned long long num = thread_ptr->num;
+
+	if (inbox != NULL) {
+		num = *TQueueInboxSeq(inbox, 0);
+		++inbox->first;
+		TQueueStore(inbox->count, inbox->count - 1);
+	} else if (thread_ptr->replay) {
+		TQueueStore(thread_ptr->num, num + 1);
+		++queue->stats.gets;
+		memcpy(msg, TQueueJournalRecord(queue->journal, num),
+			   queue->elem_size);
+		return;
+	} else
+		TQueueStore(thread_ptr->num, num + 1);
+
+	TQueueReadSlot(queue, num, msg);
+}
+
+// reads message num, which the reader is counted on, into msg
+void TQueueReadSlot(TQueue * queue, unsigned long long num, void **msg) {
+	TQueueMessage *message_ptr = TQueueSlot(queue, num);
+
+	++queue->stats.gets;
+	if (queue->ops != NULL)
+		queue->ops->get(msg, TQueuePayload(queue, num),
+						message_ptr->count == 1);
+	else if (queue->elem_size)
+		memcpy(msg, TQueuePayload(queue, num), queue->elem_size);
+	else
+		*msg = message_ptr->message;
+	// with topics a newer message can be read by all before the head
+	if (!--message_ptr->count && num == queue->head)
+		TQueueRemoveRead(queue);
+}
+
+// called with the mutex held, returns 0 on success, -1 if the queue
+// gets destroyed and -4 if the deadline passes
+int TQueueGetMessage(TQueue * queue, TQueueThread * thread_ptr, void **msg,
+					 const struct timespec *deadline) {
+	unsigned long long head;
+	int ret;
+
+	if (thread_ptr->group != NULL) {
+		ret = TQueueGroupRead(queue, thread_ptr->group, msg, 1, 0, 0,
+							  deadline);
+		return ret < 0 ? ret : 0;
+	}
+	ret = TQueueWaitMessage(queue, thread_ptr, deadline);
+	if (ret)
+		return ret;
+
+	dbgprintf("BEFORE GET (%p)\n", thread_ptr->thread);
+	dbgTQueuePrint(queue);
+
+	head = queue->head;
+	TQueueReadMessage(queue, thread_ptr, msg);
+	TQueueWakePublishers(queue, queue->head - head);
+
+	dbgprintf("AFTER GET (%p)\n", thread_ptr->thread);
+	dbgTQueuePrint(queue);
+
+	return 0;
+}
+
+// called with the mutex held, reads all available messages up to max
+// waiting only for the first one, publishers are woken once
+int TQueueGetMessages(TQueue * queue, TQueueThread * thread_ptr,
+					  void **msgs, int max) {
+	unsigned long long head;
+	int n = 0;
+
+	if (max <= 0)
+		return max < 0 ? -2 : 0;
+	if (thread_ptr->group != NULL)
+		return TQueueGroupRead(queue, thread_ptr->group, msgs, max, 0, 0,
+							   NULL);
+	if (TQueueWaitMessage(queue, thread_ptr, NULL))
+		return -1;
+
+	head = queue->head;
+	while (n < max && TQueueNextMessage(queue, thread_ptr))
+		TQueueReadMessage(queue, thread_ptr, TQueueOut(queue, msgs, n++));
+	if (n < max)
+		TQueueReadyArm(queue, thread_ptr);
+	TQueueWakePublishers(queue, queue->head - head);
+
+	dbgprintf("AFTER GET BATCH (%p) %d\n", thread_ptr->thread, n);
+	dbgTQueuePrint(queue);
+
+	return n;
+}
+
+void TQueueAppend(TQueue * queue, void *msg) {
+	TQueueMessage *tail;
+	TQueueMessage *new_message;
+
+	// TQueueWaitSpace has made room for it in the ring
+	tail = TQueueSlot(queue, queue->tail);
+	new_message = TQueueSlot(queue, queue->tail + 1);
+
+	new_message->message = NULL;
+	new_message->unsubscribed = 0;
+	new_message->count = 0;
+	new_message->num = queue->tail + 1;
+	new_message->removed = 0;
+
+	// subscribers that left at the tail have no pending messages, so they
+	// are dropped here instead of being buried under a topic message
+	queue->subscribers -= tail->unsubscribed;
+	tail->count += tail->unsubscribed;
+	tail->unsubscribed = 0;
+
+	++queue->stats.puts;
+	++queue->stats.depth[queue->size ? 64 - __builtin_clzll(queue->size) : 0];
+	TQueueStore(queue->size, queue->size + 1);
+	if (queue->ops != NULL)
+		queue->ops->put(TQueuePayload(queue, queue->tail), msg);
+	else if (queue->elem_size)
+		memcpy(TQueuePayload(queue, queue->tail), msg, queue->elem_size);
+	else
+		tail->message = msg;
+	if (queue->journal != NULL)
+		TQueueJournalWrite(queue, queue->tail);
+	tail->count = tail->count + queue->subscribers;
+	TQueueStore(queue->tail, queue->tail + 1);
+}
+
+// wakes n of waiting threads on cond, all of them if n is not lower
+void TQueueSignal(pthread_cond_t * cond, unsigned long long n,
+				  unsigned waiting) {
+	if (n >= waiting) {
+		pthread_cond_broadcast(cond);
+		return;
+	}
+	while (n--)
+		pthread_cond_signal(cond);
+}
+
+// called with the mutex held after n messages have been put, subscribers
+// only wait at the tail so a new message lets every one of them continue,
+// while each message lets one member of a group continue
+void TQueueWakeSubscribers(TQueue * queue, unsigned long long n) {
+	if (queue->get_locked)
+		pthread_cond_broadcast(&queue->get_cond);
+	if (queue->groups != NULL)
+		TQueueWakeGroups(queue, n);
+	if (queue->armed)
+		TQueueReadyNotify(queue);
+	if (queue->get_waiters != NULL)
+		TQueueWakeGetters(queue);
+}
+
+// called with the mutex held when slots have been freed, each put needs
+// one of them so at most freed publishers are woken
+void TQueueWakePublishers(TQueue * queue, unsigned long long freed) {
+	if (freed && queue->put_locked)
+		TQueueSignal(&queue->put_cond, freed, queue->put_locked);
+	if (freed && queue->space_armed) {
+		queue->space_armed = 0;
+		TQueueSignalFd(queue->space_fd);
+	}
+	if (freed && queue->put_waiters != NULL)
+		TQueueWakePutters(queue, freed);
 }
 
 #define ITER_LIMIT 1024
@@ -577,33 +5587,30 @@ void TQueuePrint(TQueue * queue) {
 
 	TQueueThread *thread_ptr;
 	TQueueMessage *message_ptr;
+	unsigned long long num;
 
 	printf("\nvvvvvvvv\n");
 	printf("max size: %d\n", queue->max_size);
 	printf("size: %d\n", queue->size);
 	printf("subscribers: %d\n", queue->subscribers);
-	printf("head: %p\n", queue->head);
-	printf("tail: %p\n", queue->tail);
+	printf("ring: %p (%u slots)\n", queue->ring, queue->ring_mask + 1);
+	printf("head: %llu\n", queue->head);
+	printf("tail: %llu\n", queue->tail);
 	printf("destroyed: %d\n", queue->destroyed);
 	printf("get locked: %d\n", queue->get_locked);
 	printf("put locked: %d\n", queue->put_locked);
-	printf("hashmap:\n");
-	for (int i = 0; i < queue->hashmap_size; ++i) {
-		printf("[%d]", i);
-		thread_ptr = queue->hashmap[i];
-		while (thread_ptr != NULL) {
-			printf("->{%p|%p}", thread_ptr->thread, thread_ptr->message_ptr);
-			thread_ptr = thread_ptr->next;
-		}
-		printf("\n");
-	}
+	printf("hashmap: %u of %u slots used, %u old slots left\n",
+		   queue->hashmap_used, queue->hashmap_size,
+		   queue->old_hashmap_size - queue->rehashed);
+	for (unsigned i = 0; (thread_ptr = TQueueNextThread(queue, &i)) != NULL;)
+		printf("{%p|%llu}\n", thread_ptr->thread, thread_ptr->num);
 	printf("messages:\n");
-	message_ptr = queue->head;
-	for (int i = 0; i < ITER_LIMIT && message_ptr != NULL; ++i) {
-		printf("ptr: %p\tmes: %p\tcnt: %d\tusb: %d\n", message_ptr,
-			   message_ptr->message, message_ptr->count,
-			   message_ptr->unsubscribed);
-		message_ptr = message_ptr->next;
+	num = queue->head;
+	for (int i = 0; i < ITER_LIMIT && num <= queue->tail; ++i, ++num) {
+		message_ptr = TQueueSlot(queue, num);
+		printf("num: %llu\tmes: %p\tcnt: %d\tusb: %d\trmv: %d\n",
+			   message_ptr->num, message_ptr->message, message_ptr->count,
+			   message_ptr->unsubscribed, message_ptr->removed);
 	}
 	printf("^^^^^^^^\n\n");
 
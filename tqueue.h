@@ -1,44 +1,331 @@
+#ifndef TQUEUE_H
+#define TQUEUE_H
+
 #include <pthread.h>
+#include <time.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
 
 typedef struct TQueueMessage TQueueMessage;
 typedef struct TQueueThread TQueueThread;
 typedef struct TQueue TQueue;
+typedef struct TQueueLockFree TQueueLockFree;
+typedef struct TQueueSubscription TQueueSubscription;
+typedef struct TQueuePool TQueuePool;
+typedef struct TQueueInbox TQueueInbox;
+typedef struct TQueueGroup TQueueGroup;
+typedef struct TQueueSharded TQueueSharded;
+typedef struct TQueueShared TQueueShared;
+typedef struct TQueueSharedRegion TQueueSharedRegion;
+typedef struct TQueueStats TQueueStats;
+typedef struct TQueueJournal TQueueJournal;
+typedef struct TQueueReady TQueueReady;
+typedef struct TQueueWaiter TQueueWaiter;
+typedef struct TQueueValueOps TQueueValueOps;
+typedef struct TQueueRetired TQueueRetired;
+
+// queue engines, chosen when the queue is created
+#define TQUEUE_ENGINE_LOCKED 0
+#define TQUEUE_ENGINE_LOCKFREE 1
+
+// slow subscriber policies, chosen when the queue is created:
+// publishers wait for room on a full queue, publishers evict the oldest
+// messages instead, or the oldest messages are evicted so that no
+// subscriber falls more than max_lag messages behind, subscribers
+// learn how many messages they missed from TQueueGetSkipped
+#define TQUEUE_POLICY_BLOCK 0
+#define TQUEUE_POLICY_OVERWRITE 1
+#define TQUEUE_POLICY_MAX_LAG 2
+
+// topics are numbered from 0 to TQUEUE_TOPICS - 1, a set of topics
+// is a mask of TQUEUE_TOPIC bits
+#define TQUEUE_TOPICS 64
+#define TQUEUE_TOPIC(topic) (1ULL << (topic))
+
+// orders in which subscribers of a sharded queue look at its shards:
+// starting from a rotating shard so that none is favoured, or, on a
+// priority queue whose shards are lanes, lane 0 (the highest priority)
+// first, or each lane first as many times out of the sum of the weights
+// as its weight, the other lanes following by priority
+#define TQUEUE_ORDER_ROTATE 0
+#define TQUEUE_PRIORITY_STRICT 1
+#define TQUEUE_PRIORITY_WEIGHTED 2
+#define TQUEUE_PRIORITIES 8
+#define TQUEUE_PRIORITY_WEIGHT_MAX 256
+
+// puts are counted in depth by the size of the queue they found, bucket 0
+// counts an empty queue, bucket i sizes from 2^(i-1) to 2^i - 1
+#define TQUEUE_STATS_DEPTHS 33
+
+// counters are kept since the queue was created, times are in nanoseconds,
+// size, subscribers and the lags are taken when the stats are read
+struct TQueueStats {
+	unsigned long long puts;
+	unsigned long long gets;
+	// messages put while nobody was subscribed
+	unsigned long long drops;
+	// messages removed by TQueueRemoveMsg and by TQueueSetSize
+	unsigned long long removals;
+	unsigned long long evictions;
+	// number of times and total time threads were blocked
+	unsigned long long put_waits;
+	unsigned long long put_wait_ns;
+	unsigned long long get_waits;
+	unsigned long long get_wait_ns;
+	// acquisitions of the mutex which found it taken and time spent
+	// waiting for it, time it was held only with TQueueSetStatsTiming
+	unsigned long long lock_contended;
+	unsigned long long lock_wait_ns;
+	unsigned long long lock_hold_ns;
+	unsigned long long depth[TQUEUE_STATS_DEPTHS];
+	unsigned size;
+	unsigned subscribers;
+	// unread messages of the furthest behind subscriber and of all of
+	// them, the stats only keep these aggregates, the lag of one
+	// subscriber is what TQueueGetAvailable returns for it
+	unsigned long long max_lag;
+	unsigned long long total_lag;
+};
+
+// continuation of an asynchronous get or put which could not be done
+// right away, wake is called once with the mutex released when the
+// operation may succeed if tried again or the queue has been destroyed,
+// it may use the queue, the other fields are set by the queue
+struct TQueueWaiter {
+	void (*wake)(TQueueWaiter * waiter);
+	TQueueWaiter *next;
+	TQueueThread *thread;
+};
+
+// operations on values of a typed queue which cannot be copied byte by
+// byte (e.g. C++ objects), called with the mutex held on slots of
+// elem_size bytes, they must not use the queue
+struct TQueueValueOps {
+	// constructs the value in the empty slot from msg passed to a put
+	void (*put)(void *slot, void *msg);
+	// stores the value in the buffer msg passed to a get, last is not 0
+	// if no other subscriber is going to read it, so it can be moved
+	void (*get)(void *msg, void *slot, int last);
+	// moves the value to the empty slot to, from is left empty
+	void (*move)(void *to, void *from);
+	// destroys the value once it has left the queue
+	void (*destroy)(void *slot);
+	// whether the value equals the one msg passed to TQueueRemoveMsg
+	// points to, NULL if the values cannot be compared
+	int (*match)(void *slot, void *msg);
+};
+
+// reasons for which a message leaves the queue, passed to the release
+// callback: it has been read by every subscriber (or those which had not
+// read it have unsubscribed), removed with TQueueRemoveMsg or
+// TQueueRemoveTicket, evicted by TQueueSetSize or a slow subscriber
+// policy, dropped by a put as nobody was subscribed, or it was still in
+// the queue when the queue was destroyed
+#define TQUEUE_RELEASE_CONSUMED 0
+#define TQUEUE_RELEASE_REMOVED 1
+#define TQUEUE_RELEASE_EVICTED 2
+#define TQUEUE_RELEASE_DROPPED 3
+#define TQUEUE_RELEASE_DESTROYED 4
+
+// called with the mutex held once for every message leaving the queue,
+// msg is the message (on typed queues its slot, or the value passed to
+// the put if it has been dropped), arg is the one passed with it to
+// TQueueSetRelease, it must not use the queue
+typedef void (*TQueueReleaseCallback)(void *msg, int reason, void *arg);
+
+// ticket of a message which has not been put on the queue
+#define TQUEUE_NO_TICKET (~0ULL)
 
 struct TQueueMessage {
 	void *message;
 	int count;
 	int unsubscribed;
-	int num;
-	TQueueMessage *next;
+	unsigned long long num;
+	unsigned char removed;
+};
+
+// link of memory retired while peeks may still read it, kept in the
+// retired node, inbox, group or in front of the slots of a hashmap, so
+// that retiring does not allocate
+struct TQueueRetired {
+	TQueueRetired *next;
+	void *ptr;
+	unsigned char kind;
 };
 
 struct TQueueThread {
-	TQueueMessage *message_ptr;
+	unsigned long long num;
+	unsigned long long skipped;
+	// position of the subscriber in the schedule of a weighted priority
+	// queue, kept on its node of lane 0
+	unsigned turn;
+	// the thread reads num from the journal until it catches up with tail
+	unsigned char replay;
 	pthread_t *thread;
-	TQueueThread *next;
+	pthread_t id;
+	TQueueInbox *inbox;
+	TQueueReady *ready;
+	// members of a consumer group read with the cursor of the group
+	TQueueGroup *group;
+	TQueueRetired retired;
+};
+
+// free list of equally sized nodes allocated in chunks
+struct TQueuePool {
+	void *free;
+	void *chunks;
+	unsigned node_size;
+	unsigned used;
+	unsigned capacity;
 };
 
 struct TQueue {
 	unsigned size;
 	unsigned max_size;
 	int subscribers;
+	// subscriptions of any kind (members of groups and topic subscribers
+	// too), read by peeks
+	unsigned subscriptions;
+	// open addressing hashmap of subscribers, while it grows the subscribers
+	// are moved over from old_hashmap a few slots at a time; the hashmaps
+	// are replaced while hashmap_version is odd, so that peeks can look
+	// subscribers up without the mutex
+	unsigned hashmap_version;
 	unsigned hashmap_size;
+	unsigned hashmap_used;
 	TQueueThread **hashmap;
-	TQueueMessage *head;
-	TQueueMessage *tail;
+	unsigned old_hashmap_size;
+	unsigned rehashed;
+	TQueueThread **old_hashmap;
+	TQueuePool nodes;
+	TQueueInbox *inboxes;
+	TQueueGroup *groups;
+	TQueueMessage *ring;
+	unsigned ring_mask;
+	unsigned long long head;
+	unsigned long long tail;
+	unsigned tombstones;
+	// messages before this one have been evicted by TQueueSetSize
+	unsigned long long evicted;
 	pthread_cond_t get_cond;
 	pthread_cond_t put_cond;
+	pthread_cond_t destroy_cond;
 	pthread_mutex_t lock;
 	unsigned char destroyed;
 	unsigned put_locked;
 	unsigned get_locked;
+	unsigned spin;
+	// iterations the next spin may take, adapted to the last spins
+	unsigned spin_limit;
+	unsigned char policy;
+	unsigned max_lag;
+	unsigned char engine;
+	TQueueLockFree *lockfree;
+	unsigned elem_size;
+	char *payload;
+	const TQueueValueOps *ops;
+	TQueueReleaseCallback release;
+	void *release_arg;
+	TQueueJournal *journal;
+	// eventfds of subscribers, armed ones are written to by the next put
+	// which gives them a message, the space eventfd by the next read or
+	// removal which frees a slot once armed
+	TQueueReady *readies;
+	unsigned armed;
+	int space_fd;
+	unsigned char space_armed;
+	// continuations of asynchronous gets and puts waiting for a message
+	// or a slot, those woken are called once the mutex is released
+	TQueueWaiter *get_waiters;
+	TQueueWaiter *put_waiters;
+	TQueueWaiter **put_waiters_last;
+	TQueueWaiter *woken;
+	TQueueStats stats;
+	unsigned char stats_timing;
+	unsigned long long locked_at;
+	// peeks in progress, nodes, inboxes, groups and hashmaps they may
+	// reach are kept on retired until it has been seen at zero, by the
+	// next retirement or by the last peek to leave
+	unsigned peekers;
+	TQueueRetired *retired;
+};
+
+// a set of locked queues (shards) with their own locks and condition
+// variables, each message goes to the shard picked by its key, subscribers
+// read from all shards, messages from a single shard keep their order;
+// the lanes of a priority queue are its shards, schedule lists the lane
+// tried first on each turn of a weighted one
+struct TQueueSharded {
+	TQueue **shards;
+	unsigned count;
+	unsigned char order;
+	unsigned char *schedule;
+	unsigned schedule_size;
+	unsigned waiting;
+	unsigned parked;
+	unsigned long long version;
+	pthread_cond_t cond;
+	pthread_mutex_t lock;
+	unsigned char destroyed;
+	// operations in progress, counted in 16 stripes a cache line apart,
+	// kept with the handle so that late operations find it destroyed
+	unsigned active[16 * 16];
+	// bumped by operations leaving a destroyed queue, its destruction
+	// sleeps on it
+	unsigned left;
+};
+
+// a queue of values in a named shared memory object which processes
+// attach to, the region holds no pointers, only this handle is local to
+// the process
+struct TQueueShared {
+	TQueueSharedRegion *region;
+	size_t length;
 };
 
 // queue creation and destruction functions
 // non-void destroy functions return 0 on success
 // and -1 if the queue has already been destroyed
+// sizes below 1 are taken as 1, when the ring for size messages cannot
+// be allocated a smaller one is, it is grown by the puts which need it,
+// while a lock-free queue holds only as many messages as fit in it
 void TQueueCreateQueue(TQueue * queue, int *size);
 void TQueueCreateQueueHash(TQueue * queue, int *size, int *hashmap_size);
+// engine is one of TQUEUE_ENGINE_* values, with the lock-free engine
+// a subscription must not be removed while its thread is reading
+void TQueueCreateQueueEngine(TQueue * queue, int *size, int *hashmap_size,
+							 int engine);
+// creates a locked queue carrying elem_size byte values copied into its
+// own storage, put functions copy elem_size bytes from msg, get functions
+// copy them to the buffer msg (or msgs for batches) instead of returning
+// pointers, TQueueGet and TQueueGetHandle are replaced by TQueueGetValue
+// and TQueueGetValueHandle, TQueueRemoveMsg compares the values
+// returns:
+// 0 on success
+// -2 if elem_size is not positive or the slots cannot be allocated, the
+// queue is not created then
+int TQueueCreateQueueTyped(TQueue * queue, int *size, int *elem_size);
+// creates a typed queue whose values are constructed, read, moved and
+// destroyed with ops instead of being copied, values still in the queue
+// are destroyed with it, it cannot have a journal
+// returns:
+// 0 on success
+// -2 if size or elem_size is not positive, ops is NULL or the slots
+// cannot be allocated, the queue is not created then
+int TQueueCreateQueueValues(TQueue * queue, int *size, int *elem_size,
+							const TQueueValueOps * ops);
+// creates a locked queue with one of TQUEUE_POLICY_* values, max_lag is
+// only read for TQUEUE_POLICY_MAX_LAG, other policies may pass NULL, and
+// has effect if it is lower than size, otherwise the queue blocks as
+// TQUEUE_POLICY_BLOCK
+// returns:
+// 0 on success
+// -2 if the policy is unknown or max_lag is NULL for
+// TQUEUE_POLICY_MAX_LAG, the queue is not created then
+int TQueueCreateQueuePolicy(TQueue * queue, int *size, int policy,
+							int *max_lag);
 int TQueueDestroyQueue(TQueue * queue);
 int TQueueDestroyQueue_1(TQueue * tqueue);
 void TQueueDestroyQueue_2(TQueue * tqueue);
@@ -49,20 +336,132 @@ void TQueueDestroyQueue_2(TQueue * tqueue);
 // -2 if the thread is already subscribed
 int TQueueSubscribe(TQueue * queue, pthread_t * thread);
 
+// subscribes without a thread identifier, the returned handle is passed
+// to the *Handle functions below instead of the thread and does not need
+// to be looked up, a thread can hold any number of handles
+// returns NULL if the queue has already been destroyed
+TQueueSubscription *TQueueSubscribeHandle(TQueue * queue);
+
+// subscribes only to messages put with TQueuePutTopic on one of topics,
+// the subscriber does not receive messages put without a topic, an empty
+// set subscribes to all messages as TQueueSubscribe
+// returns:
+// 0 on success
+// -1 if the queue has already been destroyed
+// -2 if the thread is already subscribed
+// -3 if the queue uses the lock-free engine
+int TQueueSubscribeTopics(TQueue * queue, pthread_t * thread,
+						  unsigned long long topics);
+// returns NULL if the queue has already been destroyed or uses
+// the lock-free engine
+TQueueSubscription *TQueueSubscribeTopicsHandle(TQueue * queue,
+												unsigned long long topics);
+
+// joins the consumer group named group, which is created by its first
+// member and removed with its last one: the group is counted as a single
+// subscriber on messages and each message is read by only one of its
+// members, which use the functions below as any subscriber does and
+// leave the group with the unsubscribe functions
+// returns:
+// 0 on success
+// -1 if the queue has already been destroyed
+// -2 if the thread is already subscribed
+// -3 if the queue uses the lock-free engine
+int TQueueSubscribeGroup(TQueue * queue, pthread_t * thread,
+						 const char *group);
+// returns NULL if the queue has already been destroyed or uses
+// the lock-free engine
+TQueueSubscription *TQueueSubscribeGroupHandle(TQueue * queue,
+											   const char *group);
+
 // returns:
 // 0 on success
 // -1 if the queue has already been destroyed
 // -2 if the thread is not subscribed
 int TQueueUnsubscribe(TQueue * queue, pthread_t * thread);
 
+// returns 0 on success and -1 if the queue has already been destroyed
+int TQueueUnsubscribeHandle(TQueue * queue, TQueueSubscription * subscription);
+
 // if the queue is full at the moment, the function is blocking
 // returns 0 on success and -1 if the queue has already been destroyed
 int TQueuePut(TQueue * queue, void *msg);
 
+// puts as many of n messages as fit in the queue under a single lock,
+// if the queue is full at the moment, the function is blocking
+// returns the number of messages put, which may be lower than n,
+// -1 if the queue has already been destroyed and -2 if n is negative
+int TQueuePutBatch(TQueue * queue, void **msgs, int n);
+
+// non-blocking and deadline variants of put, the deadline is absolute
+// and measured against CLOCK_REALTIME as in pthread_cond_timedwait
+// returns:
+// 0 on success
+// -1 if the queue has already been destroyed
+// -4 if the queue is full (try) or stayed full until the deadline (timed)
+int TQueueTryPut(TQueue * queue, void *msg);
+int TQueueTimedPut(TQueue * queue, void *msg,
+				   const struct timespec *deadline);
+
+// works as TQueuePut and stores the ticket of the message, which can be
+// passed to TQueueRemoveTicket, in ticket, TQUEUE_NO_TICKET if the message
+// has been dropped as nobody is subscribed
+// returns:
+// 0 on success
+// -1 if the queue has already been destroyed
+// -3 if the queue uses the lock-free engine
+int TQueuePutTicket(TQueue * queue, void *msg, unsigned long long *ticket);
+
+// puts the message on topic, it is delivered to subscribers of the topic
+// and to those subscribed to all messages, if the queue is full at the
+// moment, the function is blocking
+// returns:
+// 0 on success
+// -1 if the queue has already been destroyed
+// -2 if topic is not lower than TQUEUE_TOPICS or negative
+// -3 if the queue uses the lock-free engine
+int TQueuePutTopic(TQueue * queue, int topic, void *msg);
+
 // get function will return NULL if a thread is not subscribed,
 // if no message is available at the moment, the function is blocking
 // returns 0 on success and -1 if the queue has already been destroyed
 void *TQueueGet(TQueue * queue, pthread_t * thread);
+void *TQueueGetHandle(TQueue * queue, TQueueSubscription * subscription);
+
+// typed queues only, copies the value to value
+// returns:
+// 0 on success
+// -1 if the queue has already been destroyed
+// -2 if the thread is not subscribed
+int TQueueGetValue(TQueue * queue, pthread_t * thread, void *value);
+int TQueueGetValueHandle(TQueue * queue, TQueueSubscription * subscription,
+						 void *value);
+
+// non-blocking and deadline variants of get, the message is stored in msg,
+// the deadline is absolute as for TQueueTimedPut
+// returns:
+// 0 on success
+// -1 if the queue has already been destroyed
+// -2 if the thread is not subscribed
+// -4 if no message is available (try) or none arrived until the deadline
+// (timed)
+int TQueueTryGet(TQueue * queue, pthread_t * thread, void **msg);
+int TQueueTryGetHandle(TQueue * queue, TQueueSubscription * subscription,
+					   void **msg);
+int TQueueTimedGet(TQueue * queue, pthread_t * thread, void **msg,
+				   const struct timespec *deadline);
+int TQueueTimedGetHandle(TQueue * queue, TQueueSubscription * subscription,
+						 void **msg, const struct timespec *deadline);
+
+// reads up to max available messages into msgs under a single lock,
+// if no message is available at the moment, the function is blocking
+// returns:
+// number of messages read on success
+// -1 if the queue has already been destroyed
+// -2 if the thread is not subscribed or max is negative
+int TQueueGetBatch(TQueue * queue, pthread_t * thread, void **msgs, int max);
+int TQueueGetBatchHandle(TQueue * queue, TQueueSubscription * subscription,
+						 void **msgs, int max);
 
 // returns:
 // number of messages available on success
@@ -70,20 +469,296 @@ void *TQueueGet(TQueue * queue, pthread_t * thread);
 // -2 if the thread is not subscribed
 int TQueueGetAvailable(TQueue * queue, pthread_t * thread);
 
+// returns:
+// number of messages available on success
+// -1 if the queue has already been destroyed
+int TQueueGetAvailableHandle(TQueue * queue, TQueueSubscription * subscription);
+
+// the same count read without taking the mutex, so that monitoring does
+// not contend with puts and gets; it may be stale by the time it is
+// returned, and it includes removed messages the subscriber has not
+// reached yet and, until it reads again, messages evicted before it
+// read them
+// returns:
+// number of messages available on success
+// -1 if the queue has already been destroyed
+// -2 if the thread is not subscribed
+int TQueuePeekAvailable(TQueue * queue, pthread_t * thread);
+
+// returns:
+// number of messages available on success
+// -1 if the queue has already been destroyed
+int TQueuePeekAvailableHandle(TQueue * queue,
+							  TQueueSubscription * subscription);
+
+// current size, maximum size and number of subscribers (counted as in
+// TQueueStats) read without taking the mutex
+// returns:
+// the value on success
+// -1 if the queue has already been destroyed
+int TQueuePeekSize(TQueue * queue);
+int TQueuePeekMaxSize(TQueue * queue);
+int TQueuePeekSubscribers(TQueue * queue);
+
+// number of messages evicted by TQueueSetSize or by the policy of the
+// queue before the subscriber read them, since the last call, removed
+// messages among them are counted too
+// returns:
+// number of skipped messages on success
+// -1 if the queue has already been destroyed
+// -2 if the thread is not subscribed
+// -3 if the queue uses the lock-free engine
+int TQueueGetSkipped(TQueue * queue, pthread_t * thread);
+int TQueueGetSkippedHandle(TQueue * queue, TQueueSubscription * subscription);
+
 // returns:
 // 0 on success (an element has been removed)
 // -2 if no element with given message is on the queue
 // -1 if the queue has already been destroyed
+// -3 if the queue uses the lock-free engine
 // if the same message is duplicated on the queue,
 // this function will remove the oldest instance
 int TQueueRemoveMsg(TQueue * queue, void *msg);
 
+// removes the message put with given ticket in constant time
+// returns:
+// 0 on success
+// -1 if the queue has already been destroyed
+// -2 if the message is no longer on the queue
+// -3 if the queue uses the lock-free engine
+int TQueueRemoveTicket(TQueue * queue, unsigned long long ticket);
+
+// sizes below 1 are taken as 1
 // returns:
 // 0 on success
 // -1 if the queue has already been destroyed
+// -3 if the queue uses the lock-free engine
 int TQueueSetSize(TQueue * queue, int *size);
 
 // returns:
 // 0 on success
 // -1 if the queue has already been destroyed
 int TQueueSetHashmapSize(TQueue * queue, int *hashmap_size);
+
+// sets how many iterations blocking functions spin at most before
+// parking on a condition variable, 0 (the default) parks right away;
+// spins are also bounded in time, shortened when they do not see the
+// queue change and skipped on a single CPU
+// returns:
+// 0 on success
+// -1 if the queue has already been destroyed
+int TQueueSetSpin(TQueue * queue, int *spin);
+
+// subscriber nodes are taken from a pool owned by the queue, sized for
+// hashmap_size subscribers and doubled when it runs out
+// returns:
+// 0 on success, with the number of nodes in use and allocated
+// stored in used and capacity
+// -1 if the queue has already been destroyed
+int TQueueGetPoolUsage(TQueue * queue, int *used, int *capacity);
+
+// copies the statistics of the queue to stats, the lock-free engine
+// does not fill depth, removals and evictions and counts lock and
+// wait times only on its slow paths
+// returns:
+// 0 on success
+// -1 if the queue has already been destroyed
+int TQueueGetStats(TQueue * queue, TQueueStats * stats);
+
+// measuring how long the mutex is held needs the time on every lock
+// and unlock, so it is off unless timing is set to a non-zero value
+// returns:
+// 0 on success
+// -1 if the queue has already been destroyed
+int TQueueSetStatsTiming(TQueue * queue, int *timing);
+
+// sets the callback called once for every message leaving the queue from
+// now on with the reason it leaves for (one of TQUEUE_RELEASE_* values),
+// so that a message read by many subscribers can be recycled by the
+// publisher without reference counting, NULL removes it
+// returns:
+// 0 on success
+// -1 if the queue has already been destroyed
+// -3 if the queue uses the lock-free engine
+int TQueueSetRelease(TQueue * queue, TQueueReleaseCallback release,
+					 void *arg);
+
+// keeps every value put on a typed queue in a journal of memory mapped
+// files named path.N, each holding segment_size values, only the newest
+// segments files are kept and older ones are deleted, values are written
+// back to the files
+// with msync every sync values if sync is not 0, otherwise when the system
+// decides to, the journal is closed when the queue is destroyed; if path
+// already holds a journal, sequence numbers of an empty queue continue
+// after it, values put while nobody is subscribed are journaled too
+// returns:
+// 0 on success
+// -1 if the queue has already been destroyed
+// -2 if the queue is not typed, not empty with a journal which does not
+// end at its tail, already has a journal or the files cannot be opened
+// -3 if the queue uses the lock-free engine
+int TQueueOpenJournal(TQueue * queue, const char *path, int *segment_size,
+					  int *segments, int *sync);
+
+// subscribes starting with the message with sequence number (ticket) seq,
+// messages already read by all are read from the journal until the thread
+// catches up with the queue, messages no longer in the journal are
+// counted as skipped, removed messages are not skipped while replaying
+// returns:
+// 0 on success
+// -1 if the queue has already been destroyed
+// -2 if the thread is already subscribed
+// -3 if the queue uses the lock-free engine or has no journal
+int TQueueSubscribeFrom(TQueue * queue, pthread_t * thread,
+						unsigned long long seq);
+
+// stores in fd an eventfd which becomes readable when the thread has
+// messages to read, it is written to once after the thread has found no
+// message (a non-blocking get returning -4 or a batch reading all
+// messages), so a burst of puts wakes it once; read the eventfd and then
+// get messages until none is left, the eventfd is created on the first
+// call and closed when the thread unsubscribes or the queue is destroyed
+// in the second step, destroying the queue makes it readable
+// returns:
+// 0 on success
+// -1 if the queue has already been destroyed
+// -2 if the thread is not subscribed or the eventfd cannot be created
+// -3 if the queue uses the lock-free engine
+int TQueueGetReadyFd(TQueue * queue, pthread_t * thread, int *fd);
+int TQueueGetReadyFdHandle(TQueue * queue, TQueueSubscription * subscription,
+						   int *fd);
+
+// stores in fd an eventfd which becomes readable when a slot frees up
+// after a put found the queue full (a non-blocking or timed put returning
+// -4 or a batch which did not fit), it is closed when the queue is
+// destroyed in the second step, destroying the queue makes it readable
+// returns:
+// 0 on success
+// -1 if the queue has already been destroyed
+// -2 if the eventfd cannot be created
+// -3 if the queue uses the lock-free engine
+int TQueueGetSpaceFd(TQueue * queue, int *fd);
+
+// asynchronous get and put working as TQueueTryGetHandle and TQueueTryPut
+// but, instead of returning -4 right away, they register waiter whose
+// wake function is called by the thread which puts a message for the
+// subscriber or frees a slot, or destroys the queue, so that the caller
+// tries again without a thread blocking on the queue; the subscription
+// must not be removed while a waiter is registered for it
+// returns:
+// 0 on success
+// -1 if the queue has already been destroyed
+// -3 if the queue uses the lock-free engine
+// -4 if the waiter has been registered
+int TQueueGetAsync(TQueue * queue, TQueueSubscription * subscription,
+				   void **msg, TQueueWaiter * waiter);
+int TQueuePutAsync(TQueue * queue, void *msg, TQueueWaiter * waiter);
+
+// sharded queue functions, every shard is a locked queue of given size,
+// a message is put on shard key % shards so messages with equal keys are
+// read in the order they were put, the destroy function returns 0
+// on success and -1 if the queue has already been destroyed
+void TQueueCreateSharded(TQueueSharded * queue, int *shards, int *size);
+int TQueueDestroySharded(TQueueSharded * queue);
+
+// subscribes to or unsubscribes from all shards
+// returns:
+// 0 on success
+// -1 if the queue has already been destroyed
+// -2 if the thread is already subscribed (subscribe)
+// or is not subscribed (unsubscribe)
+int TQueueShardedSubscribe(TQueueSharded * queue, pthread_t * thread);
+int TQueueShardedUnsubscribe(TQueueSharded * queue, pthread_t * thread);
+
+// if the shard is full at the moment, the function is blocking
+// returns 0 on success and -1 if the queue has already been destroyed
+int TQueueShardedPut(TQueueSharded * queue, unsigned long long key,
+					 void *msg);
+
+// reads a message from any shard, if no message is available at the moment,
+// the function is blocking, returns NULL if the thread is not subscribed
+// or the queue has been destroyed
+void *TQueueShardedGet(TQueueSharded * queue, pthread_t * thread);
+
+// returns:
+// 0 on success
+// -1 if the queue has already been destroyed
+// -2 if the thread is not subscribed
+// -4 if no message is available
+int TQueueShardedTryGet(TQueueSharded * queue, pthread_t * thread,
+						void **msg);
+
+// priority queue functions, a priority queue is a sharded queue whose
+// shards are lanes numbered by priority, lane i being a locked queue of
+// sizes[i] messages so that each lane has its own room, messages are
+// read from the lanes in the given order (TQUEUE_PRIORITY_*, weights
+// are only read for weighted queues) with the sharded functions above
+// returns 0 on success and -2 if lanes is not between 1 and
+// TQUEUE_PRIORITIES, the order is unknown or a weight is not between 1
+// and TQUEUE_PRIORITY_WEIGHT_MAX
+int TQueueCreatePriority(TQueueSharded * queue, int *lanes, int *sizes,
+						 int order, int *weights);
+
+// puts the message on lane level, if the lane is full at the moment the
+// function is blocking
+// returns:
+// 0 on success
+// -1 if the queue has already been destroyed
+// -2 if there is no lane level
+int TQueuePutPriority(TQueueSharded * queue, void *msg, int level);
+
+// shared memory queue functions, the queue named name (as for shm_open)
+// holds at most size values of elem_size bytes and at most subscribers
+// subscribers, which are identified by non-zero ids chosen by the
+// processes; a subscriber whose process has died is removed once it
+// keeps a publisher waiting, create, attach and destroy return:
+// 0 on success
+// -1 if the queue has already been destroyed (destroy)
+// -2 if the name is taken (create), does not name a queue (attach)
+// or the shared memory object cannot be created or mapped
+int TQueueCreateShared(TQueueShared * queue, const char *name, int *size,
+					   int *elem_size, int *subscribers);
+int TQueueAttachShared(TQueueShared * queue, const char *name);
+// wakes blocked publishers and subscribers of all processes, which
+// return -1, and removes the name, the queue stays mapped until detached
+int TQueueDestroyShared(TQueueShared * queue);
+// unmaps the queue, no thread of the process may be using it any more,
+// the memory is freed once the last process detaches from a destroyed
+// queue
+void TQueueDetachShared(TQueueShared * queue);
+
+// returns:
+// 0 on success
+// -1 if the queue has already been destroyed
+// -2 if the id is 0, already subscribed or there is no room for another
+// subscriber (subscribe) or the id is not subscribed (unsubscribe)
+int TQueueSharedSubscribe(TQueueShared * queue, unsigned long long id);
+int TQueueSharedUnsubscribe(TQueueShared * queue, unsigned long long id);
+
+// copies elem_size bytes from value to the queue, if the queue is full
+// at the moment the function is blocking (try variant returns -4)
+// returns 0 on success and -1 if the queue has already been destroyed
+int TQueueSharedPut(TQueueShared * queue, void *value);
+int TQueueSharedTryPut(TQueueShared * queue, void *value);
+
+// copies the next value of the subscriber to the buffer value, if no
+// value is available at the moment the function is blocking (try variant
+// returns -4)
+// returns:
+// 0 on success
+// -1 if the queue has already been destroyed
+// -2 if the id is not subscribed
+int TQueueSharedGet(TQueueShared * queue, unsigned long long id,
+					void *value);
+int TQueueSharedTryGet(TQueueShared * queue, unsigned long long id,
+					   void *value);
+
+// returns the number of values the subscriber has not read, -1 if the
+// queue has already been destroyed and -2 if the id is not subscribed
+int TQueueSharedGetAvailable(TQueueShared * queue, unsigned long long id);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
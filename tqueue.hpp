@@ -0,0 +1,383 @@
+#ifndef TQUEUE_HPP
+#define TQUEUE_HPP
+
+#include <atomic>
+#include <concepts>
+#include <coroutine>
+#include <cstddef>
+#include <new>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+
+#include "tqueue.h"
+
+// C++20 front-end of the locked engine: co_await on get() and put()
+// suspends the coroutine instead of blocking its thread, it is resumed on
+// the thread which puts a message for it, frees a slot or destroys the
+// queue, right after that thread has released the mutex; Queue<T, Capacity>
+// keeps objects of type T in the slots of a typed queue
+
+namespace tqueue {
+
+// result of an awaited get, status is 0 on success, -1 if the queue has
+// been destroyed and -3 if it uses the lock-free engine; msg is the
+// message, or the buffer the value has been copied to on typed queues,
+// and nullptr unless status is 0
+struct Received {
+	int status;
+	void *msg;
+};
+
+// the waiter is the first member of the awaiters so that wake can find
+// them, they are not touched after they have been registered until wake
+// is called, which may happen before await_suspend returns
+class GetAwaiter {
+public:
+	GetAwaiter(TQueue * queue, TQueueSubscription * subscription,
+			   void *value) noexcept
+	: waiter {&GetAwaiter::wake, nullptr, nullptr}, queue(queue),
+		subscription(subscription), value(value), msg(nullptr), status(0) {
+	}
+
+	bool await_ready() const noexcept {
+		return false;
+	}
+
+	bool await_suspend(std::coroutine_handle<> handle) noexcept {
+		int rc;
+
+		this->handle = handle;
+		rc = TQueueGetAsync(queue, subscription, out(), &waiter);
+		if (rc == -4)
+			return true;
+		status = rc;
+		return false;
+	}
+
+	Received await_resume() const noexcept {
+		if (status)
+			return Received {status, nullptr};
+		return Received {status, value != nullptr ? value : msg};
+	}
+
+private:
+	// on typed queues the value is copied to the caller's buffer
+	void **out() noexcept {
+		return value != nullptr ? static_cast<void **>(value) : &msg;
+	}
+
+	// a message may be gone by the time the get is tried again, then the
+	// waiter is registered once more and the coroutine stays suspended
+	static void wake(TQueueWaiter * waiter) noexcept {
+		GetAwaiter *self = reinterpret_cast<GetAwaiter *>(waiter);
+		int rc = TQueueGetAsync(self->queue, self->subscription, self->out(),
+								&self->waiter);
+
+		if (rc == -4)
+			return;
+		self->status = rc;
+		self->handle.resume();
+	}
+
+	TQueueWaiter waiter;
+	TQueue *queue;
+	TQueueSubscription *subscription;
+	void *value;
+	void *msg;
+	int status;
+	std::coroutine_handle<> handle;
+};
+
+class PutAwaiter {
+public:
+	PutAwaiter(TQueue * queue, void *msg) noexcept
+	: waiter {&PutAwaiter::wake, nullptr, nullptr}, queue(queue), msg(msg),
+		status(0) {
+	}
+
+	bool await_ready() const noexcept {
+		return false;
+	}
+
+	bool await_suspend(std::coroutine_handle<> handle) noexcept {
+		int rc;
+
+		this->handle = handle;
+		rc = TQueuePutAsync(queue, msg, &waiter);
+		if (rc == -4)
+			return true;
+		status = rc;
+		return false;
+	}
+
+	// 0 on success, -1 if the queue has been destroyed and -3 if it uses
+	// the lock-free engine
+	int await_resume() const noexcept {
+		return status;
+	}
+
+private:
+	// another publisher may have taken the slot
+	static void wake(TQueueWaiter * waiter) noexcept {
+		PutAwaiter *self = reinterpret_cast<PutAwaiter *>(waiter);
+		int rc = TQueuePutAsync(self->queue, self->msg, &self->waiter);
+
+		if (rc == -4)
+			return;
+		self->status = rc;
+		self->handle.resume();
+	}
+
+	TQueueWaiter waiter;
+	TQueue *queue;
+	void *msg;
+	int status;
+	std::coroutine_handle<> handle;
+};
+
+// co_await get(queue, subscription) reads the next message of the
+// subscriber, suspending until there is one
+inline GetAwaiter get(TQueue & queue, TQueueSubscription * subscription) {
+	return GetAwaiter(&queue, subscription, nullptr);
+}
+
+// the same for typed queues, the value is copied to the buffer value
+inline GetAwaiter get_value(TQueue & queue,
+							TQueueSubscription * subscription, void *value) {
+	return GetAwaiter(&queue, subscription, value);
+}
+
+// co_await put(queue, msg) puts the message, or copies the value msg
+// points to on typed queues, suspending while the queue is full
+inline PutAwaiter put(TQueue & queue, void *msg) {
+	return PutAwaiter(&queue, msg);
+}
+
+// a queue of at most Capacity objects of type T stored in its own slots,
+// put() and emplace() construct them there and get() assigns them to the
+// caller's object, moving them out for the last subscriber to read them
+// and copying them for the others; a T which cannot be copied, such as
+// std::unique_ptr, can only have one subscriber at a time, subscribing
+// another one fails with -2 (or nullptr); the functions return what the
+// C functions they call do, the operations run with the mutex held so T's
+// copy and move must not throw; the constructor throws std::bad_alloc if
+// the slots cannot be allocated
+template <class T, unsigned Capacity>
+class Queue {
+	static_assert(Capacity > 0 && Capacity <= 0x7fffffff,
+				  "Capacity has to fit in the size of the queue");
+	static_assert(alignof(T) <= alignof(std::max_align_t),
+				  "the slots are only aligned as malloc aligns them");
+	static_assert(std::is_nothrow_move_constructible_v<T>
+				  && std::is_move_assignable_v<T>,
+				  "values are moved between slots and assigned to readers");
+
+public:
+	Queue() {
+		int size = Capacity;
+		int elem_size = sizeof(T);
+
+		// the destructor does not run for a queue which was not created
+		if (TQueueCreateQueueValues(&queue, &size, &elem_size, &ops))
+			throw std::bad_alloc();
+	}
+
+	~Queue() {
+		TQueueDestroyQueue(&queue);
+	}
+
+	Queue(const Queue &) = delete;
+	Queue &operator=(const Queue &) = delete;
+
+	// the underlying queue, for the C functions and the awaitables,
+	// subscribing on it directly is not limited to one subscriber for
+	// a T which cannot be copied
+	TQueue &c_queue() noexcept {
+		return queue;
+	}
+
+	int subscribe(pthread_t * thread) {
+		int ret;
+
+		if (!claim_reader())
+			return -2;
+		ret = TQueueSubscribe(&queue, thread);
+		if (ret)
+			release_reader();
+		return ret;
+	}
+
+	TQueueSubscription *subscribe() {
+		TQueueSubscription *subscription;
+
+		if (!claim_reader())
+			return nullptr;
+		subscription = TQueueSubscribeHandle(&queue);
+		if (subscription == nullptr)
+			release_reader();
+		return subscription;
+	}
+
+	int unsubscribe(pthread_t * thread) {
+		int ret = TQueueUnsubscribe(&queue, thread);
+
+		if (!ret)
+			release_reader();
+		return ret;
+	}
+
+	int unsubscribe(TQueueSubscription * subscription) {
+		int ret = TQueueUnsubscribeHandle(&queue, subscription);
+
+		if (!ret)
+			release_reader();
+		return ret;
+	}
+
+	int put(const T & value) {
+		return emplace(value);
+	}
+
+	int put(T && value) {
+		return emplace(std::move(value));
+	}
+
+	// constructs T from args in a slot once there is room for it
+	template <class... Args>
+	int emplace(Args &&... args) {
+		Source<Args...> source(std::forward<Args>(args)...);
+		return TQueuePut(&queue, &source);
+	}
+
+	template <class... Args>
+	int try_emplace(Args &&... args) {
+		Source<Args...> source(std::forward<Args>(args)...);
+		return TQueueTryPut(&queue, &source);
+	}
+
+	// stores the sequence number of the message in ticket for remove()
+	int put_ticket(T && value, unsigned long long &ticket) {
+		Source<T &&> source(std::move(value));
+		return TQueuePutTicket(&queue, &source, &ticket);
+	}
+
+	int get(pthread_t * thread, T & value) {
+		return TQueueGetValue(&queue, thread, &value);
+	}
+
+	int get(TQueueSubscription * subscription, T & value) {
+		return TQueueGetValueHandle(&queue, subscription, &value);
+	}
+
+	int try_get(pthread_t * thread, T & value) {
+		return TQueueTryGet(&queue, thread, reinterpret_cast<void **>(&value));
+	}
+
+	int try_get(TQueueSubscription * subscription, T & value) {
+		return TQueueTryGetHandle(&queue, subscription,
+								  reinterpret_cast<void **>(&value));
+	}
+
+	int available(pthread_t * thread) {
+		return TQueueGetAvailable(&queue, thread);
+	}
+
+	int available(TQueueSubscription * subscription) {
+		return TQueueGetAvailableHandle(&queue, subscription);
+	}
+
+	int remove(unsigned long long ticket) {
+		return TQueueRemoveTicket(&queue, ticket);
+	}
+
+	// removes the oldest value equal to value
+	int remove(const T & value) requires std::equality_comparable<T> {
+		return TQueueRemoveMsg(&queue, const_cast<T *>(&value));
+	}
+
+private:
+	// what a put passes as its message, it constructs the value in the
+	// slot from the arguments it refers to
+	struct SourceBase {
+		void (*construct)(SourceBase * source, void *slot);
+	};
+
+	template <class... Args>
+	struct Source : SourceBase {
+		explicit Source(Args &&... args) noexcept
+		: SourceBase {&Source::build}, args(std::forward<Args>(args)...) {
+		}
+
+		static void build(SourceBase * base, void *slot) noexcept {
+			Source *source = static_cast<Source *>(base);
+			std::apply([slot](Args &&... args) {
+						   ::new (slot) T(std::forward<Args>(args)...);
+					   }, std::move(source->args));
+		}
+
+		std::tuple<Args &&...> args;
+	};
+
+	// a value which cannot be copied can only be read by one subscriber
+	bool claim_reader() noexcept {
+		if constexpr (std::is_copy_assignable_v<T>)
+			return true;
+		else
+			return !reader.exchange(true);
+	}
+
+	void release_reader() noexcept {
+		if constexpr (!std::is_copy_assignable_v<T>)
+			reader.store(false);
+	}
+
+	static T *value(void *slot) noexcept {
+		return std::launder(static_cast<T *>(slot));
+	}
+
+	static void put_value(void *slot, void *msg) noexcept {
+		SourceBase *source = static_cast<SourceBase *>(msg);
+		source->construct(source, slot);
+	}
+
+	static void get_value(void *msg, void *slot, int last) noexcept {
+		if constexpr (std::is_copy_assignable_v<T>) {
+			if (!last) {
+				*static_cast<T *>(msg) = *value(slot);
+				return;
+			}
+		}
+		// with a single subscriber every read is the last one, more can
+		// only subscribe through c_queue(), the first of them takes it
+		*static_cast<T *>(msg) = std::move(*value(slot));
+	}
+
+	static void move_value(void *to, void *from) noexcept {
+		::new (to) T(std::move(*value(from)));
+		value(from)->~T();
+	}
+
+	static void destroy_value(void *slot) noexcept {
+		value(slot)->~T();
+	}
+
+	static int match_value(void *slot, void *msg) noexcept {
+		if constexpr (std::equality_comparable<T>)
+			return *value(slot) == *static_cast<T *>(msg);
+		else
+			return 0;
+	}
+
+	static constexpr TQueueValueOps ops {
+		&Queue::put_value, &Queue::get_value, &Queue::move_value,
+		&Queue::destroy_value, &Queue::match_value
+	};
+
+	TQueue queue;
+	std::atomic<bool> reader {false};
+};
+
+}
+
+#endif